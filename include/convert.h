@@ -0,0 +1,121 @@
+/*
+ * MSi2500 sample unpacking kernels
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CONVERT_H
+#define __CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mirisdr.h"
+#include "iqcorr.h"
+
+/*
+ * Layout of a 1024 byte block as sent by the MSi2500:
+ *
+ *   16 byte header (address counter in bytes 1..3)
+ *    6 sub-blocks, each 16 * 10 bytes of packed 10 bit samples
+ *                  followed by a 32 bit scale flag word
+ *   24 byte padding
+ */
+#define MIRISDR_BLOCK_LEN		1024
+#define MIRISDR_BLOCK_HDR_LEN		16
+#define MIRISDR_SUBBLOCKS		6
+#define MIRISDR_SUBBLOCK_LEN		160
+#define MIRISDR_SUBBLOCK_FLAG_LEN	4
+#define MIRISDR_SUBBLOCK_SAMPLES	128
+#define MIRISDR_BLOCK_SAMPLES		(MIRISDR_SUBBLOCKS * MIRISDR_SUBBLOCK_SAMPLES)
+
+/*
+ * Unpack one sub-block into 128 int16 values (64 I/Q pairs).
+ *
+ * Every 10 bytes carry 8 samples, two bits of flags select the scale of
+ * those 8 samples: 0 -> >> 2, 1 -> >> 1, 2/3 -> unscaled.
+ *
+ * SIMD kernels may read up to 6 bytes past the sub-block, which is always
+ * covered by the flag word and the block padding.
+ */
+typedef void (*mirisdr_unpack_fn_t)(const uint8_t *ip, int16_t *op, uint32_t flags);
+
+/*
+ * Scale flags of a sub-block as passed to the unpack kernels. The flag word
+ * follows the samples, but it is not applied: every sample is shifted right
+ * by 2, as the driver always did. Unpacked samples are therefore 10 bit
+ * values in the upper bits of 14, full scale of CS16 is +-8192 and the other
+ * formats are scaled to that.
+ */
+static inline uint32_t mirisdr_subblock_flags(const uint8_t *ip)
+{
+	return 0;
+}
+
+#define MIRISDR_CS16_FULL_SCALE	8192
+#define MIRISDR_CF32_SCALE	(1.0f / MIRISDR_CS16_FULL_SCALE)
+#define MIRISDR_CU8_SHIFT	6	/* CS16 full scale to +-128 */
+
+typedef struct mirisdr_unpack_kernel {
+	const char *name;
+	mirisdr_unpack_fn_t unpack;
+	int (*supported)(void);
+} mirisdr_unpack_kernel_t;
+
+/* all compiled in kernels, terminated by an entry with name == NULL */
+extern const mirisdr_unpack_kernel_t mirisdr_unpack_kernels[];
+
+/*
+ * Select the fastest kernel supported by the running CPU. The choice may be
+ * overridden by setting MIRISDR_KERNEL to a kernel name.
+ */
+const mirisdr_unpack_kernel_t *mirisdr_unpack_select(void);
+
+/*
+ * Convert the 128 unpacked values of one sub-block to an output format.
+ * pos is the index of the first complex sample in the output buffer, plane
+ * the number of complex samples in the buffer, which is where the Q plane
+ * of planar formats starts.
+ */
+typedef void (*mirisdr_store_fn_t)(const int16_t *sp, void *out,
+				   uint32_t pos, uint32_t plane);
+
+typedef struct mirisdr_format_desc {
+	mirisdr_format_t format;
+	const char *name;
+	size_t sample_size;		/* bytes per complex sample, 0: raw blocks */
+	int planar;
+	uint8_t zero;			/* byte value of a zero sample */
+	mirisdr_store_fn_t store;	/* NULL: unpack straight into output */
+} mirisdr_format_desc_t;
+
+/* NULL for unknown formats */
+const mirisdr_format_desc_t *mirisdr_format_desc(mirisdr_format_t format);
+
+/*
+ * Convert nblocks consecutive blocks, starting at complex sample pos of the
+ * output buffer. plane is the number of complex samples in the whole output
+ * buffer and only used by planar formats. Headers are skipped, checking
+ * them is up to the caller. corr, if not NULL, corrects every sub-block
+ * between unpacking and storing.
+ *
+ * Returns the number of complex samples written.
+ */
+uint32_t mirisdr_convert_blocks(mirisdr_unpack_fn_t unpack,
+				const mirisdr_format_desc_t *format,
+				mirisdr_iqcorr_t *corr,
+				const uint8_t *ip, void *out, uint32_t pos,
+				uint32_t plane, uint32_t nblocks);
+
+#endif
@@ -0,0 +1,63 @@
+/*
+ * Decimation of the sample stream
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DECIMATE_H
+#define __DECIMATE_H
+
+#include <stdint.h>
+
+#include "convert.h"
+
+/*
+ * A cascade of halfband decimators followed by a polyphase resampler for
+ * the remaining ratio between 1 and 2. Sub-blocks are unpacked and fed
+ * through the filters one at a time, so there is no buffer at the input
+ * rate. The output of a call is collected at the output rate and stored
+ * in the output format at the end, which is where planar formats learn
+ * the size of their planes.
+ */
+
+/* output samples a call may produce on top of in * out_rate / in_rate */
+#define MIRISDR_DECIM_SLACK	64
+
+typedef struct mirisdr_decim mirisdr_decim_t;
+
+/* max_in is the largest number of complex input samples of one call */
+mirisdr_decim_t *mirisdr_decim_create(uint32_t in_rate, uint32_t out_rate,
+				      uint32_t max_in);
+void mirisdr_decim_free(mirisdr_decim_t *d);
+
+/* forget the filter history, after samples were skipped */
+void mirisdr_decim_reset(mirisdr_decim_t *d);
+
+/*
+ * Decimate nblocks blocks, each given by its own pointer, corrected by corr
+ * unless it is NULL. Returns the number of complex samples written to out,
+ * which may be 0.
+ */
+uint32_t mirisdr_decim_blocks(mirisdr_decim_t *d, mirisdr_unpack_fn_t unpack,
+			      const mirisdr_format_desc_t *format,
+			      mirisdr_iqcorr_t *corr,
+			      unsigned char *const *blocks, uint32_t nblocks,
+			      void *out);
+
+/* the same for n zero input samples */
+uint32_t mirisdr_decim_zeros(mirisdr_decim_t *d,
+			     const mirisdr_format_desc_t *format, uint32_t n,
+			     void *out);
+
+#endif
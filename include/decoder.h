@@ -0,0 +1,50 @@
+/*
+ * Decoder of MSi2500 blocks
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DECODER_H
+#define __DECODER_H
+
+#include <stdint.h>
+
+#include "convert.h"
+
+/*
+ * The device embeds its decoder and checks the headers of a transfer
+ * before it splits the blocks into runs, so the converting part takes
+ * blocks whose headers are already checked.
+ */
+struct mirisdr_decoder {
+	mirisdr_unpack_fn_t unpack;
+	const mirisdr_format_desc_t *format;
+	uint32_t addr; /* expected address of the next block */
+	int addr_valid;
+	int headerflag;
+};
+
+/* 0 on success, -1 on an unknown format */
+int mirisdr_decoder_init(mirisdr_decoder_t *dec, mirisdr_format_t format);
+
+/*
+ * Convert nblocks consecutive blocks, like mirisdr_convert_blocks() in the
+ * format of the decoder, RAW blocks are copied. Returns the number of
+ * complex samples written.
+ */
+uint32_t mirisdr_decoder_convert(mirisdr_decoder_t *dec, mirisdr_iqcorr_t *corr,
+				 const uint8_t *ip, void *out, uint32_t pos,
+				 uint32_t plane, uint32_t nblocks);
+
+#endif
@@ -0,0 +1,63 @@
+/*
+ * DC offset and IQ imbalance correction
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __IQCORR_H
+#define __IQCORR_H
+
+#include <stdint.h>
+
+/*
+ * The MSi001 runs zero-IF, its LO leaks into the baseband as DC and the
+ * I and Q paths differ slightly in gain and phase, which shows as an image.
+ *
+ * Unpacked sub-blocks are corrected in place, with the coefficients of the
+ * previous block, while their moments are summed up. Once per block the
+ * moments are folded into running averages and new coefficients are
+ * derived: the mean is removed, Q is replaced by the combination a*I + b*Q
+ * that is orthogonal to I and carries the same power.
+ */
+
+#define MIRISDR_IQCORR_SHIFT	6	/* averages over about 2^6 blocks */
+
+typedef struct mirisdr_iqcorr {
+	int flags;			/* MIRISDR_CORR_*, 0: untouched */
+
+	/* coefficients in use, a and b are Q14 */
+	int32_t dc_i, dc_q;
+	int32_t a, b;
+
+	/* moments of the current block, of the samples >> 4 */
+	int64_t si, sq, sii, sqq, siq;
+	uint32_t n;
+
+	/* running averages, in int16 units */
+	int primed;
+	double mi, mq, mii, mqq, miq;
+} mirisdr_iqcorr_t;
+
+void mirisdr_iqcorr_init(mirisdr_iqcorr_t *c, int flags);
+
+/* forget the estimates, after a retune or when streaming starts */
+void mirisdr_iqcorr_reset(mirisdr_iqcorr_t *c);
+
+/* correct n complex samples in place and account for them */
+void mirisdr_iqcorr_apply(mirisdr_iqcorr_t *c, int16_t *s, uint32_t n);
+
+/* end of a block, derive the coefficients for the next one */
+void mirisdr_iqcorr_update(mirisdr_iqcorr_t *c);
+
+#endif
@@ -27,6 +27,7 @@ extern "C" {
 #include <mirisdr_export.h>
 
 typedef struct mirisdr_dev mirisdr_dev_t;
+typedef struct mirisdr_context mirisdr_context_t;
 
 MIRISDR_API uint32_t mirisdr_get_device_count(void);
 
@@ -48,10 +49,168 @@ MIRISDR_API int mirisdr_get_device_usb_strings(uint32_t index,
 					       char *product,
 					       char *serial);
 
+/*!
+ * Get the device index of a serial number.
+ *
+ * The device list is kept up to date as devices come and go and the USB
+ * strings are read only once per device, so this is cheap to call again.
+ *
+ * \param serial serial number of the device
+ * \return device index, -1 if serial is NULL, -2 if there are no devices,
+ *	    -3 if no device has that serial number
+ */
+MIRISDR_API int mirisdr_get_index_by_serial(const char *serial);
+
 MIRISDR_API int mirisdr_open(mirisdr_dev_t **dev, uint32_t index);
 
+/*!
+ * Open the device with the given serial number.
+ *
+ * \param dev the device handle
+ * \param serial serial number of the device
+ * \return 0 on success, the errors of mirisdr_get_index_by_serial() or
+ *	    mirisdr_open()
+ */
+MIRISDR_API int mirisdr_open_by_serial(mirisdr_dev_t **dev,
+				       const char *serial);
+
+#define MIRISDR_REPLAY_REALTIME	(1 << 0)	/* pace at the sample rate, not as fast as possible */
+#define MIRISDR_REPLAY_LOOP	(1 << 1)	/* start over at the end of the file */
+
+/*!
+ * Open a capture file instead of a device. The file holds the raw stream
+ * of 1024 byte blocks as sent by the MSi2500, it is fed through the whole
+ * library like data from the USB bus, which allows testing and profiling
+ * without hardware. Streaming ends at the end of the file. A leading
+ * mirisdr_raw_header_t, as written for MIRISDR_FORMAT_RAW captures, is
+ * skipped. The capture has no status of the USB packets, all of them are
+ * replayed as received in full, and losses only as gaps in the blocks.
+ *
+ * mirisdr_open() does the same when MIRISDR_REPLAY names a file, with
+ * MIRISDR_REPLAY_REGS, MIRISDR_REPLAY_PACE=realtime and MIRISDR_REPLAY_LOOP
+ * taking the place of the other arguments.
+ *
+ * \param dev the device handle
+ * \param path capture file
+ * \param reg_log file the register writes are logged to, may be NULL
+ * \param flags MIRISDR_REPLAY_* flags
+ * \return 0 on success
+ */
+MIRISDR_API int mirisdr_open_replay(mirisdr_dev_t **dev, const char *path,
+				    const char *reg_log, int flags);
+
 MIRISDR_API int mirisdr_close(mirisdr_dev_t *dev);
 
+/*!
+ * Create a context shared by several devices. Instead of a libusb context
+ * per device and a thread blocked in mirisdr_read_async() per stream, the
+ * context owns a fixed number of event threads, each serving the transfers
+ * of the devices assigned to it. Devices are spread evenly across the
+ * threads. One thread is enough for a handful of receivers, more help when
+ * the callbacks are expensive, as each thread runs its callbacks one by one.
+ *
+ * \param ctx the context handle
+ * \param threads event threads, 0 for one, at most 16
+ * \return 0 on success
+ */
+MIRISDR_API int mirisdr_context_create(mirisdr_context_t **ctx, int threads);
+
+/*!
+ * Stop the event threads and free the context.
+ *
+ * \param ctx the context handle given by mirisdr_context_create()
+ * \return 0 on success, -2 while devices are still open on it
+ */
+MIRISDR_API int mirisdr_context_destroy(mirisdr_context_t *ctx);
+
+/*!
+ * Like mirisdr_open(), but the device is served by the event threads of
+ * a shared context, see mirisdr_start_async().
+ *
+ * \param dev the device handle
+ * \param ctx the context handle given by mirisdr_context_create()
+ * \param index device index, as for mirisdr_open()
+ * \return 0 on success
+ */
+MIRISDR_API int mirisdr_open_context(mirisdr_dev_t **dev, mirisdr_context_t *ctx,
+				     uint32_t index);
+
+typedef struct mirisdr_open_req mirisdr_open_req_t;
+
+/* dev is NULL if status is negative */
+typedef void(*mirisdr_open_cb_t)(mirisdr_dev_t *dev, int status, void *ctx);
+
+/*!
+ * Open a device in the background. Bringing a device up takes a number of
+ * control transfers, opening many devices this way lets them come up at
+ * the same time instead of one after the other.
+ *
+ * The callback is called from a library thread once the device is ready
+ * or failed to open. Either way mirisdr_open_finish() must be called to
+ * release the request.
+ *
+ * \param req request handle
+ * \param ctx shared context as for mirisdr_open_context(), NULL for a
+ *	      device of its own as for mirisdr_open()
+ * \param index device index
+ * \param cb completion callback, may be NULL to poll instead
+ * \param cb_ctx user specific context to pass via the callback function
+ * \return 0 on success
+ */
+MIRISDR_API int mirisdr_open_async(mirisdr_open_req_t **req,
+				   mirisdr_context_t *ctx, uint32_t index,
+				   mirisdr_open_cb_t cb, void *cb_ctx);
+
+/*!
+ * Check whether a background open has completed, without waiting.
+ *
+ * \param req request handle given by mirisdr_open_async()
+ * \return 1 if it has, 0 if it is still running
+ */
+MIRISDR_API int mirisdr_open_done(mirisdr_open_req_t *req);
+
+/*!
+ * Wait for a background open to complete and release the request.
+ *
+ * \param req request handle given by mirisdr_open_async()
+ * \param dev the device handle, the same one passed to the callback,
+ *	      may be NULL
+ * \return the result of the open, 0 on success
+ */
+MIRISDR_API int mirisdr_open_finish(mirisdr_open_req_t *req,
+				    mirisdr_dev_t **dev);
+
+/* logging */
+
+enum mirisdr_log_level {
+	MIRISDR_LOG_NONE = 0,
+	MIRISDR_LOG_ERROR,
+	MIRISDR_LOG_WARNING,
+	MIRISDR_LOG_INFO,
+	MIRISDR_LOG_DEBUG
+};
+
+typedef void(*mirisdr_log_cb_t)(int level, const char *msg);
+
+/*!
+ * Install a log sink for all devices of this process.
+ *
+ * Messages up to and including level are passed to cb, one line without
+ * the trailing newline each. Messages above level are dropped before they
+ * are formatted, so verbose levels cost nothing unless enabled.
+ *
+ * By default errors are written to stderr. The streaming and retune paths
+ * only log at MIRISDR_LOG_DEBUG. The sink may be called from the libusb
+ * event thread and should not block.
+ *
+ * Not thread safe, install the sink before opening a device.
+ *
+ * \param level highest level to log, MIRISDR_LOG_NONE disables logging
+ * \param cb log sink, NULL for the built in stderr sink
+ * \return 0 on success
+ */
+MIRISDR_API int mirisdr_set_log_callback(int level, mirisdr_log_cb_t cb);
+
 /* configuration functions */
 
 /*!
@@ -85,6 +244,49 @@ MIRISDR_API int mirisdr_set_center_freq(mirisdr_dev_t *dev, uint32_t freq);
  */
 MIRISDR_API uint32_t mirisdr_get_center_freq(mirisdr_dev_t *dev);
 
+typedef struct mirisdr_tune_plan mirisdr_tune_plan_t;
+
+/*!
+ * Precompute the tuner registers for a list of frequencies.
+ *
+ * Applying an entry whose band matches the current one writes a single
+ * tuner register, so hopping between such frequencies costs one control
+ * transfer.
+ *
+ * \param dev the device handle given by mirisdr_open()
+ * \param freqs frequencies in Hz
+ * \param num number of frequencies
+ * \param out_plan plan to be freed with mirisdr_tune_plan_free()
+ * \return 0 on success
+ */
+MIRISDR_API int mirisdr_tune_plan_create(mirisdr_dev_t *dev,
+					 const uint32_t *freqs, uint32_t num,
+					 mirisdr_tune_plan_t **out_plan);
+
+/*!
+ * Tune to one entry of a plan.
+ *
+ * \param dev the device handle given by mirisdr_open()
+ * \param plan plan created by mirisdr_tune_plan_create()
+ * \param index entry of the plan, in the order of the frequency list
+ * \return 0 on success
+ */
+MIRISDR_API int mirisdr_tune_plan_apply(mirisdr_dev_t *dev,
+					const mirisdr_tune_plan_t *plan,
+					uint32_t index);
+
+/*!
+ * Get the LO frequency an entry of a plan actually tunes to.
+ *
+ * \param plan plan created by mirisdr_tune_plan_create()
+ * \param index entry of the plan
+ * \return 0 on error, frequency in Hz otherwise
+ */
+MIRISDR_API uint32_t mirisdr_tune_plan_lo_freq(const mirisdr_tune_plan_t *plan,
+					       uint32_t index);
+
+MIRISDR_API void mirisdr_tune_plan_free(mirisdr_tune_plan_t *plan);
+
 /*!
  * Get a list of gains supported by the tuner.
  *
@@ -130,6 +332,9 @@ MIRISDR_API int mirisdr_set_tuner_gain_mode(mirisdr_dev_t *dev, int manual);
 /*!
  * Set the sample rate for the device.
  *
+ * Rates listed by mirisdr_get_sample_rates() use precomputed register
+ * values, any other rate between 1.2 and 9.216 MHz is computed on demand.
+ *
  * \param dev the device handle given by mirisdr_open()
  * \param rate the sample rate in Hz
  * \return 0 on success
@@ -137,19 +342,248 @@ MIRISDR_API int mirisdr_set_tuner_gain_mode(mirisdr_dev_t *dev, int manual);
 MIRISDR_API int mirisdr_set_sample_rate(mirisdr_dev_t *dev, uint32_t rate);
 
 /*!
- * Get the sample rate the device is configured to.
+ * Get the sample rate the device is configured to, as produced by the
+ * synthesizer, which may be off by a few Hz from the one asked for.
  *
  * \param dev the device handle given by mirisdr_open()
  * \return 0 on error, sample rate in Hz otherwise
  */
 MIRISDR_API uint32_t mirisdr_get_sample_rate(mirisdr_dev_t *dev);
 
+/*!
+ * Get a list of sample rates with precomputed register values.
+ *
+ * NOTE: The rates argument must be preallocated by the caller. If NULL is
+ * being given instead, the number of available rates will be returned.
+ *
+ * \param dev the device handle given by mirisdr_open()
+ * \param rates array of sample rates in Hz
+ * \return <= 0 on error, number of available (returned) rates otherwise
+ */
+MIRISDR_API int mirisdr_get_sample_rates(mirisdr_dev_t *dev, uint32_t *rates);
+
+enum mirisdr_format {
+	MIRISDR_FORMAT_CS16 = 0,	/* interleaved int16 I/Q (default) */
+	MIRISDR_FORMAT_CF32,		/* interleaved float I/Q, +-1.0 full scale */
+	MIRISDR_FORMAT_CU8,		/* interleaved offset binary uint8 I/Q */
+	MIRISDR_FORMAT_CS16_PLANAR,	/* int16 I samples followed by Q samples */
+	MIRISDR_FORMAT_CF32_PLANAR,	/* float I samples followed by Q samples */
+	MIRISDR_FORMAT_RAW		/* 1024 byte blocks as sent by the MSi2500 */
+};
+
+typedef enum mirisdr_format mirisdr_format_t;
+
+/*!
+ * Set the format of the samples passed to the callback of
+ * mirisdr_read_async(). The conversion is done while unpacking, no extra
+ * pass over the samples is needed.
+ *
+ * Samples are scaled consistently across formats: the 10 bit samples of
+ * the MSi2500 come as CS16 of +-8192 full scale, CF32 divides them by
+ * 8192 to +-1.0, CU8 is them shifted right by 6 and offset by 128 (as
+ * produced by rtl_sdr). Planar buffers carry all I samples of the
+ * buffer, followed by the same number of Q samples.
+ *
+ * RAW skips the conversion and passes the blocks on as received, headers
+ * with the address counter included, 384 packed 10 bit samples in 1024
+ * bytes. Lost blocks show as jumps of the counter, they are never zero
+ * filled, and neither decimation nor IQ correction apply.
+ *
+ * May not be called while streaming.
+ *
+ * \param dev the device handle given by mirisdr_open()
+ * \param format one of the MIRISDR_FORMAT_* values
+ * \return 0 on success
+ */
+MIRISDR_API int mirisdr_set_output_format(mirisdr_dev_t *dev,
+					  mirisdr_format_t format);
+
+/*!
+ * Get the output sample format.
+ *
+ * \param dev the device handle given by mirisdr_open()
+ * \return the current format, MIRISDR_FORMAT_CS16 on error
+ */
+MIRISDR_API mirisdr_format_t mirisdr_get_output_format(mirisdr_dev_t *dev);
+
+#define MIRISDR_RAW_MAGIC	"MIRIRAW1"
+#define MIRISDR_RAW_BYTE_ORDER	0x01020304
+
+/*
+ * Header of a capture of MIRISDR_FORMAT_RAW blocks, which follow it at
+ * header_len. Fields are in the byte order of the host that wrote it, as
+ * byte_order tells. mirisdr_open_replay() skips it and paces by its rate.
+ */
+typedef struct mirisdr_raw_header {
+	char magic[8];			/* MIRISDR_RAW_MAGIC */
+	uint32_t byte_order;		/* MIRISDR_RAW_BYTE_ORDER */
+	uint32_t header_len;		/* offset of the first block */
+	uint32_t block_len;		/* bytes per block, 1024 */
+	uint32_t block_samples;		/* complex samples per block, 384 */
+	uint32_t sample_bits;		/* bits per packed sample, 10 */
+	uint32_t sample_rate;		/* Hz */
+	uint32_t center_freq;		/* Hz */
+	int32_t gain;			/* tenths of a dB, 0 for auto */
+	uint32_t reserved[2];
+	int64_t start_time;		/* us since 1970 */
+} mirisdr_raw_header_t;
+
+/*!
+ * Fill in a header for a capture of raw blocks from the current settings.
+ *
+ * \param dev the device handle given by mirisdr_open()
+ * \param hdr header to fill in, start_time is the current time
+ * \return 0 on success
+ */
+MIRISDR_API int mirisdr_get_raw_header(mirisdr_dev_t *dev,
+				       mirisdr_raw_header_t *hdr);
+
+/*
+ * Decoder of MSi2500 blocks, the same the device runs on the received
+ * blocks, for captures of MIRISDR_FORMAT_RAW or any other source of blocks.
+ * It needs no device and holds nothing but the continuity of the address
+ * counter and the selected unpack kernel, separate decoders may be used
+ * from separate threads at once.
+ */
+typedef struct mirisdr_decoder mirisdr_decoder_t;
+
+/* returned for the blocks lost when the address counter started over */
+#define MIRISDR_DECODER_RESET	-1
+
+/*!
+ * Create a decoder. The unpack kernel is selected for the running CPU,
+ * MIRISDR_KERNEL overrides the choice as for devices.
+ *
+ * \param format one of the MIRISDR_FORMAT_* values, RAW copies the blocks
+ * \return the decoder, NULL on an unknown format or out of memory
+ */
+MIRISDR_API mirisdr_decoder_t *mirisdr_decoder_create(mirisdr_format_t format);
+
+/*!
+ * Free a decoder.
+ *
+ * \param dec decoder given by mirisdr_decoder_create(), may be NULL
+ */
+MIRISDR_API void mirisdr_decoder_free(mirisdr_decoder_t *dec);
+
+/*!
+ * Forget the address counter, the next block starts a new stream and is
+ * not checked against the blocks before.
+ *
+ * \param dec decoder given by mirisdr_decoder_create()
+ */
+MIRISDR_API void mirisdr_decoder_reset(mirisdr_decoder_t *dec);
+
+/*!
+ * Check the address counter of a block against the blocks before and take
+ * it as the latest block of the stream, without decoding it. Parallel
+ * decoders pass the block in front of their part of a capture.
+ *
+ * \param dec decoder given by mirisdr_decoder_create()
+ * \param block a block of 1024 bytes
+ * \return number of blocks lost before it, MIRISDR_DECODER_RESET if the
+ *         counter started over, 0 if it follows the last block
+ */
+MIRISDR_API int32_t mirisdr_decoder_check(mirisdr_decoder_t *dec,
+					  const void *block);
+
+/*!
+ * Decode a run of contiguous blocks. Decoding stops before a block that
+ * does not follow the one before it, the next call decodes it and reports
+ * the blocks lost in front of it. Samples are scaled as set out for
+ * mirisdr_set_output_format(), planar output has the planes of the blocks
+ * decoded by this call.
+ *
+ * \param dec decoder given by mirisdr_decoder_create()
+ * \param in blocks as received, trailing bytes of a partial block are ignored
+ * \param len length of in in bytes
+ * \param out room for 384 complex samples in the output format, or 1024
+ *        bytes for RAW, for every whole block of in
+ * \param gap if not NULL, set to the blocks lost before the first block
+ *        decoded, as returned by mirisdr_decoder_check()
+ * \return number of blocks decoded, of 384 samples each, negative on error
+ */
+MIRISDR_API int mirisdr_decoder_decode(mirisdr_decoder_t *dec, const void *in,
+				       uint32_t len, void *out, int32_t *gap);
+
+/*!
+ * Decimate the samples before they are passed to the callback. A cascade
+ * of halfband filters followed by a fractional resampler brings the stream
+ * down to the given rate, the callback only sees the reduced rate. Sample
+ * indexes, dwell and settle times count samples at the output rate.
+ *
+ * The filters are set up when streaming starts, a rate that is not below
+ * the sample rate by then leaves the stream undecimated. May not be called
+ * while streaming.
+ *
+ * \param dev the device handle given by mirisdr_open()
+ * \param rate output rate in Hz, 0 to disable decimation
+ * \return 0 on success, -EINVAL if the rate is not below the sample rate
+ */
+MIRISDR_API int mirisdr_set_output_rate(mirisdr_dev_t *dev, uint32_t rate);
+
+/*!
+ * Get the rate of the samples passed to the callback.
+ *
+ * \param dev the device handle given by mirisdr_open()
+ * \return the output rate in Hz, the sample rate when not decimating
+ */
+MIRISDR_API uint32_t mirisdr_get_output_rate(mirisdr_dev_t *dev);
+
 /* streaming functions */
 
+/* positive status codes of mirisdr_read_sync() and friends */
+#define MIRISDR_SYNC_DROPPED	1	/* samples were dropped after the returned data */
+#define MIRISDR_SYNC_TIMEOUT	2	/* less data than requested arrived in time */
+
+/*!
+ * Set the size of the ring buffer between the event thread and
+ * mirisdr_read_sync(). Must be called before the first synchronous read.
+ *
+ * \param dev the device handle given by mirisdr_open()
+ * \param len ring size in bytes, 0 for the default (8 MiB)
+ * \return 0 on success
+ */
+MIRISDR_API int mirisdr_set_sync_buffer_len(mirisdr_dev_t *dev, uint32_t len);
+
+/*!
+ * Discard all samples buffered for mirisdr_read_sync(). Must be called from
+ * the reading thread.
+ *
+ * \param dev the device handle given by mirisdr_open()
+ * \return 0 on success
+ */
 MIRISDR_API int mirisdr_reset_buffer(mirisdr_dev_t *dev);
 
+/*!
+ * Read samples synchronously, blocking until len bytes are available.
+ *
+ * The first call starts streaming on a background event thread, which
+ * keeps filling a ring buffer until the device is closed. If the ring
+ * overflows, whole transfers are dropped, and so is everything after them
+ * until the reader has caught up with the drop. A read never spans such a
+ * drop: it returns the samples before it and MIRISDR_SYNC_DROPPED.
+ *
+ * Samples are in the output format, len should be a multiple of its
+ * sample size. Do not mix with mirisdr_read_async().
+ *
+ * \param dev the device handle given by mirisdr_open()
+ * \param buf buffer to read into
+ * \param len number of bytes to read
+ * \param n_read number of bytes actually read, may be NULL
+ * \return 0 on success, MIRISDR_SYNC_DROPPED, or < 0 on error
+ */
 MIRISDR_API int mirisdr_read_sync(mirisdr_dev_t *dev, void *buf, int len, int *n_read);
 
+/*!
+ * Like mirisdr_read_sync(), but gives up after timeout_ms milliseconds and
+ * returns MIRISDR_SYNC_TIMEOUT with the samples read until then.
+ *
+ * \param timeout_ms timeout in milliseconds, 0 to wait forever
+ */
+MIRISDR_API int mirisdr_read_sync_timeout(mirisdr_dev_t *dev, void *buf, int len,
+					  int *n_read, int timeout_ms);
+
 typedef void(*mirisdr_read_async_cb_t)(unsigned char *buf, uint32_t len, void *ctx);
 
 /*!
@@ -160,10 +594,12 @@ typedef void(*mirisdr_read_async_cb_t)(unsigned char *buf, uint32_t len, void *c
  * \param cb callback function to return received samples
  * \param ctx user specific context to pass via the callback function
  * \param buf_num optional buffer count, buf_num * buf_len = overall buffer size
- *		  set to 0 for default buffer count (32)
- * \param buf_len optional buffer length, must be multiple of 512,
- *		  set to 0 for default buffer length (16 * 32 * 512)
- * \return 0 on success
+ *		  set to 0 for the transfer count of the current geometry
+ * \param buf_len optional buffer length, rounded down to a multiple of the
+ *		  3072 byte iso packet size, set to 0 for the current geometry.
+ *		  Both apply to this stream only, they do not change the
+ *		  geometry set by mirisdr_set_transfer_geometry().
+ * \return 0 on success, -EINVAL if buf_len is below one iso packet
  */
 MIRISDR_API int mirisdr_read_async(mirisdr_dev_t *dev,
 				 mirisdr_read_async_cb_t cb,
@@ -171,6 +607,244 @@ MIRISDR_API int mirisdr_read_async(mirisdr_dev_t *dev,
 				 uint32_t buf_num,
 				 uint32_t buf_len);
 
+#define MIRISDR_BUF_DISCONTINUITY	(1 << 0)	/* samples are missing before this buffer */
+#define MIRISDR_BUF_ZERO_FILLED		(1 << 1)	/* zeros standing in for lost samples */
+#define MIRISDR_BUF_RETUNED		(1 << 2)	/* first buffer after a hop */
+
+typedef struct mirisdr_buffer_info {
+	uint64_t sample_index;		/* complex samples since streaming started */
+	uint32_t samples;		/* complex samples in the buffer */
+	uint32_t flags;			/* MIRISDR_BUF_* */
+	uint32_t center_freq;		/* Hz, the samples were taken at */
+} mirisdr_buffer_info_t;
+
+typedef void(*mirisdr_read_async_ex_cb_t)(unsigned char *buf, uint32_t len,
+					   const mirisdr_buffer_info_t *info,
+					   void *ctx);
+
+/*!
+ * Like mirisdr_read_async(), but every buffer comes with the index of its
+ * first sample. The index is derived from the block counter of the MSi2500
+ * and counts lost samples, so it keeps matching the sample clock of the
+ * device across dropped USB packets.
+ *
+ * A buffer never spans a gap: when blocks are lost the samples before the
+ * gap are delivered first and the next buffer has MIRISDR_BUF_DISCONTINUITY
+ * set. This also applies to the callback of mirisdr_read_async(), which may
+ * therefore be called more than once per transfer.
+ *
+ * \param dev the device handle given by mirisdr_open()
+ * \param cb callback function to return received samples
+ * \param ctx user specific context to pass via the callback function
+ * \param buf_num see mirisdr_read_async()
+ * \param buf_len see mirisdr_read_async()
+ * \return 0 on success
+ */
+MIRISDR_API int mirisdr_read_async_ex(mirisdr_dev_t *dev,
+				      mirisdr_read_async_ex_cb_t cb,
+				      void *ctx,
+				      uint32_t buf_num,
+				      uint32_t buf_len);
+
+/*!
+ * Start streaming on a device opened with mirisdr_open_context() and
+ * return right away. The callback runs on an event thread of the context,
+ * the same thread may serve other devices meanwhile, so it should not
+ * block. Statistics and buffer pools stay per device.
+ *
+ * \param dev the device handle given by mirisdr_open_context()
+ * \param cb callback function to return received samples
+ * \param ctx user specific context to pass via the callback function
+ * \param buf_num see mirisdr_read_async()
+ * \param buf_len see mirisdr_read_async()
+ * \return 0 on success, -EINVAL if the device has no shared context
+ */
+MIRISDR_API int mirisdr_start_async(mirisdr_dev_t *dev,
+				    mirisdr_read_async_ex_cb_t cb,
+				    void *ctx,
+				    uint32_t buf_num,
+				    uint32_t buf_len);
+
+/*!
+ * Stop a stream started by mirisdr_start_async() and wait until its last
+ * callback has returned. Must not be called from the callback, use
+ * mirisdr_cancel_async() there, the stream then ends in the background.
+ *
+ * \param dev the device handle given by mirisdr_open_context()
+ * \return 0 on success
+ */
+MIRISDR_API int mirisdr_stop_async(mirisdr_dev_t *dev);
+
+/*!
+ * Replace lost blocks by zero samples, so the output keeps its sample clock
+ * after a USB hiccup. The zeros are delivered in separate buffers flagged
+ * MIRISDR_BUF_ZERO_FILLED. The zeros of one transfer are limited to four
+ * output buffers, longer gaps and counter resets are not filled, they are
+ * reported as a discontinuity instead. Off by default, may not be changed while
+ * streaming.
+ *
+ * \param dev the device handle given by mirisdr_open()
+ * \param on 1 to fill gaps with zeros, 0 to skip them
+ * \return 0 on success
+ */
+MIRISDR_API int mirisdr_set_zero_fill(mirisdr_dev_t *dev, int on);
+
+#define MIRISDR_CORR_DC		(1 << 0)	/* remove the DC offset */
+#define MIRISDR_CORR_IQ		(1 << 1)	/* equalize I/Q gain and phase */
+
+/*!
+ * Correct the zero-IF artifacts of the tuner while converting the samples:
+ * the DC offset of the LO leakage and the gain and phase mismatch between
+ * I and Q that shows as an image. The estimates are running averages over
+ * the last few dozen blocks, updated with every block and started over
+ * when streaming starts and after each hop.
+ *
+ * May not be called while streaming.
+ *
+ * \param dev the device handle given by mirisdr_open()
+ * \param flags MIRISDR_CORR_* values, 0 to pass the samples untouched
+ * \return 0 on success
+ */
+MIRISDR_API int mirisdr_set_iq_correction(mirisdr_dev_t *dev, int flags);
+
+/*!
+ * Get the enabled corrections.
+ *
+ * \param dev the device handle given by mirisdr_open()
+ * \return MIRISDR_CORR_* values, 0 on error
+ */
+MIRISDR_API int mirisdr_get_iq_correction(mirisdr_dev_t *dev);
+
+typedef struct mirisdr_hop {
+	uint32_t freq;			/* Hz */
+	uint32_t dwell_us;		/* delivered at freq, whole transfers */
+	uint32_t settle_us;		/* dropped after the retune */
+} mirisdr_hop_t;
+
+/*!
+ * Step through a list of frequencies while streaming.
+ *
+ * The library retunes between transfers, after at least dwell_us worth of
+ * samples were delivered at a frequency, and wraps around at the end of
+ * the list. Samples taken while the tuner writes are in flight, the rest
+ * of the transfer completing after them and settle_us more are dropped,
+ * the sample index skips over them. Each buffer carries its frequency in
+ * mirisdr_buffer_info_t, the first one after a hop is flagged
+ * MIRISDR_BUF_RETUNED.
+ *
+ * Tuning calls while hopping is active are not supported. May not be
+ * changed while streaming.
+ *
+ * \param dev the device handle given by mirisdr_open()
+ * \param hops frequency list, copied
+ * \param num number of entries, 0 turns hopping off
+ * \return 0 on success
+ */
+MIRISDR_API int mirisdr_set_hop_list(mirisdr_dev_t *dev,
+				     const mirisdr_hop_t *hops, uint32_t num);
+
+/*!
+ * Set the number of isochronous transfers kept in flight and the number of
+ * 3072 byte iso packets per transfer. More and larger transfers ride out
+ * longer stalls of the event thread, fewer and smaller ones reduce memory
+ * use and latency. May not be called while streaming.
+ *
+ * Limits: up to 256 transfers, up to 128 packets per transfer and up to
+ * 16 MiB in total.
+ *
+ * \param dev the device handle given by mirisdr_open()
+ * \param buf_num transfer count, 0 for the default (32)
+ * \param iso_packets iso packets per transfer, 0 for the default (8)
+ * \return 0 on success, -EINVAL if the geometry is out of range
+ */
+MIRISDR_API int mirisdr_set_transfer_geometry(mirisdr_dev_t *dev,
+					      uint32_t buf_num,
+					      uint32_t iso_packets);
+
+/*!
+ * Get the transfer geometry used for streaming, while streaming the one of
+ * the running stream.
+ *
+ * \param dev the device handle given by mirisdr_open()
+ * \param buf_num transfer count, may be NULL
+ * \param iso_packets iso packets per transfer, may be NULL
+ * \param buf_len raw bytes per transfer, may be NULL
+ * \return 0 on success
+ */
+MIRISDR_API int mirisdr_get_transfer_geometry(mirisdr_dev_t *dev,
+					      uint32_t *buf_num,
+					      uint32_t *iso_packets,
+					      uint32_t *buf_len);
+
+/*!
+ * Get the size of the converted samples of one transfer, which is the most
+ * the callback of mirisdr_read_async() is handed at once.
+ *
+ * \param dev the device handle given by mirisdr_open()
+ * \return 0 on error, buffer size in bytes for the current format otherwise
+ */
+MIRISDR_API uint32_t mirisdr_get_output_buffer_len(mirisdr_dev_t *dev);
+
+/*!
+ * Let the library convert samples directly into caller owned buffers.
+ *
+ * Each buffer passed to the callback of mirisdr_read_async() is borrowed
+ * from the pool and stays with the caller until it is handed back with
+ * mirisdr_release_buffer(), so the callback does not have to copy it. When
+ * all buffers are borrowed, the samples of a transfer are dropped.
+ *
+ * May not be called while streaming. Pass NULL to go back to the internal
+ * buffer, which is only valid for the duration of the callback.
+ *
+ * \param dev the device handle given by mirisdr_open()
+ * \param bufs array of buf_num buffers, should be aligned to 32 bytes
+ * \param buf_num number of buffers
+ * \param buf_len size of each buffer, at least mirisdr_get_output_buffer_len()
+ * \return 0 on success
+ */
+MIRISDR_API int mirisdr_set_buffer_pool(mirisdr_dev_t *dev, void **bufs,
+					uint32_t buf_num, uint32_t buf_len);
+
+/*!
+ * Hand a buffer received by the callback back to the library. May be called
+ * from any thread.
+ *
+ * \param dev the device handle given by mirisdr_open()
+ * \param buf buffer as passed to the callback
+ * \return 0 on success, -1 if buf is not part of the pool
+ */
+MIRISDR_API int mirisdr_release_buffer(mirisdr_dev_t *dev, void *buf);
+
+#define MIRISDR_ISO_STATUS_NUM	8
+
+typedef struct mirisdr_stream_stats {
+	uint64_t transfers;		/* transfers completed */
+	uint64_t iso_packets;		/* iso packets received */
+	/* failed iso packets, indexed by enum libusb_transfer_status */
+	uint64_t iso_errors[MIRISDR_ISO_STATUS_NUM];
+	uint64_t short_packets;		/* packets shorter than requested */
+	uint64_t discontinuities;	/* jumps of the block address counter */
+	uint64_t samples_lost;		/* complex samples lost in total, at the output rate */
+	uint64_t overruns;		/* transfers dropped, consumer too slow */
+	uint64_t open_us;		/* time the device took to come up */
+	uint64_t first_sample_us;	/* from the start of the last stream to
+					   its first samples, 0 before */
+} mirisdr_stream_stats_t;
+
+/*!
+ * Get the streaming health counters, cumulative since mirisdr_open().
+ *
+ * The counters are updated atomically by the event thread, so this is
+ * cheap and may be polled from any thread while streaming. Counters are
+ * read one by one, not as a consistent snapshot.
+ *
+ * \param dev the device handle given by mirisdr_open()
+ * \param stats structure to fill in
+ * \return 0 on success
+ */
+MIRISDR_API int mirisdr_get_stream_stats(mirisdr_dev_t *dev,
+					 mirisdr_stream_stats_t *stats);
+
 /*!
  * Cancel all pending asynchronous operations on the device.
  *
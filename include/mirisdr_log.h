@@ -0,0 +1,28 @@
+#ifndef __LOG_H
+#define __LOG_H
+
+#include "mirisdr.h"
+
+extern int mirisdr_log_level;
+
+void mirisdr_log_msg(int level, const char *fmt, ...)
+#ifdef __GNUC__
+	__attribute__((format(printf, 2, 3)))
+#endif
+	;
+
+/* the level check is inlined, disabled messages are never formatted */
+#define mirisdr_log_enabled(level)	((level) <= mirisdr_log_level)
+
+#define mirisdr_log(level, ...) \
+	do { \
+		if (mirisdr_log_enabled(level)) \
+			mirisdr_log_msg(level, __VA_ARGS__); \
+	} while (0)
+
+#define log_err(...)	mirisdr_log(MIRISDR_LOG_ERROR, __VA_ARGS__)
+#define log_warn(...)	mirisdr_log(MIRISDR_LOG_WARNING, __VA_ARGS__)
+#define log_info(...)	mirisdr_log(MIRISDR_LOG_INFO, __VA_ARGS__)
+#define log_dbg(...)	mirisdr_log(MIRISDR_LOG_DEBUG, __VA_ARGS__)
+
+#endif
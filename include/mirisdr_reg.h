@@ -3,4 +3,8 @@
 
 int mirisdr_reg_write_fn(void *dev, uint8_t reg, uint32_t val);
 
+/* writes between begin and end are submitted together at the end */
+int mirisdr_reg_batch_begin(void *dev);
+int mirisdr_reg_batch_end(void *dev);
+
 #endif
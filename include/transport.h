@@ -0,0 +1,118 @@
+/*
+ * USB transport interface
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TRANSPORT_H
+#define __TRANSPORT_H
+
+#include <stdint.h>
+
+/*
+ * Everything the library needs from the device goes through a transport:
+ * vendor control requests and the isochronous sample stream. The libusb
+ * transport talks to a real MSi2500, the replay transport reads a capture
+ * file, so the library can be exercised without hardware.
+ */
+
+#define MIRISDR_PACKET_COMPLETED	0 /* status numbering of libusb_transfer_status */
+
+/* one isochronous packet of a completed transfer */
+typedef struct mirisdr_packet {
+	unsigned char *buf;
+	uint32_t length;
+	uint32_t actual_length;
+	int status;
+} mirisdr_packet_t;
+
+/* vendor request without data stage */
+typedef struct mirisdr_ctrl {
+	uint8_t request;
+	uint16_t value;
+	uint16_t index;
+} mirisdr_ctrl_t;
+
+/* called from handle_events() for every completed transfer */
+typedef void (*mirisdr_packets_cb_t)(void *ctx, const mirisdr_packet_t *pkts,
+				     int num);
+
+/* called from handle_events() once a submitted set of requests is done */
+typedef void (*mirisdr_ctrl_cb_t)(void *ctx, int status);
+
+typedef struct mirisdr_transport mirisdr_transport_t;
+
+typedef struct mirisdr_transport_ops {
+	const char *name;
+	void (*close)(mirisdr_transport_t *t);
+	/* select the streaming alternate setting, done after baseband init */
+	int (*activate)(mirisdr_transport_t *t);
+	/* vendor request without data stage */
+	int (*control)(mirisdr_transport_t *t, uint8_t request, uint16_t value,
+		       uint16_t index);
+	/* submit all requests at once, in order, and wait for all of them */
+	int (*control_batch)(mirisdr_transport_t *t, const mirisdr_ctrl_t *reqs,
+			     int num);
+	/* like control_batch but without waiting, safe from a packets callback */
+	int (*control_submit)(mirisdr_transport_t *t, const mirisdr_ctrl_t *reqs,
+			      int num, mirisdr_ctrl_cb_t cb, void *ctx);
+	int (*get_usb_strings)(mirisdr_transport_t *t, char *manufact,
+			       char *product, char *serial);
+	/* submit buf_num transfers of iso_packets packets each */
+	int (*stream_start)(mirisdr_transport_t *t, uint32_t buf_num,
+			    uint32_t iso_packets, uint32_t packet_len,
+			    uint32_t rate, mirisdr_packets_cb_t cb, void *ctx);
+	/* 0, -EINTR on a stray signal, other negative values are fatal */
+	int (*handle_events)(mirisdr_transport_t *t, int timeout_ms);
+	/* stop resubmitting and cancel every transfer in flight */
+	int (*stream_cancel)(mirisdr_transport_t *t);
+	/* transfers still owned by the transport, control ones included,
+	 * streaming ends at 0 */
+	uint32_t (*stream_pending)(mirisdr_transport_t *t);
+	/* release the transfers, waits for cancelled ones to come back */
+	void (*stream_free)(mirisdr_transport_t *t);
+} mirisdr_transport_ops_t;
+
+/* embedded as first member by every transport */
+struct mirisdr_transport {
+	const mirisdr_transport_ops_t *ops;
+};
+
+/* libusb transport, enumerates the known MSi2500 devices */
+uint32_t mirisdr_usb_get_device_count(void);
+const char *mirisdr_usb_get_device_name(uint32_t index);
+int mirisdr_usb_get_device_usb_strings(uint32_t index, char *manufact,
+				       char *product, char *serial);
+int mirisdr_usb_open(mirisdr_transport_t **t, uint32_t index);
+
+/*
+ * libusb contexts shared by several devices. libusb runs the callbacks of
+ * one context one at a time, so there is one context per event thread and
+ * devices are spread across them.
+ */
+typedef struct mirisdr_usb_pool mirisdr_usb_pool_t;
+
+int mirisdr_usb_pool_create(mirisdr_usb_pool_t **pool, int num);
+void mirisdr_usb_pool_destroy(mirisdr_usb_pool_t *pool);
+/* same return values as the handle_events op */
+int mirisdr_usb_pool_handle_events(mirisdr_usb_pool_t *pool, int shard,
+				   int timeout_ms);
+int mirisdr_usb_pool_open(mirisdr_transport_t **t, uint32_t index,
+			  mirisdr_usb_pool_t *pool, int shard);
+
+/* replay transport, flags are MIRISDR_REPLAY_* */
+int mirisdr_replay_open(mirisdr_transport_t **t, const char *path,
+			const char *reg_log, int flags);
+
+#endif
@@ -19,7 +19,9 @@
 
 #include <stdint.h>
 
-#define c(v) ((v<0)?printf("err! %s %s:%i\n", #v, __FILE__, __LINE__):0)
+#include "mirisdr_log.h"
+
+#define c(v) do { if ((v) < 0) mirisdr_log(MIRISDR_LOG_ERROR, "err! %s %s:%i", #v, __FILE__, __LINE__); } while (0)
 #define MHZ(x)	((x)*1000*1000)
 #define KHZ(x)	((x)*1000)
 
@@ -49,9 +51,10 @@ enum am_mixgainred{
 };
 
 struct state{
+	int valid; /* m, x and reg[] reflect the hardware */
 	enum mode m;
 	enum xtal x;
-	double freq_hz;
+	uint32_t freq_hz;
 	uint32_t minus_bbgain;
 	enum am_mixgainred am_mixgainred;
 	uint32_t mixl;
@@ -72,7 +75,23 @@ struct iffreqs_{
 	uint32_t fif1;
 };
 
-int msi001_init(void *dev, uint32_t freq);
+/* register values for one frequency */
+struct msi001_plan{
+	uint32_t freq_hz;
+	uint32_t lo_hz; /* what the synthesizer actually produces */
+	enum mode m;
+	enum xtal x;
+	uint32_t reg0;
+	uint32_t reg5;
+	uint32_t reg2;
+};
+
+/* forget the hardware state, the next tune writes every register */
+void msi001_reset(struct state *s);
+int msi001_plan(const struct state *s, uint32_t freq, struct msi001_plan *p);
+/* only reg 2 is written when band and crystal are unchanged */
+int msi001_apply(void *dev, struct state *s, const struct msi001_plan *p);
+int msi001_tune(void *dev, struct state *s, uint32_t freq);
 
 //######
 #define R0_FIL_MODE_SH 12
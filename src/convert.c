@@ -0,0 +1,295 @@
+/*
+ * MSi2500 sample unpacking kernels
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "convert.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/* reference implementation, every other kernel must match it bit by bit */
+static void unpack_scalar(const uint8_t *ip, int16_t *op, uint32_t flags)
+{
+	int i, j;
+	int16_t *sp = op;
+
+	for (j = 0; j < 16; j++) {
+		for (i = 0; i < 10; i += 5) {
+			*op++ = (ip[i+0] << 6) | ((ip[i+1] & 0x03) << 14);
+			*op++ = ((ip[i+1] & 0xfc) << 4) | ((ip[i+2] & 0x0f) << 12);
+			*op++ = ((ip[i+2] & 0xf0) << 2) | ((ip[i+3] & 0x3f) << 10);
+			*op++ = (ip[i+3] & 0xc0) | (ip[i+4] << 8);
+		}
+		/* 10 bytes per 8 samples */
+		ip += 10;
+	}
+
+	for (j = 0; j < 16; j++, sp += 8) {
+		switch (flags & 0x03) {
+		case 0:
+			for (i = 0; i < 8; i++)
+				sp[i] >>= 2;
+			break;
+		case 1:
+			for (i = 0; i < 8; i++)
+				sp[i] >>= 1;
+			break;
+		case 2:
+		case 3:
+			break;
+		}
+		flags >>= 2;
+	}
+}
+
+static int supported_always(void)
+{
+	return 1;
+}
+
+#ifdef HAVE_X86_KERNELS
+/*
+ * Sample k of a 10 byte group starts at bit 10 * k, so a byte shuffle moves
+ * the two bytes holding it into 16 bit lane k. A multiply by 64, 16, 4 or 1
+ * then left aligns the 10 bit value, the mask drops the neighbouring bits.
+ *
+ * Scaling is done as an arithmetic shift by 2 followed by a multiply with
+ * 1, 2 or 4, which is identical to shifting by 2, 1 or 0 but allows a
+ * different scale per lane.
+ */
+static const int16_t scale_mul[4] = { 1, 2, 4, 4 };
+
+static int supported_ssse3(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("ssse3");
+}
+
+__attribute__((target("ssse3")))
+static void unpack_ssse3(const uint8_t *ip, int16_t *op, uint32_t flags)
+{
+	const __m128i shuf = _mm_setr_epi8(0, 1, 1, 2, 2, 3, 3, 4,
+					   5, 6, 6, 7, 7, 8, 8, 9);
+	const __m128i align = _mm_setr_epi16(64, 16, 4, 1, 64, 16, 4, 1);
+	const __m128i mask = _mm_set1_epi16((int16_t)0xffc0);
+	__m128i v;
+	int j;
+
+	for (j = 0; j < 16; j++) {
+		v = _mm_loadu_si128((const __m128i *)ip);
+		v = _mm_shuffle_epi8(v, shuf);
+		v = _mm_and_si128(_mm_mullo_epi16(v, align), mask);
+		v = _mm_srai_epi16(v, 2);
+		v = _mm_mullo_epi16(v, _mm_set1_epi16(scale_mul[flags & 0x03]));
+		_mm_storeu_si128((__m128i *)op, v);
+
+		flags >>= 2;
+		ip += 10;
+		op += 8;
+	}
+}
+
+static int supported_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2")))
+static void unpack_avx2(const uint8_t *ip, int16_t *op, uint32_t flags)
+{
+	const __m256i shuf = _mm256_setr_epi8(0, 1, 1, 2, 2, 3, 3, 4,
+					      5, 6, 6, 7, 7, 8, 8, 9,
+					      0, 1, 1, 2, 2, 3, 3, 4,
+					      5, 6, 6, 7, 7, 8, 8, 9);
+	const __m256i align = _mm256_setr_epi16(64, 16, 4, 1, 64, 16, 4, 1,
+						64, 16, 4, 1, 64, 16, 4, 1);
+	const __m256i mask = _mm256_set1_epi16((int16_t)0xffc0);
+	__m256i v, s;
+	int j;
+
+	/* two 10 byte groups per iteration, one in each 128 bit lane */
+	for (j = 0; j < 16; j += 2) {
+		v = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)ip));
+		v = _mm256_inserti128_si256(v, _mm_loadu_si128((const __m128i *)(ip + 10)), 1);
+		s = _mm256_castsi128_si256(_mm_set1_epi16(scale_mul[flags & 0x03]));
+		s = _mm256_inserti128_si256(s, _mm_set1_epi16(scale_mul[(flags >> 2) & 0x03]), 1);
+
+		v = _mm256_shuffle_epi8(v, shuf);
+		v = _mm256_and_si256(_mm256_mullo_epi16(v, align), mask);
+		v = _mm256_srai_epi16(v, 2);
+		v = _mm256_mullo_epi16(v, s);
+		_mm256_storeu_si256((__m256i *)op, v);
+
+		flags >>= 4;
+		ip += 20;
+		op += 16;
+	}
+}
+#endif
+
+/* ordered from the most to the least preferred kernel */
+const mirisdr_unpack_kernel_t mirisdr_unpack_kernels[] = {
+#ifdef HAVE_X86_KERNELS
+	{ "avx2", unpack_avx2, supported_avx2 },
+	{ "ssse3", unpack_ssse3, supported_ssse3 },
+#endif
+	{ "scalar", unpack_scalar, supported_always },
+	{ NULL, NULL, NULL }
+};
+
+const mirisdr_unpack_kernel_t *mirisdr_unpack_select(void)
+{
+	const mirisdr_unpack_kernel_t *k;
+	const char *name = getenv("MIRISDR_KERNEL");
+
+	if (name) {
+		for (k = mirisdr_unpack_kernels; k->name; k++) {
+			if (!strcmp(k->name, name) && k->supported())
+				return k;
+		}
+	}
+
+	for (k = mirisdr_unpack_kernels; k->name; k++) {
+		if (k->supported())
+			return k;
+	}
+
+	/* not reached, the scalar kernel is always supported */
+	return NULL;
+}
+
+/*
+ * Output stores, plain loops over one sub-block which the compiler is able
+ * to vectorize. The block scale is already applied by the unpack kernel.
+ */
+
+static void store_cf32(const int16_t *sp, void *out, uint32_t pos, uint32_t plane)
+{
+	float *op = (float *)out + 2 * pos;
+	int i;
+
+	for (i = 0; i < MIRISDR_SUBBLOCK_SAMPLES; i++)
+		op[i] = sp[i] * MIRISDR_CF32_SCALE;
+}
+
+static void store_cu8(const int16_t *sp, void *out, uint32_t pos, uint32_t plane)
+{
+	uint8_t *op = (uint8_t *)out + 2 * pos;
+	int i;
+
+	int v;
+
+	/* corrected samples may go past full scale */
+	for (i = 0; i < MIRISDR_SUBBLOCK_SAMPLES; i++) {
+		v = (sp[i] >> MIRISDR_CU8_SHIFT) + 128;
+		op[i] = v > 255 ? 255 : (v < 0 ? 0 : v);
+	}
+}
+
+static void store_cs16_planar(const int16_t *sp, void *out, uint32_t pos, uint32_t plane)
+{
+	int16_t *ip = (int16_t *)out + pos;
+	int16_t *qp = ip + plane;
+	int i;
+
+	for (i = 0; i < MIRISDR_SUBBLOCK_SAMPLES / 2; i++) {
+		ip[i] = sp[2 * i];
+		qp[i] = sp[2 * i + 1];
+	}
+}
+
+static void store_cf32_planar(const int16_t *sp, void *out, uint32_t pos, uint32_t plane)
+{
+	float *ip = (float *)out + pos;
+	float *qp = ip + plane;
+	int i;
+
+	for (i = 0; i < MIRISDR_SUBBLOCK_SAMPLES / 2; i++) {
+		ip[i] = sp[2 * i] * MIRISDR_CF32_SCALE;
+		qp[i] = sp[2 * i + 1] * MIRISDR_CF32_SCALE;
+	}
+}
+
+static const mirisdr_format_desc_t formats[] = {
+	{ MIRISDR_FORMAT_CS16, "cs16", 2 * sizeof(int16_t), 0, 0, NULL },
+	{ MIRISDR_FORMAT_CF32, "cf32", 2 * sizeof(float), 0, 0, store_cf32 },
+	{ MIRISDR_FORMAT_CU8, "cu8", 2 * sizeof(uint8_t), 0, 128, store_cu8 },
+	{ MIRISDR_FORMAT_CS16_PLANAR, "cs16p", 2 * sizeof(int16_t), 1, 0, store_cs16_planar },
+	{ MIRISDR_FORMAT_CF32_PLANAR, "cf32p", 2 * sizeof(float), 1, 0, store_cf32_planar },
+	/* blocks are copied as they are, not converted */
+	{ MIRISDR_FORMAT_RAW, "raw", 0, 0, 0, NULL }
+};
+
+const mirisdr_format_desc_t *mirisdr_format_desc(mirisdr_format_t format)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		if (formats[i].format == format)
+			return &formats[i];
+	}
+
+	return NULL;
+}
+
+uint32_t mirisdr_convert_blocks(mirisdr_unpack_fn_t unpack,
+				const mirisdr_format_desc_t *format,
+				mirisdr_iqcorr_t *corr,
+				const uint8_t *ip, void *out, uint32_t pos,
+				uint32_t plane, uint32_t nblocks)
+{
+	int k;
+	uint32_t start = pos;
+	int16_t tmp[MIRISDR_SUBBLOCK_SAMPLES];
+
+	while (nblocks--) {
+		/* skip header */
+		ip += MIRISDR_BLOCK_HDR_LEN;
+
+		k = MIRISDR_SUBBLOCKS;
+		while (k--) {
+			uint32_t flag = mirisdr_subblock_flags(ip);
+
+			if (format->store) {
+				unpack(ip, tmp, flag);
+				if (corr)
+					mirisdr_iqcorr_apply(corr, tmp, MIRISDR_SUBBLOCK_SAMPLES / 2);
+				format->store(tmp, out, pos, plane);
+			} else {
+				unpack(ip, (int16_t *)out + 2 * pos, flag);
+				if (corr)
+					mirisdr_iqcorr_apply(corr, (int16_t *)out + 2 * pos,
+							     MIRISDR_SUBBLOCK_SAMPLES / 2);
+			}
+			pos += MIRISDR_SUBBLOCK_SAMPLES / 2;
+
+			/* packed samples + flagbytes */
+			ip += MIRISDR_SUBBLOCK_LEN + MIRISDR_SUBBLOCK_FLAG_LEN;
+		}
+		ip += 24;
+
+		if (corr)
+			mirisdr_iqcorr_update(corr);
+	}
+
+	return pos - start;
+}
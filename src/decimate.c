@@ -0,0 +1,446 @@
+/*
+ * Decimation of the sample stream
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "decimate.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define DECIM_CHUNK	(MIRISDR_SUBBLOCK_SAMPLES / 2) /* complex samples per push */
+
+#define HB_K		8	/* 4 * HB_K - 1 taps */
+#define HB_K_LAST	16	/* sharper last stage when no resampler follows */
+#define HB_MAX_STAGES	10
+
+#define RS_PHASES_SH	6
+#define RS_PHASES	(1 << RS_PHASES_SH)
+#define RS_TAPS		64
+#define RS_CUTOFF	0.45	/* of the output rate */
+
+/*
+ * Halfband filter of 4k - 1 taps in polyphase form: the odd phase only
+ * meets the center tap, the even phase the 2k other non zero taps. The
+ * even samples are kept in their own array so the inner loop is a plain
+ * multiply-add over interleaved I/Q, which the compiler vectorizes.
+ */
+typedef struct hb_stage {
+	float g[2 * HB_K_LAST];
+	int k;
+	int phase;		/* the next input sample is odd */
+	uint32_t ne, no;	/* complex samples in e and o */
+	float e[2 * (2 * HB_K_LAST + DECIM_CHUNK)];
+	float o[2 * (HB_K_LAST + DECIM_CHUNK)];
+} hb_stage_t;
+
+/*
+ * Windowed sinc interpolator, RS_PHASES + 1 phases so every fractional
+ * position is interpolated linearly between two neighbouring phases.
+ */
+typedef struct resampler {
+	float h[(RS_PHASES + 1) * RS_TAPS];
+	uint64_t step;		/* input samples per output, 32.32 fixed point */
+	uint64_t t;		/* position of the next output in x */
+	uint32_t len;		/* complex samples in x */
+	float x[2 * (RS_TAPS + DECIM_CHUNK)];
+} resampler_t;
+
+struct mirisdr_decim {
+	int stages;
+	hb_stage_t hb[HB_MAX_STAGES];
+	resampler_t *rs;	/* NULL for power of two ratios */
+	float *out;		/* result of the current call */
+	uint32_t out_len;
+	uint32_t out_max;
+};
+
+static double blackman_harris(double u)
+{
+	return 0.35875 - 0.48829 * cos(2 * M_PI * u) +
+	       0.14128 * cos(4 * M_PI * u) - 0.01168 * cos(6 * M_PI * u);
+}
+
+static double sinc(double x)
+{
+	return x == 0.0 ? 1.0 : sin(M_PI * x) / (M_PI * x);
+}
+
+static void hb_init(hb_stage_t *s, int k)
+{
+	int q, taps = 4 * k - 1;
+	double n, sum = 0;
+
+	memset(s, 0, sizeof(*s));
+	s->k = k;
+
+	/* even taps 0, 2 .. 4k - 2 of h(n) = sinc((n - c) / 2) / 2, c = 2k - 1 */
+	for (q = 0; q < 2 * k; q++) {
+		n = 2 * q;
+		s->g[q] = 0.5 * sinc((n - (2 * k - 1)) / 2) *
+			  blackman_harris(n / (taps - 1));
+		sum += s->g[q];
+	}
+
+	/* unity gain at DC, the center tap contributes the other half */
+	for (q = 0; q < 2 * k; q++)
+		s->g[q] *= 0.5 / sum;
+}
+
+static void hb_reset(hb_stage_t *s)
+{
+	s->phase = 0;
+	s->ne = 0;
+	s->no = 0;
+}
+
+static uint32_t hb_process(hb_stage_t *s, const float *in, uint32_t n,
+			   float *out)
+{
+	uint32_t i, q, nout, k = s->k;
+	const float *e;
+	float g;
+
+	for (i = 0; i < n; i++) {
+		if (s->phase) {
+			s->o[2 * s->no] = in[2 * i];
+			s->o[2 * s->no + 1] = in[2 * i + 1];
+			s->no++;
+		} else {
+			s->e[2 * s->ne] = in[2 * i];
+			s->e[2 * s->ne + 1] = in[2 * i + 1];
+			s->ne++;
+		}
+		s->phase ^= 1;
+	}
+
+	/* output j needs e[j .. j + 2k - 1] and o[j + k - 1] */
+	if (s->ne < 2 * k || s->no < k)
+		return 0;
+
+	nout = s->ne - (2 * k - 1);
+	if (nout > s->no - (k - 1))
+		nout = s->no - (k - 1);
+
+	for (i = 0; i < 2 * nout; i++)
+		out[i] = 0.5f * s->o[2 * (k - 1) + i];
+
+	for (q = 0; q < 2 * k; q++) {
+		g = s->g[q];
+		e = s->e + 2 * q;
+
+		for (i = 0; i < 2 * nout; i++)
+			out[i] += g * e[i];
+	}
+
+	s->ne -= nout;
+	s->no -= nout;
+	memmove(s->e, s->e + 2 * nout, 2 * s->ne * sizeof(float));
+	memmove(s->o, s->o + 2 * nout, 2 * s->no * sizeof(float));
+
+	return nout;
+}
+
+/* ratio is input over output rate, between 1 and 2 */
+static resampler_t *rs_create(uint64_t step)
+{
+	resampler_t *r;
+	double ratio = (double)step / 4294967296.0;
+	double fc = RS_CUTOFF / ratio; /* cycles per input sample */
+	double x, sum;
+	int p, k;
+
+	r = calloc(1, sizeof(resampler_t));
+	if (!r)
+		return NULL;
+
+	r->step = step;
+
+	/* phase p delays by p / RS_PHASES samples */
+	for (p = 0; p <= RS_PHASES; p++) {
+		float *h = r->h + p * RS_TAPS;
+
+		sum = 0;
+		for (k = 0; k < RS_TAPS; k++) {
+			x = RS_TAPS / 2 - 1 + (double)p / RS_PHASES - k;
+			h[k] = 2 * fc * sinc(2 * fc * x) *
+			       blackman_harris((x + RS_TAPS / 2) / RS_TAPS);
+			sum += h[k];
+		}
+
+		for (k = 0; k < RS_TAPS; k++)
+			h[k] /= sum;
+	}
+
+	return r;
+}
+
+static void rs_reset(resampler_t *r)
+{
+	r->t = 0;
+	r->len = 0;
+}
+
+static uint32_t rs_process(resampler_t *r, const float *in, uint32_t n,
+			   float *out)
+{
+	uint32_t i, k, p, shift, nout = 0;
+	const float *h0, *h1, *x;
+	float a, w, re, im;
+
+	memcpy(r->x + 2 * r->len, in, 2 * n * sizeof(float));
+	r->len += n;
+
+	while ((i = r->t >> 32) + RS_TAPS <= r->len) {
+		p = (uint32_t)r->t >> (32 - RS_PHASES_SH);
+		a = (float)(((uint32_t)r->t << RS_PHASES_SH) * (1.0 / 4294967296.0));
+		h0 = r->h + p * RS_TAPS;
+		h1 = h0 + RS_TAPS;
+		x = r->x + 2 * i;
+
+		re = 0;
+		im = 0;
+		for (k = 0; k < RS_TAPS; k++) {
+			w = h0[k] + a * (h1[k] - h0[k]);
+			re += w * x[2 * k];
+			im += w * x[2 * k + 1];
+		}
+
+		out[2 * nout] = re;
+		out[2 * nout + 1] = im;
+		nout++;
+
+		r->t += r->step;
+	}
+
+	shift = r->t >> 32;
+	if (shift > r->len)
+		shift = r->len;
+
+	r->len -= shift;
+	r->t -= (uint64_t)shift << 32;
+	memmove(r->x, r->x + 2 * shift, 2 * r->len * sizeof(float));
+
+	return nout;
+}
+
+mirisdr_decim_t *mirisdr_decim_create(uint32_t in_rate, uint32_t out_rate,
+				      uint32_t max_in)
+{
+	mirisdr_decim_t *d;
+	uint64_t step;
+	int i;
+
+	if (!out_rate || out_rate >= in_rate)
+		return NULL;
+
+	d = calloc(1, sizeof(mirisdr_decim_t));
+	if (!d)
+		return NULL;
+
+	/* halve while the output rate still fits, the rest is resampled */
+	while (d->stages < HB_MAX_STAGES &&
+	       (uint64_t)out_rate << (d->stages + 1) <= in_rate)
+		d->stages++;
+
+	step = ((uint64_t)in_rate << 32) / ((uint64_t)out_rate << d->stages);
+	if (step > (1ULL << 32)) {
+		d->rs = rs_create(step);
+		if (!d->rs)
+			goto err;
+	}
+
+	for (i = 0; i < d->stages; i++)
+		hb_init(&d->hb[i], (i == d->stages - 1 && !d->rs) ? HB_K_LAST : HB_K);
+
+	d->out_max = (uint64_t)max_in * out_rate / in_rate + MIRISDR_DECIM_SLACK;
+	d->out = malloc(2 * d->out_max * sizeof(float));
+	if (!d->out)
+		goto err;
+
+	return d;
+err:
+	mirisdr_decim_free(d);
+
+	return NULL;
+}
+
+void mirisdr_decim_free(mirisdr_decim_t *d)
+{
+	if (!d)
+		return;
+
+	free(d->rs);
+	free(d->out);
+	free(d);
+}
+
+void mirisdr_decim_reset(mirisdr_decim_t *d)
+{
+	int i;
+
+	for (i = 0; i < d->stages; i++)
+		hb_reset(&d->hb[i]);
+
+	if (d->rs)
+		rs_reset(d->rs);
+}
+
+/* run up to DECIM_CHUNK complex samples through the cascade */
+static void decim_push(mirisdr_decim_t *d, const float *in, uint32_t n)
+{
+	float a[2 * (DECIM_CHUNK + 1)], b[2 * (DECIM_CHUNK + 1)];
+	const float *cur = in;
+	float *next = a;
+	int i;
+
+	for (i = 0; i < d->stages && n; i++) {
+		n = hb_process(&d->hb[i], cur, n, next);
+		cur = next;
+		next = next == a ? b : a;
+	}
+
+	if (d->rs && n) {
+		n = rs_process(d->rs, cur, n, next);
+		cur = next;
+	}
+
+	/* can't happen with max_in respected, drop rather than overflow */
+	if (d->out_len + n > d->out_max)
+		n = d->out_max - d->out_len;
+
+	memcpy(d->out + 2 * d->out_len, cur, 2 * n * sizeof(float));
+	d->out_len += n;
+}
+
+static int16_t to_s16(float v)
+{
+	v *= MIRISDR_CS16_FULL_SCALE;
+
+	if (v >= 32767.0f)
+		return 32767;
+	if (v <= -32768.0f)
+		return -32768;
+
+	return (int16_t)(v + (v >= 0 ? 0.5f : -0.5f));
+}
+
+static uint8_t to_u8(float v)
+{
+	v = v * 128.0f + 128.0f;
+
+	if (v >= 255.0f)
+		return 255;
+	if (v <= 0.0f)
+		return 0;
+
+	return (uint8_t)v;
+}
+
+/* the collected output in the output format, planes are out_len apart */
+static uint32_t decim_store(mirisdr_decim_t *d,
+			    const mirisdr_format_desc_t *format, void *out)
+{
+	uint32_t i, n = d->out_len;
+	const float *sp = d->out;
+
+	switch (format->format) {
+	case MIRISDR_FORMAT_CS16:
+		for (i = 0; i < 2 * n; i++)
+			((int16_t *)out)[i] = to_s16(sp[i]);
+		break;
+	case MIRISDR_FORMAT_CF32:
+		memcpy(out, sp, 2 * n * sizeof(float));
+		break;
+	case MIRISDR_FORMAT_CU8:
+		for (i = 0; i < 2 * n; i++)
+			((uint8_t *)out)[i] = to_u8(sp[i]);
+		break;
+	case MIRISDR_FORMAT_CS16_PLANAR:
+		for (i = 0; i < n; i++) {
+			((int16_t *)out)[i] = to_s16(sp[2 * i]);
+			((int16_t *)out)[n + i] = to_s16(sp[2 * i + 1]);
+		}
+		break;
+	case MIRISDR_FORMAT_CF32_PLANAR:
+		for (i = 0; i < n; i++) {
+			((float *)out)[i] = sp[2 * i];
+			((float *)out)[n + i] = sp[2 * i + 1];
+		}
+		break;
+	case MIRISDR_FORMAT_RAW:
+		/* not reached, raw blocks are never decimated */
+		break;
+	}
+
+	d->out_len = 0;
+
+	return n;
+}
+
+uint32_t mirisdr_decim_blocks(mirisdr_decim_t *d, mirisdr_unpack_fn_t unpack,
+			      const mirisdr_format_desc_t *format,
+			      mirisdr_iqcorr_t *corr,
+			      unsigned char *const *blocks, uint32_t nblocks,
+			      void *out)
+{
+	int16_t sp[MIRISDR_SUBBLOCK_SAMPLES];
+	float x[MIRISDR_SUBBLOCK_SAMPLES];
+	const uint8_t *ip;
+	uint32_t b;
+	int i, k;
+
+	for (b = 0; b < nblocks; b++) {
+		ip = blocks[b] + MIRISDR_BLOCK_HDR_LEN;
+
+		for (k = 0; k < MIRISDR_SUBBLOCKS; k++) {
+			unpack(ip, sp, mirisdr_subblock_flags(ip));
+			if (corr)
+				mirisdr_iqcorr_apply(corr, sp, DECIM_CHUNK);
+
+			for (i = 0; i < MIRISDR_SUBBLOCK_SAMPLES; i++)
+				x[i] = sp[i] * MIRISDR_CF32_SCALE;
+
+			decim_push(d, x, DECIM_CHUNK);
+
+			ip += MIRISDR_SUBBLOCK_LEN + MIRISDR_SUBBLOCK_FLAG_LEN;
+		}
+
+		if (corr)
+			mirisdr_iqcorr_update(corr);
+	}
+
+	return decim_store(d, format, out);
+}
+
+uint32_t mirisdr_decim_zeros(mirisdr_decim_t *d,
+			     const mirisdr_format_desc_t *format, uint32_t n,
+			     void *out)
+{
+	static const float zeros[2 * DECIM_CHUNK];
+	uint32_t len;
+
+	for (; n; n -= len) {
+		len = n < DECIM_CHUNK ? n : DECIM_CHUNK;
+		decim_push(d, zeros, len);
+	}
+
+	return decim_store(d, format, out);
+}
@@ -0,0 +1,165 @@
+/*
+ * Decoder of MSi2500 blocks
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mirisdr.h"
+#include "mirisdr_log.h"
+#include "decoder.h"
+
+static void hexdump(const uint8_t *inbuf, int cnt)
+{
+	char line[3 * MIRISDR_BLOCK_HDR_LEN + 1];
+	int i;
+
+	if (!mirisdr_log_enabled(MIRISDR_LOG_DEBUG))
+		return;
+
+	if (cnt > MIRISDR_BLOCK_HDR_LEN)
+		cnt = MIRISDR_BLOCK_HDR_LEN;
+
+	for (i = 0; i < cnt; i++)
+		sprintf(line + 3 * i, "%02x ", inbuf[i]);
+	line[3 * cnt] = '\0';
+
+	mirisdr_log_msg(MIRISDR_LOG_DEBUG, "header %s", line);
+}
+
+static uint32_t block_addr(const uint8_t *ip)
+{
+	return ip[1] + (ip[2] << 8) + (ip[3] << 16);
+}
+
+int mirisdr_decoder_init(mirisdr_decoder_t *dec, mirisdr_format_t format)
+{
+	const mirisdr_format_desc_t *desc = mirisdr_format_desc(format);
+
+	if (!desc)
+		return -1;
+
+	memset(dec, 0, sizeof(*dec));
+	dec->unpack = mirisdr_unpack_select()->unpack;
+	dec->format = desc;
+
+	return 0;
+}
+
+uint32_t mirisdr_decoder_convert(mirisdr_decoder_t *dec, mirisdr_iqcorr_t *corr,
+				 const uint8_t *ip, void *out, uint32_t pos,
+				 uint32_t plane, uint32_t nblocks)
+{
+	if (!dec->format->sample_size) {
+		memcpy((uint8_t *)out + pos / (MIRISDR_BLOCK_SAMPLES / 2) * MIRISDR_BLOCK_LEN,
+		       ip, nblocks * MIRISDR_BLOCK_LEN);
+		return nblocks * (MIRISDR_BLOCK_SAMPLES / 2);
+	}
+
+	return mirisdr_convert_blocks(dec->unpack, dec->format, corr, ip, out,
+				      pos, plane, nblocks);
+}
+
+mirisdr_decoder_t *mirisdr_decoder_create(mirisdr_format_t format)
+{
+	mirisdr_decoder_t *dec = malloc(sizeof(mirisdr_decoder_t));
+
+	if (!dec)
+		return NULL;
+
+	if (mirisdr_decoder_init(dec, format) < 0) {
+		free(dec);
+		return NULL;
+	}
+
+	return dec;
+}
+
+void mirisdr_decoder_free(mirisdr_decoder_t *dec)
+{
+	free(dec);
+}
+
+void mirisdr_decoder_reset(mirisdr_decoder_t *dec)
+{
+	if (dec)
+		dec->addr_valid = 0;
+}
+
+int32_t mirisdr_decoder_check(mirisdr_decoder_t *dec, const void *block)
+{
+	const uint8_t *ip = block;
+	uint32_t address, gap;
+	int32_t ret = 0;
+
+	if (!dec || !block)
+		return 0;
+
+	address = block_addr(ip);
+
+	if (dec->addr_valid && address != dec->addr) {
+		gap = (address - dec->addr) & 0xffffff;
+
+		/* a jump backwards is a counter reset, nothing to count */
+		ret = gap < 0x800000 ? (int32_t)gap : MIRISDR_DECODER_RESET;
+	}
+
+	dec->addr = (address + (ip[0] >> 7) + 1) & 0xffffff;
+	dec->addr_valid = 1;
+
+	if (((ip[5] & 0x40) && dec->headerflag)) {
+		hexdump(ip, MIRISDR_BLOCK_HDR_LEN);
+		dec->headerflag = 0;
+	} else if ((!(ip[5] & 0x40) && !dec->headerflag)) {
+		hexdump(ip, MIRISDR_BLOCK_HDR_LEN);
+		dec->headerflag = 1;
+	}
+
+	return ret;
+}
+
+int mirisdr_decoder_decode(mirisdr_decoder_t *dec, const void *in,
+			   uint32_t len, void *out, int32_t *gap)
+{
+	const uint8_t *ip = in;
+	uint32_t n, nblocks = len / MIRISDR_BLOCK_LEN;
+	int32_t first = 0;
+
+	if (!dec || (nblocks && (!in || !out)))
+		return -1;
+
+	if (nblocks)
+		first = mirisdr_decoder_check(dec, ip);
+
+	/* the run ends at the first block out of sequence */
+	for (n = 1; n < nblocks; n++) {
+		if (block_addr(ip + n * MIRISDR_BLOCK_LEN) != dec->addr)
+			break;
+		mirisdr_decoder_check(dec, ip + n * MIRISDR_BLOCK_LEN);
+	}
+
+	if (gap)
+		*gap = first;
+
+	if (!nblocks)
+		return 0;
+
+	mirisdr_decoder_convert(dec, NULL, ip, out, 0,
+				n * (MIRISDR_BLOCK_SAMPLES / 2), n);
+
+	return n;
+}
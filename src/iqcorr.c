@@ -0,0 +1,153 @@
+/*
+ * DC offset and IQ imbalance correction
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "mirisdr.h"
+#include "iqcorr.h"
+
+#define COEF_ONE	(1 << 14)
+
+/* 64 squares of 12 bit values still fit the 32 bit partial sums */
+#define SUM_CHUNK	64
+
+/* coefficients fit 16 bits, a * i + b * q stays within 32 */
+#define DC_MAX		16384
+#define A_MAX		(COEF_ONE / 2)
+#define B_MIN		(COEF_ONE / 2)
+#define B_MAX		(COEF_ONE + COEF_ONE / 2)
+
+static int32_t clamp(double v, int32_t lo, int32_t hi)
+{
+	if (v < lo)
+		return lo;
+	if (v > hi)
+		return hi;
+	return (int32_t)lrint(v);
+}
+
+static inline int16_t sat16(int32_t v)
+{
+	return v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
+}
+
+void mirisdr_iqcorr_init(mirisdr_iqcorr_t *c, int flags)
+{
+	memset(c, 0, sizeof(*c));
+	c->flags = flags;
+	c->b = COEF_ONE;
+}
+
+void mirisdr_iqcorr_reset(mirisdr_iqcorr_t *c)
+{
+	mirisdr_iqcorr_init(c, c->flags);
+}
+
+/*
+ * Plain loops over interleaved I/Q the compiler vectorizes, the moments are
+ * taken before the correction so the estimates do not chase themselves.
+ */
+void mirisdr_iqcorr_apply(mirisdr_iqcorr_t *c, int16_t *s, uint32_t n)
+{
+	int32_t si, sq, sii, sqq, siq;
+	int16_t i, q, dc_i = c->dc_i, dc_q = c->dc_q, a = c->a, b = c->b;
+	uint32_t k, len;
+
+	for (; n; n -= len, s += 2 * len) {
+		len = n < SUM_CHUNK ? n : SUM_CHUNK;
+
+		si = sq = sii = sqq = siq = 0;
+		for (k = 0; k < len; k++) {
+			i = s[2 * k] >> 4;
+			q = s[2 * k + 1] >> 4;
+			si += i;
+			sq += q;
+			sii += i * i;
+			sqq += q * q;
+			siq += i * q;
+		}
+
+		c->si += si;
+		c->sq += sq;
+		c->sii += sii;
+		c->sqq += sqq;
+		c->siq += siq;
+		c->n += len;
+
+		for (k = 0; k < len; k++) {
+			i = sat16(s[2 * k] - dc_i);
+			q = sat16(s[2 * k + 1] - dc_q);
+			s[2 * k] = i;
+			s[2 * k + 1] = sat16((a * i + b * q + COEF_ONE / 2) >> 14);
+		}
+	}
+}
+
+void mirisdr_iqcorr_update(mirisdr_iqcorr_t *c)
+{
+	const double alpha = 1.0 / (1 << MIRISDR_IQCORR_SHIFT);
+	double n = c->n, p, r, x, d;
+
+	if (!c->n)
+		return;
+
+	/* back to int16 units, the sums were taken of samples >> 4 */
+	if (!c->primed) {
+		c->mi = c->si * 16.0 / n;
+		c->mq = c->sq * 16.0 / n;
+		c->mii = c->sii * 256.0 / n;
+		c->mqq = c->sqq * 256.0 / n;
+		c->miq = c->siq * 256.0 / n;
+		c->primed = 1;
+	} else {
+		c->mi += (c->si * 16.0 / n - c->mi) * alpha;
+		c->mq += (c->sq * 16.0 / n - c->mq) * alpha;
+		c->mii += (c->sii * 256.0 / n - c->mii) * alpha;
+		c->mqq += (c->sqq * 256.0 / n - c->mqq) * alpha;
+		c->miq += (c->siq * 256.0 / n - c->miq) * alpha;
+	}
+
+	c->si = c->sq = c->sii = c->sqq = c->siq = 0;
+	c->n = 0;
+
+	if (c->flags & MIRISDR_CORR_DC) {
+		c->dc_i = clamp(c->mi, -DC_MAX, DC_MAX);
+		c->dc_q = clamp(c->mq, -DC_MAX, DC_MAX);
+	} else {
+		c->dc_i = c->dc_q = 0;
+	}
+
+	if (!(c->flags & MIRISDR_CORR_IQ)) {
+		c->a = 0;
+		c->b = COEF_ONE;
+		return;
+	}
+
+	/* covariance of I and Q, keep the last coefficients without signal */
+	p = c->mii - c->mi * c->mi;
+	r = c->mqq - c->mq * c->mq;
+	x = c->miq - c->mi * c->mq;
+	d = p * r - x * x;
+
+	if (p < 1.0 || d < 1.0)
+		return;
+
+	d = sqrt(d);
+	c->a = clamp(-x / d * COEF_ONE, -A_MAX, A_MAX);
+	c->b = clamp(p / d * COEF_ONE, B_MIN, B_MAX);
+}
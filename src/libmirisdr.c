@@ -18,36 +18,27 @@
 
 #include <errno.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #ifndef _WIN32
 #include <unistd.h>
 #define min(a, b) (((a) < (b)) ? (a) : (b))
 #endif
 
-//#define USE_SSE
-
-#ifdef USE_SSE
-#include <immintrin.h>
-#endif
-
-#include <libusb.h>
-
-/*
- * All libusb callback functions should be marked with the LIBUSB_CALL macro
- * to ensure that they are compiled with the same calling convention as libusb.
- *
- * If the macro isn't available in older libusb versions, we simply define it.
- */
-#ifndef LIBUSB_CALL
-#define LIBUSB_CALL
-#endif
-
 #include "mirisdr.h"
 #include "mirisdr_reg.h"
+#include "mirisdr_log.h"
 #include "tuner_msi001.h"
+#include "convert.h"
+#include "decimate.h"
+#include "decoder.h"
+#include "transport.h"
 
 typedef struct mirisdr_tuner {
 	/* tuner interface */
@@ -59,60 +50,185 @@ typedef struct mirisdr_tuner {
 	int (*set_gain_mode)(void *, int manual);
 } mirisdr_tuner_t;
 
+/* sample clock synthesizer setting for one rate */
+typedef struct mirisdr_rate {
+	uint32_t rate; /* Hz, as asked for */
+	uint32_t actual; /* Hz, what the synthesizer makes of it */
+	uint32_t reg3;
+	uint32_t reg4;
+} mirisdr_rate_t;
+
+/* rates offered by mirisdr_get_sample_rates(), others are computed on demand */
+static const uint32_t known_rates[] = {
+	1200000, 1536000, 2000000, 2048000, 2400000, 3000000, 3200000,
+	4000000, 5000000, 6000000, 7000000, 8000000, 9000000, 9140000
+};
+
+#define RATE_NUM	(sizeof(known_rates) / sizeof(known_rates[0]))
+
+/* only ever written by the event thread, read from anywhere */
+typedef struct mirisdr_stats {
+	atomic_uint_fast64_t transfers;
+	atomic_uint_fast64_t iso_packets;
+	atomic_uint_fast64_t iso_errors[MIRISDR_ISO_STATUS_NUM];
+	atomic_uint_fast64_t short_packets;
+	atomic_uint_fast64_t discontinuities;
+	atomic_uint_fast64_t samples_lost;
+	atomic_uint_fast64_t overruns;
+	atomic_uint_fast64_t first_sample_us;
+} mirisdr_stats_t;
+
+/* single writer, so a relaxed load and store is enough and needs no lock */
+#define STATS_ADD(dev, field, n) \
+	atomic_store_explicit(&(dev)->stats.field, \
+		atomic_load_explicit(&(dev)->stats.field, memory_order_relaxed) + (n), \
+		memory_order_relaxed)
+
+enum mirisdr_hop_state {
+	HOP_DWELL = 0,	/* delivering samples */
+	HOP_TUNING,	/* tuner writes in flight */
+	HOP_FAILED,	/* tuner writes failed, retried on the next transfer */
+	HOP_SETTLE	/* waiting for the PLL */
+};
+
 enum mirisdr_async_status {
 	mirisdr_INACTIVE = 0,
 	mirisdr_CANCELING,
 	mirisdr_RUNNING
 };
 
+#define CONTEXT_POLL_MS		100
+#define MAX_CONTEXT_THREADS	16
+
+typedef struct mirisdr_context_shard {
+	mirisdr_context_t *ctx;
+	int index;
+	int devices;
+	pthread_t thread;
+} mirisdr_context_shard_t;
+
+/* event threads shared by several devices, see mirisdr_context_create() */
+struct mirisdr_context {
+	mirisdr_usb_pool_t *usb;
+	mirisdr_context_shard_t *shards;
+	int num;
+	atomic_int quit;
+	pthread_mutex_t lock;	/* device list, streaming flags */
+	pthread_cond_t cond;	/* a stream ended */
+	mirisdr_dev_t *devs;
+};
+
+#define MSI2500_REG_NUM		256
+#define MSI2500_TUNER_REG	0x09 /* MSi001 port, tuner register in bits 0..3 */
+#define MSI001_REG_NUM		16
+#define MAX_CTRL_BATCH		64
+
 struct mirisdr_dev {
-	libusb_context *ctx;
-	struct libusb_device_handle *devh;
-	uint32_t xfer_buf_num;
+	mirisdr_transport_t *transport;
+	/* shared context, NULL if the device has its own */
+	mirisdr_context_t *ctx;
+	int ctx_shard;
+	int ctx_streaming; /* driven by the context threads */
+	mirisdr_dev_t *ctx_next;
+	uint32_t xfer_buf_num; /* of the current stream */
 	uint32_t xfer_iso_pack;
 	uint32_t xfer_buf_len;
-	struct libusb_transfer **xfer;
-	unsigned char **xfer_buf;
+	uint32_t geom_buf_num; /* set by mirisdr_set_transfer_geometry() */
+	uint32_t geom_iso_pack;
+	void *out_buf;
+	/* caller owned output buffers */
+	void **pool;
+	atomic_int *pool_busy;
+	uint32_t pool_num;
+	uint32_t pool_len;
+	uint32_t pool_next;
 	mirisdr_read_async_cb_t cb;
+	mirisdr_read_async_ex_cb_t cb_ex;
 	void *cb_ctx;
 	enum mirisdr_async_status async_status;
+	/* sync read context */
+	uint8_t *sync_buf;
+	uint32_t sync_buf_len;
+	atomic_uint_fast64_t sync_head;	/* bytes written by the event thread */
+	atomic_uint_fast64_t sync_tail;	/* bytes consumed by the reader */
+	atomic_uint_fast64_t sync_gap;	/* sync_head at the pending drop */
+	atomic_uint_fast64_t sync_wake;	/* sync_head the reader sleeps for */
+	atomic_int sync_running;
+	int sync_started;
+	pthread_t sync_thread;
+	pthread_mutex_t sync_lock;
+	pthread_cond_t sync_cond;
+	int async_canceled;
 	/* adc context */
 	uint32_t rate; /* Hz */
 	uint32_t adc_clock; /* Hz */
+	mirisdr_rate_t rates[RATE_NUM];
 	/* tuner context */
 	mirisdr_tuner_t *tuner;
+	struct state msi001;
 	uint32_t freq; /* Hz */
 	int gain; /* dB */
 	/* samples context */
-	int headerflag;
-	uint32_t addr;
+	uint32_t out_rate; /* Hz, 0: no decimation */
+	mirisdr_decim_t *decim;
+	uint64_t skip_frac; /* of an output sample, in units of 1 / rate */
+	mirisdr_decoder_t dec;
+	uint64_t sample_index; /* of the next sample handed out */
+	uint32_t buf_flags; /* MIRISDR_BUF_* for the next buffer */
+	int zero_fill;
+	uint64_t fill_left; /* zero samples the current transfer may still add */
+	mirisdr_iqcorr_t iqcorr; /* flags 0: off */
+	unsigned char **blocks; /* blocks of the current transfer */
+	int32_t *block_gap; /* blocks lost before each of them */
+	mirisdr_stats_t stats;
+	uint64_t open_us;
+	uint64_t stream_start; /* _mirisdr_now_us() */
+	/* register context */
+	uint32_t reg_shadow[MSI2500_REG_NUM];
+	uint8_t reg_valid[MSI2500_REG_NUM];
+	uint32_t tuner_shadow[MSI001_REG_NUM];
+	uint8_t tuner_valid[MSI001_REG_NUM];
+	mirisdr_ctrl_t ctrl_batch[MAX_CTRL_BATCH];
+	int ctrl_batch_num;
+	int ctrl_batch_depth;
+	/* hop context */
+	mirisdr_hop_t *hops;
+	mirisdr_tune_plan_t *hop_plan;
+	uint32_t hop_num;
+	uint32_t hop_cur;
+	enum mirisdr_hop_state hop_state;
+	uint64_t hop_end; /* sample index ending the settle or dwell time */
+	int hop_end_valid;
+	uint64_t hop_settle; /* samples */
+	uint64_t hop_dwell; /* samples */
 };
 
-typedef struct mirisdr_dongle {
-	uint16_t vid;
-	uint16_t pid;
-	const char *name;
-} mirisdr_dongle_t;
-
-static mirisdr_dongle_t known_devices[] = {
-	{ 0x1df7, 0x2500, "Mirics MSi2500 default (e.g. VTX3D card)" },
-	{ 0x04bb, 0x0537, "IO-DATA GV-TV100 stick" }
-};
+#define ISO_PACKET_LENGTH	3072 /* 3 * 1024 bytes per microframe */
 
 #define DEFAULT_BUF_NUMBER	32
 #define DEFAULT_ISO_PACKETS	8
-#define DEFAULT_BUF_LENGTH	(3072 * DEFAULT_ISO_PACKETS)
+#define DEFAULT_BUF_LENGTH	(ISO_PACKET_LENGTH * DEFAULT_ISO_PACKETS)
+
+#define MAX_BUF_NUMBER		256
+#define MAX_ISO_PACKETS		128 /* usbfs limit per URB */
+#define MAX_BUF_TOTAL		(16 * 1024 * 1024) /* default usbfs_memory_mb */
+
+#define MAX_FILL_BUFFERS	4 /* of zeros per transfer, longer gaps are not filled */
 
-#define DEF_ADC_FREQ	4000000
+#define DEF_ADC_FREQ	24000000 /* crystal, reference of the sample clock */
+#define DEF_SAMPLE_RATE	9140000 /* programmed by mirisdr_init_baseband() */
 
-#define CTRL_IN		(LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN)
-#define CTRL_OUT	(LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT)
-#define FUNC(group, function) ((group << 8) | function)
+#define MIN_SAMPLE_RATE	1200000
+#define MAX_SAMPLE_RATE	9216000 /* 3 * 1024 byte per microframe */
+#define RATE_VCO_MIN	202000000
+#define RATE_LO_DIV	12
+#define RATE_FRAC_BITS	21
 
-#define CTRL_TIMEOUT	300
-#define ISO_TIMEOUT	0
+#define DEFAULT_SYNC_BUF_LENGTH	(8 * 1024 * 1024)
+#define SYNC_NO_GAP		UINT64_MAX
 
 int _msi001_init(void *dev) {
+	msi001_reset(&((mirisdr_dev_t *)dev)->msi001);
 	return 0;
 }
 
@@ -121,7 +237,7 @@ int msi001_exit(void *dev) {
 }
 
 int msi001_set_freq(void *dev, uint32_t freq) {
-	return msi001_init(dev, freq);
+	return msi001_tune(dev, &((mirisdr_dev_t *)dev)->msi001, freq);
 }
 
 int msi001_set_bw(void *dev, int bw) {
@@ -154,21 +270,256 @@ static mirisdr_tuner_t tuner = {
 	msi001_set_bw, msi001_set_gain, msi001_set_gain_mode
 };
 
+static void _mirisdr_log_stderr(int level, const char *msg)
+{
+	fprintf(stderr, "%s\n", msg);
+}
+
+int mirisdr_log_level = MIRISDR_LOG_ERROR;
+static mirisdr_log_cb_t log_cb = _mirisdr_log_stderr;
+
+int mirisdr_set_log_callback(int level, mirisdr_log_cb_t cb)
+{
+	mirisdr_log_level = level;
+	log_cb = cb ? cb : _mirisdr_log_stderr;
+
+	return 0;
+}
+
+void mirisdr_log_msg(int level, const char *fmt, ...)
+{
+	char msg[256];
+	va_list ap;
+
+	if (!mirisdr_log_enabled(level))
+		return;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+
+	log_cb(level, msg);
+}
+
+static void _mirisdr_reg_invalidate(mirisdr_dev_t *dev)
+{
+	memset(dev->reg_valid, 0, sizeof(dev->reg_valid));
+	memset(dev->tuner_valid, 0, sizeof(dev->tuner_valid));
+}
+
+static int _mirisdr_batch_flush(mirisdr_dev_t *dev)
+{
+	int r;
+
+	if (!dev->ctrl_batch_num)
+		return 0;
+
+	if (dev->ctrl_batch_num == 1)
+		r = dev->transport->ops->control(dev->transport,
+						 dev->ctrl_batch[0].request,
+						 dev->ctrl_batch[0].value,
+						 dev->ctrl_batch[0].index);
+	else
+		r = dev->transport->ops->control_batch(dev->transport,
+						       dev->ctrl_batch,
+						       dev->ctrl_batch_num);
+	dev->ctrl_batch_num = 0;
+
+	/* unknown which writes made it, so trust none of the cached values */
+	if (r < 0) {
+		log_err("control batch failed: %d", r);
+		_mirisdr_reg_invalidate(dev);
+	}
+
+	return r;
+}
+
+/* drop the open batch unsent, the cache took its writes as done */
+static void _mirisdr_batch_discard(mirisdr_dev_t *dev)
+{
+	dev->ctrl_batch_num = 0;
+	dev->ctrl_batch_depth = 0;
+	_mirisdr_reg_invalidate(dev);
+}
+
+/* send a vendor request, or queue it while a batch is open */
+static int _mirisdr_control(mirisdr_dev_t *dev, uint8_t request,
+			    uint16_t value, uint16_t index)
+{
+	mirisdr_ctrl_t *c;
+	int r = 0;
+
+	if (!dev->ctrl_batch_depth)
+		return dev->transport->ops->control(dev->transport, request,
+						    value, index);
+
+	if (dev->ctrl_batch_num == MAX_CTRL_BATCH)
+		r = _mirisdr_batch_flush(dev);
+
+	c = &dev->ctrl_batch[dev->ctrl_batch_num++];
+	c->request = request;
+	c->value = value;
+	c->index = index;
+
+	return r;
+}
+
+/*
+ * Writes are skipped when the register already holds the value. Writes to
+ * reg 0x09 end up in the MSi001, they are cached by tuner register.
+ */
 int msi2500_write_reg(mirisdr_dev_t *dev, uint8_t reg, uint32_t val)
 {
 	uint16_t wValue = (val & 0xff) << 8 | reg;
 	uint16_t wIndex = (val >> 8) & 0xffff;
+	uint32_t *shadow;
+	uint8_t *valid;
+	int r;
+
+	val &= 0xffffff;
+
+	if (reg == MSI2500_TUNER_REG) {
+		shadow = &dev->tuner_shadow[val & (MSI001_REG_NUM - 1)];
+		valid = &dev->tuner_valid[val & (MSI001_REG_NUM - 1)];
+	} else {
+		shadow = &dev->reg_shadow[reg];
+		valid = &dev->reg_valid[reg];
+	}
+
+	if (*valid && *shadow == val)
+		return 0;
 
-	int r = libusb_control_transfer(dev->devh, 0x42, 0x41, wValue, wIndex, NULL, 0, CTRL_TIMEOUT);
+	r = _mirisdr_control(dev, 0x41, wValue, wIndex);
 
-//	fprintf(stderr, "%s: reg %02x -> %06x\n", __FUNCTION__, reg, val);
+	/* a queued write counts as done, a failing batch drops the cache */
+	*shadow = val;
+	*valid = r >= 0;
+
+	log_dbg("reg %02x -> %06x", reg, val);
 	return r;
 }
 
+/* queue register writes until the matching end, then submit them at once */
+int mirisdr_reg_batch_begin(void *dev)
+{
+	if (!dev)
+		return -1;
+
+	((mirisdr_dev_t *)dev)->ctrl_batch_depth++;
+
+	return 0;
+}
+
+int mirisdr_reg_batch_end(void *dev)
+{
+	mirisdr_dev_t *d = (mirisdr_dev_t *)dev;
+
+	if (!d || !d->ctrl_batch_depth)
+		return -1;
+
+	if (--d->ctrl_batch_depth)
+		return 0;
+
+	return _mirisdr_batch_flush(d);
+}
+
+/*
+ * The sample clock comes from a fractional-N synthesizer. Its VCO runs at
+ * rate * div_out * 12 and is locked to twice the crystal:
+ *
+ *   f_vco = 2 * adc_clock * (N + k / 2^21)
+ *
+ * div_out is the smallest of 4, 6, .. 16 that keeps the VCO above 202 MHz.
+ * Bits 12..15 of reg 3 change with the rate, what they select is unknown.
+ */
+static int _mirisdr_calc_rate(uint32_t adc_clock, uint32_t rate,
+			      mirisdr_rate_t *out)
+{
+	uint64_t ref = (uint64_t)adc_clock * 2, f_vco = 0, k;
+	uint32_t div_out, n, band;
+
+	if (rate < MIN_SAMPLE_RATE || rate > MAX_SAMPLE_RATE)
+		return -EINVAL;
+
+	for (div_out = 4; div_out <= 16; div_out += 2) {
+		f_vco = (uint64_t)rate * div_out * RATE_LO_DIV;
+		if (f_vco >= RATE_VCO_MIN)
+			break;
+	}
+
+	if (div_out > 16)
+		div_out = 16;
+
+	n = f_vco / ref;
+	k = ((f_vco % ref) << RATE_FRAC_BITS) / ref;
+
+	if (rate < 6000000)
+		band = 0x0;
+	else if (rate < 7000000)
+		band = 0x4;
+	else if (rate < 8500000)
+		band = 0x8;
+	else
+		band = 0xc;
+
+	out->rate = rate;
+	out->actual = (ref * (((uint64_t)n << RATE_FRAC_BITS) + k) +
+		       ((uint64_t)div_out * RATE_LO_DIV << (RATE_FRAC_BITS - 1))) /
+		      ((uint64_t)div_out * RATE_LO_DIV << RATE_FRAC_BITS);
+	out->reg3 = 0x010003 | band << 12 | n << 8 |
+		    ((k >> 20) & 0x1) << 7 | (div_out / 2 - 1) << 2;
+	out->reg4 = k & 0x0fffff;
+
+	return 0;
+}
+
+static void _mirisdr_rate_table(mirisdr_dev_t *dev)
+{
+	uint32_t i;
+
+	for (i = 0; i < RATE_NUM; i++)
+		_mirisdr_calc_rate(dev->adc_clock, known_rates[i], &dev->rates[i]);
+}
+
+/* precomputed if it is a known rate */
+static int _mirisdr_set_rate(mirisdr_dev_t *dev, uint32_t rate)
+{
+	mirisdr_rate_t calc;
+	const mirisdr_rate_t *r = NULL;
+	uint32_t i;
+	int ret;
+
+	for (i = 0; i < RATE_NUM; i++) {
+		if (dev->rates[i].rate == rate && dev->rates[i].actual)
+			r = &dev->rates[i];
+	}
+
+	if (!r) {
+		if (_mirisdr_calc_rate(dev->adc_clock, rate, &calc) < 0) {
+			log_err("sample rate %u Hz out of range", rate);
+			return -EINVAL;
+		}
+
+		r = &calc;
+	}
+
+	log_dbg("sample rate %u Hz, reg3 %06x reg4 %06x", r->actual, r->reg3,
+		r->reg4);
+
+	mirisdr_reg_batch_begin(dev);
+	msi2500_write_reg(dev, 0x04, r->reg4);
+	msi2500_write_reg(dev, 0x03, r->reg3);
+	ret = mirisdr_reg_batch_end(dev);
+
+	dev->rate = ret < 0 ? 0 : r->actual;
+
+	return ret < 0 ? ret : 0;
+}
+
 void mirisdr_init_baseband(mirisdr_dev_t *dev)
 {
 	/* TODO figure out what that does and why it's needed */
-	libusb_control_transfer(dev->devh, 0x42, 0x43, 0x0, 0x0, NULL, 0, CTRL_TIMEOUT);
+	_mirisdr_control(dev, 0x43, 0x0, 0x0);
 
 	/* initialisation */
 
@@ -180,16 +531,7 @@ void mirisdr_init_baseband(mirisdr_dev_t *dev)
 	msi2500_write_reg(dev, 0x07, 0x0000a5);
 
 	/* sample rate  = 9.14 MS/s */
-	msi2500_write_reg(dev, 0x04, 0x04923d);
-	msi2500_write_reg(dev, 0x03, 0x01c907);
-
-	//6M sample rate
-//	msi2500_write_reg(dev, 0x04, 0x9220b);
-//	msi2500_write_reg(dev, 0x03, 0x14a0b);
-
-	// doesn't work yet
-//	fprintf(stderr, "setting fs\n");
-//	mirisdr_set_samp_rate(dev, 8000000);
+	_mirisdr_set_rate(dev, DEF_SAMPLE_RATE);
 
 	msi2500_write_reg(dev, 0x13, 0x006b46);
 	msi2500_write_reg(dev, 0x14, 0x0000f5);
@@ -229,42 +571,11 @@ int mirisdr_deinit_baseband(mirisdr_dev_t *dev)
 int mirisdr_get_usb_strings(mirisdr_dev_t *dev, char *manufact, char *product,
 			    char *serial)
 {
-	struct libusb_device_descriptor dd;
-	libusb_device *device = NULL;
-	const int buf_max = 256;
-	int r = 0;
-
-	if (!dev || !dev->devh)
-		return -1;
-
-	device = libusb_get_device(dev->devh);
-
-	r = libusb_get_device_descriptor(device, &dd);
-	if (r < 0)
+	if (!dev || !dev->transport)
 		return -1;
 
-	if (manufact) {
-		memset(manufact, 0, buf_max);
-		libusb_get_string_descriptor_ascii(dev->devh, dd.iManufacturer,
-						   (unsigned char *)manufact,
-						   buf_max);
-	}
-
-	if (product) {
-		memset(product, 0, buf_max);
-		libusb_get_string_descriptor_ascii(dev->devh, dd.iProduct,
-						   (unsigned char *)product,
-						   buf_max);
-	}
-
-	if (serial) {
-		memset(serial, 0, buf_max);
-		libusb_get_string_descriptor_ascii(dev->devh, dd.iSerialNumber,
-						   (unsigned char *)serial,
-						   buf_max);
-	}
-
-	return 0;
+	return dev->transport->ops->get_usb_strings(dev->transport, manufact,
+						    product, serial);
 }
 
 int mirisdr_set_center_freq(mirisdr_dev_t *dev, uint32_t freq)
@@ -274,8 +585,14 @@ int mirisdr_set_center_freq(mirisdr_dev_t *dev, uint32_t freq)
 	if (!dev || !dev->tuner)
 		return -1;
 
-	if (dev->tuner->set_freq)
+	if (dev->tuner->set_freq) {
+		mirisdr_reg_batch_begin(dev);
 		r = dev->tuner->set_freq(dev, freq);
+		if (mirisdr_reg_batch_end(dev) < 0) {
+			msi001_reset(&dev->msi001);
+			r = -1;
+		}
+	}
 
 	if (!r)
 		dev->freq = freq;
@@ -293,6 +610,82 @@ uint32_t mirisdr_get_center_freq(mirisdr_dev_t *dev)
 	return dev->freq;
 }
 
+struct mirisdr_tune_plan {
+	uint32_t num;
+	struct msi001_plan *entries;
+};
+
+int mirisdr_tune_plan_create(mirisdr_dev_t *dev, const uint32_t *freqs,
+			     uint32_t num, mirisdr_tune_plan_t **out_plan)
+{
+	mirisdr_tune_plan_t *plan;
+	uint32_t i;
+
+	if (!dev || !freqs || !num || !out_plan)
+		return -1;
+
+	plan = malloc(sizeof(mirisdr_tune_plan_t));
+	if (NULL == plan)
+		return -ENOMEM;
+
+	plan->num = num;
+	plan->entries = malloc(num * sizeof(struct msi001_plan));
+	if (NULL == plan->entries) {
+		free(plan);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (msi001_plan(&dev->msi001, freqs[i], &plan->entries[i]) < 0) {
+			log_err("can't tune to %u Hz", freqs[i]);
+			mirisdr_tune_plan_free(plan);
+			return -1;
+		}
+	}
+
+	*out_plan = plan;
+
+	return 0;
+}
+
+int mirisdr_tune_plan_apply(mirisdr_dev_t *dev, const mirisdr_tune_plan_t *plan,
+			    uint32_t index)
+{
+	int r;
+
+	if (!dev || !plan || index >= plan->num)
+		return -1;
+
+	mirisdr_reg_batch_begin(dev);
+	r = msi001_apply(dev, &dev->msi001, &plan->entries[index]);
+	if (mirisdr_reg_batch_end(dev) < 0) {
+		msi001_reset(&dev->msi001);
+		r = -1;
+	}
+
+	dev->freq = r ? 0 : plan->entries[index].freq_hz;
+
+	return r;
+}
+
+uint32_t mirisdr_tune_plan_lo_freq(const mirisdr_tune_plan_t *plan,
+				   uint32_t index)
+{
+	if (!plan || index >= plan->num)
+		return 0;
+
+	return plan->entries[index].lo_hz;
+}
+
+void mirisdr_tune_plan_free(mirisdr_tune_plan_t *plan)
+{
+	if (!plan)
+		return;
+
+	free(plan->entries);
+	free(plan);
+}
+
 int mirisdr_get_tuner_gains(mirisdr_dev_t *dev, int *gains)
 {
 	const int msi001_gains[] = { -10, 15, 40, 65, 90, 115, 140, 165, 190, 215,
@@ -373,23 +766,15 @@ int mirisdr_set_tuner_if_gain(mirisdr_dev_t *dev, int stage, int gain)
 
 int mirisdr_set_sample_rate(mirisdr_dev_t *dev, uint32_t samp_rate)
 {
-	int n;
-	int r = 0;
+	int r;
 
 	if (!dev)
 		return -1;
 
-	/* TODO */
-//	mirisdr_set_samp_rate(dev, samp_rate);
-
-	if (r >= 0) {
-		if (dev->tuner && dev->tuner->set_bw)
-			dev->tuner->set_bw(dev, samp_rate);
+	r = _mirisdr_set_rate(dev, samp_rate);
 
-		dev->rate = samp_rate;
-	} else {
-		dev->rate = 0;
-	}
+	if (r >= 0 && dev->tuner && dev->tuner->set_bw)
+		dev->tuner->set_bw(dev, samp_rate);
 
 	return r;
 }
@@ -402,185 +787,203 @@ uint32_t mirisdr_get_sample_rate(mirisdr_dev_t *dev)
 	return dev->rate;
 }
 
-static mirisdr_dongle_t *find_known_device(uint16_t vid, uint16_t pid)
+int mirisdr_get_sample_rates(mirisdr_dev_t *dev, uint32_t *rates)
 {
-	unsigned int i;
-	mirisdr_dongle_t *device = NULL;
+	if (!dev)
+		return -1;
 
-	for (i = 0; i < sizeof(known_devices)/sizeof(mirisdr_dongle_t); i++ ) {
-		if (known_devices[i].vid == vid && known_devices[i].pid == pid) {
-			device = &known_devices[i];
-			break;
-		}
-	}
+	if (rates) /* NULL just returns the count */
+		memcpy(rates, known_rates, sizeof(known_rates));
 
-	return device;
+	return RATE_NUM;
 }
 
-uint32_t mirisdr_get_device_count(void)
+int mirisdr_set_output_rate(mirisdr_dev_t *dev, uint32_t rate)
 {
-	int i;
-	libusb_context *ctx;
-	libusb_device **list;
-	struct libusb_device_descriptor dd;
-	uint32_t device_count = 0;
-	ssize_t cnt;
+	if (!dev)
+		return -1;
 
-	libusb_init(&ctx);
+	if (mirisdr_INACTIVE != dev->async_status)
+		return -2;
 
-	cnt = libusb_get_device_list(ctx, &list);
+	if (rate && rate >= dev->rate)
+		return -EINVAL;
 
-	for (i = 0; i < cnt; i++) {
-		libusb_get_device_descriptor(list[i], &dd);
+	dev->out_rate = rate;
 
-		if (find_known_device(dd.idVendor, dd.idProduct))
-			device_count++;
-	}
+	return 0;
+}
 
-	libusb_free_device_list(list, 1);
+uint32_t mirisdr_get_output_rate(mirisdr_dev_t *dev)
+{
+	if (!dev)
+		return 0;
 
-	libusb_exit(ctx);
+	if (dev->out_rate && dev->out_rate < dev->rate &&
+	    dev->dec.format->sample_size)
+		return dev->out_rate;
 
-	return device_count;
+	return dev->rate;
 }
 
-const char *mirisdr_get_device_name(uint32_t index)
+int mirisdr_set_output_format(mirisdr_dev_t *dev, mirisdr_format_t format)
 {
-	int i;
-	libusb_context *ctx;
-	libusb_device **list;
-	struct libusb_device_descriptor dd;
-	mirisdr_dongle_t *device = NULL;
-	uint32_t device_count = 0;
-	ssize_t cnt;
+	const mirisdr_format_desc_t *desc;
+
+	if (!dev)
+		return -1;
 
-	libusb_init(&ctx);
+	/* the output buffer is sized for the format when streaming starts */
+	if (mirisdr_INACTIVE != dev->async_status)
+		return -2;
 
-	cnt = libusb_get_device_list(ctx, &list);
+	desc = mirisdr_format_desc(format);
+	if (!desc)
+		return -1;
 
-	for (i = 0; i < cnt; i++) {
-		libusb_get_device_descriptor(list[i], &dd);
+	dev->dec.format = desc;
 
-		device = find_known_device(dd.idVendor, dd.idProduct);
+	return 0;
+}
 
-		if (device) {
-			device_count++;
+mirisdr_format_t mirisdr_get_output_format(mirisdr_dev_t *dev)
+{
+	if (!dev)
+		return MIRISDR_FORMAT_CS16;
 
-			if (index == device_count - 1)
-				break;
+	return dev->dec.format->format;
+}
 
-			device = NULL;
-		}
-	}
+int mirisdr_get_raw_header(mirisdr_dev_t *dev, mirisdr_raw_header_t *hdr)
+{
+	struct timespec ts;
 
-	libusb_free_device_list(list, 1);
+	if (!dev || !hdr)
+		return -1;
 
-	libusb_exit(ctx);
+	clock_gettime(CLOCK_REALTIME, &ts);
 
-	if (device)
-		return device->name;
-	else
-		return "";
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, MIRISDR_RAW_MAGIC, sizeof(hdr->magic));
+	hdr->byte_order = MIRISDR_RAW_BYTE_ORDER;
+	hdr->header_len = sizeof(*hdr);
+	hdr->block_len = MIRISDR_BLOCK_LEN;
+	hdr->block_samples = MIRISDR_BLOCK_SAMPLES / 2;
+	hdr->sample_bits = 10;
+	hdr->sample_rate = dev->rate ? dev->rate : DEF_SAMPLE_RATE;
+	hdr->center_freq = dev->freq;
+	hdr->gain = dev->gain;
+	hdr->start_time = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+	return 0;
 }
 
-int mirisdr_get_device_usb_strings(uint32_t index, char *manufact,
-				   char *product, char *serial)
+static uint64_t _mirisdr_now_us(void)
 {
-	int r = -2;
-	int i;
-	libusb_context *ctx;
-	libusb_device **list;
-	struct libusb_device_descriptor dd;
-	mirisdr_dev_t devt;
-	uint32_t device_count = 0;
-	ssize_t cnt;
+	struct timespec ts;
 
-	libusb_init(&ctx);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	cnt = libusb_get_device_list(ctx, &list);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-	for (i = 0; i < cnt; i++) {
-		libusb_get_device_descriptor(list[i], &dd);
-
-		if (find_known_device(dd.idVendor, dd.idProduct))
-			device_count++;
-
-		if (index == device_count - 1) {
-			r = libusb_open(list[i], &devt.devh);
-			if (!r) {
-				r = mirisdr_get_usb_strings(&devt,
-							    manufact,
-							    product,
-							    serial);
-				libusb_close(devt.devh);
-			}
-			break;
-		}
-	}
+/* MIRISDR_REPLAY selects a capture file instead of the USB devices */
+static const char *_mirisdr_replay_path(void)
+{
+	const char *path = getenv("MIRISDR_REPLAY");
 
-	libusb_free_device_list(list, 1);
+	return path && *path ? path : NULL;
+}
 
-	libusb_exit(ctx);
+uint32_t mirisdr_get_device_count(void)
+{
+	if (_mirisdr_replay_path())
+		return 1;
 
-	return r;
+	return mirisdr_usb_get_device_count();
 }
 
-int mirisdr_open(mirisdr_dev_t **out_dev, uint32_t index)
+const char *mirisdr_get_device_name(uint32_t index)
 {
-	int r;
-	int i;
-	libusb_device **list;
-	mirisdr_dev_t *dev = NULL;
-	libusb_device *device = NULL;
-	uint32_t device_count = 0;
-	struct libusb_device_descriptor dd;
-	ssize_t cnt;
+	if (_mirisdr_replay_path())
+		return index ? "" : "Mirics MSi2500 replay";
 
-	dev = malloc(sizeof(mirisdr_dev_t));
-	if (NULL == dev)
-		return -ENOMEM;
+	return mirisdr_usb_get_device_name(index);
+}
 
-	memset(dev, 0, sizeof(mirisdr_dev_t));
+int mirisdr_get_device_usb_strings(uint32_t index, char *manufact,
+				   char *product, char *serial)
+{
+	mirisdr_transport_t *t;
+	const char *path = _mirisdr_replay_path();
+	int r;
 
-	libusb_init(&dev->ctx);
+	if (!path)
+		return mirisdr_usb_get_device_usb_strings(index, manufact,
+							  product, serial);
 
-	cnt = libusb_get_device_list(dev->ctx, &list);
+	if (index)
+		return -2;
 
-	for (i = 0; i < cnt; i++) {
-		device = list[i];
+	r = mirisdr_replay_open(&t, path, NULL, 0);
+	if (r < 0)
+		return r;
 
-		libusb_get_device_descriptor(list[i], &dd);
+	r = t->ops->get_usb_strings(t, manufact, product, serial);
+	t->ops->close(t);
 
-		if (find_known_device(dd.idVendor, dd.idProduct))
-			device_count++;
+	return r;
+}
 
-		if (index == device_count - 1)
-			break;
+int mirisdr_get_index_by_serial(const char *serial)
+{
+	char str[256];
+	uint32_t i, cnt;
 
-		device = NULL;
-	}
+	if (!serial)
+		return -1;
 
-	if (!device) {
-		r = -1;
-		goto err;
-	}
+	cnt = mirisdr_get_device_count();
+	if (!cnt)
+		return -2;
 
-	r = libusb_open(device, &dev->devh);
-	if (r < 0) {
-		libusb_free_device_list(list, 1);
-		fprintf(stderr, "usb_open error %d\n", r);
-		goto err;
+	for (i = 0; i < cnt; i++) {
+		if (mirisdr_get_device_usb_strings(i, NULL, NULL, str) < 0)
+			continue;
+
+		if (!strcmp(serial, str))
+			return i;
 	}
 
-	libusb_free_device_list(list, 1);
+	return -3;
+}
+
+/* common part of opening a device, takes ownership of the transport */
+static int _mirisdr_open(mirisdr_dev_t **out_dev, mirisdr_transport_t *t,
+			 uint64_t start)
+{
+	mirisdr_dev_t *dev = NULL;
+	int r;
 
-	r = libusb_claim_interface(dev->devh, 0);
-	if (r < 0) {
-		fprintf(stderr, "usb_claim_interface error %d\n", r);
-		goto err;
+	dev = malloc(sizeof(mirisdr_dev_t));
+	if (NULL == dev) {
+		t->ops->close(t);
+		return -ENOMEM;
 	}
 
+	memset(dev, 0, sizeof(mirisdr_dev_t));
+
+	pthread_mutex_init(&dev->sync_lock, NULL);
+	pthread_cond_init(&dev->sync_cond, NULL);
+
+	dev->transport = t;
 	dev->adc_clock = DEF_ADC_FREQ;
+	_mirisdr_rate_table(dev);
+	mirisdr_decoder_init(&dev->dec, MIRISDR_FORMAT_CS16);
+	mirisdr_set_transfer_geometry(dev, DEFAULT_BUF_NUMBER, DEFAULT_ISO_PACKETS);
+
+	/* the whole init sequence goes out in one batch */
+	mirisdr_reg_batch_begin(dev);
 
 	mirisdr_init_baseband(dev);
 
@@ -588,366 +991,1552 @@ int mirisdr_open(mirisdr_dev_t **out_dev, uint32_t index)
 
 	if (dev->tuner->init) {
 		r = dev->tuner->init(dev);
+		if (r < 0) {
+			/* no half done init goes out to the device */
+			_mirisdr_batch_discard(dev);
+			log_err("tuner init failed: %d", r);
+			goto err;
+		}
+	}
+
+	/* every init write goes out here, a failure loses all of them */
+	r = mirisdr_reg_batch_end(dev);
+	if (r < 0) {
+		log_err("device init failed: %d", r);
+		goto err;
+	}
+
+	/* alternate setting of the streaming interface */
+	r = t->ops->activate(t);
+	if (r < 0) {
+		log_err("failed to activate the interface: %d", r);
+		goto err;
 	}
 
-	r = libusb_set_interface_alt_setting(dev->devh, 0, 1);
+	dev->open_us = _mirisdr_now_us() - start;
 
 	*out_dev = dev;
 
 	return 0;
+
 err:
-	if (dev) {
-		if (dev->ctx)
-			libusb_exit(dev->ctx);
+	t->ops->close(t);
+	pthread_mutex_destroy(&dev->sync_lock);
+	pthread_cond_destroy(&dev->sync_cond);
+	free(dev);
 
-		free(dev);
+	return r;
+}
+
+int mirisdr_open(mirisdr_dev_t **out_dev, uint32_t index)
+{
+	mirisdr_transport_t *t;
+	const char *path = _mirisdr_replay_path();
+	const char *pace;
+	uint64_t start = _mirisdr_now_us();
+	int flags = 0;
+	int r;
+
+	if (path) {
+		pace = getenv("MIRISDR_REPLAY_PACE");
+		if (pace && !strcmp(pace, "realtime"))
+			flags |= MIRISDR_REPLAY_REALTIME;
+
+		if (getenv("MIRISDR_REPLAY_LOOP"))
+			flags |= MIRISDR_REPLAY_LOOP;
+
+		r = mirisdr_replay_open(&t, path, getenv("MIRISDR_REPLAY_REGS"),
+					flags);
+	} else {
+		r = mirisdr_usb_open(&t, index);
 	}
 
-	return r;
+	if (r < 0)
+		return r;
+
+	return _mirisdr_open(out_dev, t, start);
 }
 
-int mirisdr_close(mirisdr_dev_t *dev)
+int mirisdr_open_by_serial(mirisdr_dev_t **out_dev, const char *serial)
 {
-	if (!dev)
+	int index = mirisdr_get_index_by_serial(serial);
+
+	if (index < 0)
+		return index;
+
+	return mirisdr_open(out_dev, index);
+}
+
+int mirisdr_open_context(mirisdr_dev_t **out_dev, mirisdr_context_t *c,
+			 uint32_t index)
+{
+	mirisdr_transport_t *t;
+	mirisdr_dev_t *dev;
+	uint64_t start = _mirisdr_now_us();
+	int i, shard = 0, r;
+
+	if (!out_dev || !c)
 		return -1;
 
-	mirisdr_deinit_baseband(dev);
+	/* the thread serving the fewest devices */
+	pthread_mutex_lock(&c->lock);
+	for (i = 1; i < c->num; i++) {
+		if (c->shards[i].devices < c->shards[shard].devices)
+			shard = i;
+	}
+	c->shards[shard].devices++;
+	pthread_mutex_unlock(&c->lock);
+
+	r = mirisdr_usb_pool_open(&t, index, c->usb, shard);
+	if (r >= 0)
+		r = _mirisdr_open(&dev, t, start);
 
-	libusb_release_interface(dev->devh, 0);
-	libusb_close(dev->devh);
+	pthread_mutex_lock(&c->lock);
+	if (r < 0) {
+		c->shards[shard].devices--;
+	} else {
+		dev->ctx = c;
+		dev->ctx_shard = shard;
+		dev->ctx_next = c->devs;
+		c->devs = dev;
+	}
+	pthread_mutex_unlock(&c->lock);
 
-	libusb_exit(dev->ctx);
+	if (r < 0)
+		return r;
 
-	free(dev);
+	*out_dev = dev;
 
 	return 0;
 }
 
-int mirisdr_reset_buffer(mirisdr_dev_t *dev)
+int mirisdr_open_replay(mirisdr_dev_t **out_dev, const char *path,
+			const char *reg_log, int flags)
 {
-	if (!dev)
+	mirisdr_transport_t *t;
+	uint64_t start = _mirisdr_now_us();
+	int r;
+
+	if (!path)
 		return -1;
 
-	/* TODO: implement */
+	r = mirisdr_replay_open(&t, path, reg_log, flags);
+	if (r < 0)
+		return r;
 
-	return 0;
+	return _mirisdr_open(out_dev, t, start);
 }
 
-int mirisdr_read_sync(mirisdr_dev_t *dev, void *buf, int len, int *n_read)
+struct mirisdr_open_req {
+	pthread_t thread;
+	mirisdr_context_t *ctx;
+	uint32_t index;
+	mirisdr_open_cb_t cb;
+	void *cb_ctx;
+	mirisdr_dev_t *dev;
+	int status;
+	atomic_int done;
+};
+
+static void *_mirisdr_open_thread(void *arg)
 {
-	if (!dev)
-		return -1;
+	mirisdr_open_req_t *req = (mirisdr_open_req_t *)arg;
+	mirisdr_dev_t *dev = NULL;
+	int r;
 
-//	return libusb_bulk_transfer(dev->devh, 0x86, buf, len, n_read, BULK_TIMEOUT);
-	return -1;
+	if (req->ctx)
+		r = mirisdr_open_context(&dev, req->ctx, req->index);
+	else
+		r = mirisdr_open(&dev, req->index);
+
+	req->dev = r < 0 ? NULL : dev;
+	req->status = r;
+
+	if (req->cb)
+		req->cb(req->dev, r, req->cb_ctx);
+
+	atomic_store(&req->done, 1);
+
+	return NULL;
 }
 
-void hexdump(uint8_t *inbuf, int cnt)
+int mirisdr_open_async(mirisdr_open_req_t **out_req, mirisdr_context_t *c,
+		       uint32_t index, mirisdr_open_cb_t cb, void *cb_ctx)
 {
-	int i;
-	for (i = 0; i < cnt; i++) {
-		printf("%02x ", inbuf[i]);
+	mirisdr_open_req_t *req;
+	int r;
+
+	if (!out_req)
+		return -1;
+
+	req = calloc(1, sizeof(mirisdr_open_req_t));
+	if (!req)
+		return -ENOMEM;
+
+	req->ctx = c;
+	req->index = index;
+	req->cb = cb;
+	req->cb_ctx = cb_ctx;
+	atomic_init(&req->done, 0);
+
+	r = pthread_create(&req->thread, NULL, _mirisdr_open_thread, req);
+	if (r) {
+		free(req);
+		return -r;
 	}
-	printf("\n");
+
+	*out_req = req;
+
+	return 0;
+}
+
+int mirisdr_open_done(mirisdr_open_req_t *req)
+{
+	if (!req)
+		return -1;
+
+	return atomic_load(&req->done);
 }
 
-int mirisdr_convert_samples(mirisdr_dev_t *dev, unsigned char* inbuf, int16_t *outsamples, int length)
+int mirisdr_open_finish(mirisdr_open_req_t *req, mirisdr_dev_t **dev)
 {
-	int i, j, k, l, block;
-	uint32_t offs;
-	uint8_t *ip;
-	uint32_t address;
-	int op = 0;
+	int r;
 
-	ip = inbuf;
+	if (!req)
+		return -1;
 
-	block = length / 1024;
-	while (block--) {
-		/* parse header */
-#if 1
-		address = ip[1] + (ip[2] << 8) + (ip[3] << 16);
-		if (address != dev->addr)
-			fprintf(stderr, "Lost samples!\n");
+	pthread_join(req->thread, NULL);
 
-		dev->addr = address + (ip[0] >> 7) + 1;
+	if (dev)
+		*dev = req->dev;
+	r = req->status;
 
-		if (((ip[5] & 0x40) && dev->headerflag)) {
-			hexdump(ip, 16);
-			dev->headerflag = 0;
-		} else if ((!(ip[5] & 0x40) && !dev->headerflag)) {
-			hexdump(ip, 16);
-			dev->headerflag = 1;
-		}
-#endif
+	free(req);
 
-		/* skip header */
-		ip += 16;
-
-		/* 16-sample-ips per block */
-		k = 6;
-		while (k--) {
-			uint32_t flag;
-			for (j = 0; j < 16; j++) {
-				for (i = 0; i < 10; i += 5) {
-					outsamples[op++] = (ip[i+0] << 6) | ((ip[i+1] & 0x03) << 14);
-					outsamples[op++] = ((ip[i+1] & 0xfc) << 4) | ((ip[i+2] & 0x0f) << 12);
-					outsamples[op++] = ((ip[i+2] & 0xf0) << 2) | ((ip[i+3] & 0x3f) << 10);
-					outsamples[op++] = (ip[i+3] & 0xc0) | (ip[i+4] << 8);
-				}
-				/* 10 bytes per 8 samples */
-				ip += 10;
-			}
+	return r;
+}
 
-			flag = *(uint32_t*)ip;
-			flag = 0;
-			for (j = 0; j < 16; j++) {
-#ifdef USE_SSE
-				/* Hoernchen's SSE accelerated version */
-				__m128i* addr = (__m128i*)&(outsamples[op-128+j*8+0]);
-				__m128i v;
-				switch(flag & 0x3) {
-				case 0:
-					v = _mm_loadu_si128(addr);
-					v = _mm_srai_epi16(v, 2);
-					_mm_storeu_si128(addr, v);
-					break;
-				case 1:
-					v = _mm_loadu_si128(addr);
-					v = _mm_srai_epi16(v, 1);
-					_mm_storeu_si128(addr, v);
-					break;
-				case 2:
-				case 3:
-					break;
-				}
-
-#else
-				switch (flag & 0x03) {
-				case 0:
-					outsamples[op-128+j*8+0] >>= 2;
-					outsamples[op-128+j*8+1] >>= 2;
-					outsamples[op-128+j*8+2] >>= 2;
-					outsamples[op-128+j*8+3] >>= 2;
-					outsamples[op-128+j*8+4] >>= 2;
-					outsamples[op-128+j*8+5] >>= 2;
-					outsamples[op-128+j*8+6] >>= 2;
-					outsamples[op-128+j*8+7] >>= 2;
-					break;
-				case 1:
-					outsamples[op-128+j*8+0] >>= 1;
-					outsamples[op-128+j*8+1] >>= 1;
-					outsamples[op-128+j*8+2] >>= 1;
-					outsamples[op-128+j*8+3] >>= 1;
-					outsamples[op-128+j*8+4] >>= 1;
-					outsamples[op-128+j*8+5] >>= 1;
-					outsamples[op-128+j*8+6] >>= 1;
-					outsamples[op-128+j*8+7] >>= 1;
-					break;
-				case 2:
-				case 3:
-					break;
-
-				}
-#endif
-				flag >>= 2;
-			}
-			/* flagbytes */
-			ip += 4;
+static void _mirisdr_sync_stop(mirisdr_dev_t *dev);
+
+/* take the device off its context, after its stream has ended */
+static void _mirisdr_context_remove(mirisdr_dev_t *dev)
+{
+	mirisdr_context_t *c = dev->ctx;
+	mirisdr_dev_t **p;
+
+	pthread_mutex_lock(&c->lock);
+	for (p = &c->devs; *p; p = &(*p)->ctx_next) {
+		if (*p == dev) {
+			*p = dev->ctx_next;
+			break;
 		}
-		ip += 24;
 	}
+	c->shards[dev->ctx_shard].devices--;
+	pthread_mutex_unlock(&c->lock);
+}
+
+int mirisdr_close(mirisdr_dev_t *dev)
+{
+	if (!dev)
+		return -1;
+
+	_mirisdr_sync_stop(dev);
+
+	if (dev->ctx) {
+		mirisdr_stop_async(dev);
+		_mirisdr_context_remove(dev);
+	}
+
+	mirisdr_deinit_baseband(dev);
+
+	mirisdr_set_buffer_pool(dev, NULL, 0, 0);
+	mirisdr_set_hop_list(dev, NULL, 0);
+
+	dev->transport->ops->close(dev->transport);
+
+	pthread_mutex_destroy(&dev->sync_lock);
+	pthread_cond_destroy(&dev->sync_cond);
+	free(dev);
 
-	return op;
-//	fwrite(outsamples, op * sizeof(uint16_t) , 1, file);
+	return 0;
 }
 
-static void LIBUSB_CALL _libusb_callback(struct libusb_transfer *xfer)
+/* count lost samples, given at the device rate, at the output rate */
+static void _mirisdr_count_lost(mirisdr_dev_t *dev, uint64_t samples)
 {
-	int i, len, total_len = 0;
-	static unsigned char* iso_packet_buf;
-	mirisdr_dev_t *dev = (mirisdr_dev_t *)xfer->user_data;
-	int16_t outsamples[768 * 3 * 8];
+	if (dev->decim)
+		samples = samples * dev->out_rate / dev->rate;
 
-//	if (xfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
-	for (i = 0; i < xfer->num_iso_packets; i++) {
-		struct libusb_iso_packet_descriptor *pack = &xfer->iso_packet_desc[i];
+	STATS_ADD(dev, samples_lost, samples);
+}
 
-		if (pack->status != LIBUSB_TRANSFER_COMPLETED) {
-//			fprintf(stderr, "transfer status: %d\n", xfer->status);
-//			mirisdr_cancel_async(dev); /* abort async loop */
-		}
+/*
+ * Check the block address counter for lost blocks. Returns the number of
+ * blocks missing before this one, MIRISDR_DECODER_RESET if the counter
+ * jumped back.
+ */
+static int32_t _mirisdr_parse_header(mirisdr_dev_t *dev, const uint8_t *ip)
+{
+	int32_t gap = mirisdr_decoder_check(&dev->dec, ip);
 
-		if (pack->actual_length > 0) {
-			iso_packet_buf =  libusb_get_iso_packet_buffer_simple(xfer, i);
-			if (iso_packet_buf) {
-				len = mirisdr_convert_samples(dev, iso_packet_buf, outsamples + total_len, pack->actual_length);
-				total_len += len;
-			}
-//			if (pack->actual_length != 3072)
-//				fprintf(stderr, "pack%u length:%u, actual_length:%u\n", i, pack->length, pack->actual_length);
-		}
+	if (gap) {
+		STATS_ADD(dev, discontinuities, 1);
+		if (gap > 0)
+			_mirisdr_count_lost(dev, (uint64_t)gap * (MIRISDR_BLOCK_SAMPLES / 2));
 	}
 
-	if (dev->cb && total_len > 0)
-		dev->cb((uint8_t*)outsamples, total_len * sizeof(int16_t), dev->cb_ctx);
+	return gap;
+}
 
-	/* resubmit transfer */
-	if (libusb_submit_transfer(xfer) < 0) {
-		fprintf(stderr, "error re-submitting URB\n");
-		exit(1);
-	}
+static mirisdr_iqcorr_t *_mirisdr_corr(mirisdr_dev_t *dev)
+{
+	return dev->iqcorr.flags ? &dev->iqcorr : NULL;
 }
 
-static int _mirisdr_alloc_async_buffers(mirisdr_dev_t *dev)
+/*
+ * Convert length bytes of blocks to the output format, starting at complex
+ * sample pos of the output buffer. plane is the number of complex samples
+ * in the whole output buffer and only used by planar formats. Headers are
+ * not looked at, that is done by _mirisdr_parse_header().
+ *
+ * Returns the number of complex samples written.
+ */
+int mirisdr_convert_samples(mirisdr_dev_t *dev, unsigned char* inbuf, void *outbuf,
+			    uint32_t pos, uint32_t plane, int length)
+{
+	return mirisdr_decoder_convert(&dev->dec, _mirisdr_corr(dev), inbuf, outbuf,
+				       pos, plane, length / MIRISDR_BLOCK_LEN);
+}
+
+uint32_t mirisdr_get_output_buffer_len(mirisdr_dev_t *dev)
+{
+	if (!dev)
+		return 0;
+
+	if (!dev->dec.format->sample_size)
+		return (dev->xfer_buf_len / MIRISDR_BLOCK_LEN) * MIRISDR_BLOCK_LEN;
+
+	/* decimated output never grows, except for a little filter history */
+	return ((dev->xfer_buf_len / MIRISDR_BLOCK_LEN) * (MIRISDR_BLOCK_SAMPLES / 2) +
+		(dev->out_rate ? MIRISDR_DECIM_SLACK : 0)) *
+	       dev->dec.format->sample_size;
+}
+
+/* bytes of complex samples in the output format, raw blocks are whole */
+static uint32_t _mirisdr_out_bytes(mirisdr_dev_t *dev, uint32_t samples)
+{
+	if (!dev->dec.format->sample_size)
+		return samples / (MIRISDR_BLOCK_SAMPLES / 2) * MIRISDR_BLOCK_LEN;
+
+	return samples * dev->dec.format->sample_size;
+}
+
+static uint32_t _mirisdr_out_samples(mirisdr_dev_t *dev, uint32_t len)
+{
+	if (!dev->dec.format->sample_size)
+		return len / MIRISDR_BLOCK_LEN * (MIRISDR_BLOCK_SAMPLES / 2);
+
+	return len / dev->dec.format->sample_size;
+}
+
+int mirisdr_set_buffer_pool(mirisdr_dev_t *dev, void **bufs, uint32_t buf_num,
+			    uint32_t buf_len)
 {
-	unsigned int i;
+	uint32_t i;
 
 	if (!dev)
 		return -1;
 
-	if (!dev->xfer) {
-		dev->xfer = malloc(dev->xfer_buf_num *
-				   sizeof(struct libusb_transfer *));
+	if (mirisdr_INACTIVE != dev->async_status)
+		return -2;
 
-		for(i = 0; i < dev->xfer_buf_num; ++i)
-			dev->xfer[i] = libusb_alloc_transfer(dev->xfer_iso_pack);
+	if (dev->pool) {
+		free(dev->pool);
+		free(dev->pool_busy);
+		dev->pool = NULL;
+		dev->pool_busy = NULL;
+		dev->pool_num = 0;
 	}
 
-	if (!dev->xfer_buf) {
-		dev->xfer_buf = malloc(dev->xfer_buf_num *
-					   sizeof(unsigned char *));
+	if (!bufs || !buf_num)
+		return 0;
+
+	dev->pool = malloc(buf_num * sizeof(void *));
+	dev->pool_busy = malloc(buf_num * sizeof(atomic_int));
+	if (!dev->pool || !dev->pool_busy) {
+		free(dev->pool);
+		free(dev->pool_busy);
+		dev->pool = NULL;
+		dev->pool_busy = NULL;
+		return -ENOMEM;
+	}
 
-		for(i = 0; i < dev->xfer_buf_num; ++i)
-			dev->xfer_buf[i] = malloc(dev->xfer_buf_len);
+	for (i = 0; i < buf_num; i++) {
+		dev->pool[i] = bufs[i];
+		atomic_init(&dev->pool_busy[i], 0);
 	}
 
-	printf("%s\n", __FUNCTION__);
+	dev->pool_num = buf_num;
+	dev->pool_len = buf_len;
+	dev->pool_next = 0;
+
 	return 0;
 }
 
-static int _mirisdr_free_async_buffers(mirisdr_dev_t *dev)
+int mirisdr_release_buffer(mirisdr_dev_t *dev, void *buf)
 {
-	unsigned int i;
+	uint32_t i;
 
 	if (!dev)
 		return -1;
 
-	if (dev->xfer) {
-		for(i = 0; i < dev->xfer_buf_num; ++i) {
-			if (dev->xfer[i]) {
-				libusb_free_transfer(dev->xfer[i]);
-			}
+	for (i = 0; i < dev->pool_num; i++) {
+		if (dev->pool[i] == buf) {
+			atomic_store_explicit(&dev->pool_busy[i], 0, memory_order_release);
+			return 0;
 		}
-
-		free(dev->xfer);
-		dev->xfer = NULL;
 	}
 
-	if (dev->xfer_buf) {
-		for(i = 0; i < dev->xfer_buf_num; ++i) {
-			if (dev->xfer_buf[i])
-				free(dev->xfer_buf[i]);
-		}
+	return -1;
+}
+
+/*
+ * Borrow the next free caller buffer. Only the event thread takes buffers,
+ * so a plain store is enough to mark one busy, any thread may release.
+ */
+static void *_mirisdr_pool_get(mirisdr_dev_t *dev)
+{
+	uint32_t i, n;
 
-		free(dev->xfer_buf);
-		dev->xfer_buf = NULL;
+	for (i = 0; i < dev->pool_num; i++) {
+		n = (dev->pool_next + i) % dev->pool_num;
+
+		if (!atomic_load_explicit(&dev->pool_busy[n], memory_order_acquire)) {
+			atomic_store_explicit(&dev->pool_busy[n], 1, memory_order_relaxed);
+			dev->pool_next = n + 1;
+			return dev->pool[n];
+		}
 	}
 
-	return 0;
+	return NULL;
 }
 
-int mirisdr_read_async(mirisdr_dev_t *dev, mirisdr_read_async_cb_t cb, void *ctx,
-		       uint32_t buf_num, uint32_t buf_len)
+/* hand a buffer to the callback, or back to the pool if there is none */
+static void _mirisdr_emit(mirisdr_dev_t *dev, void *out, uint32_t samples,
+			  uint32_t flags)
 {
-	unsigned int i;
-	int r, num_iso_pack = 8;
-	struct timeval tv = { 1, 0 };
+	mirisdr_buffer_info_t info;
+	uint32_t len = _mirisdr_out_bytes(dev, samples);
+
+	info.sample_index = dev->sample_index;
+	info.samples = samples;
+	info.flags = dev->buf_flags | flags;
+	info.center_freq = dev->freq;
+
+	dev->sample_index += samples;
+	dev->buf_flags = 0;
+
+	if (dev->cb_ex)
+		dev->cb_ex((uint8_t *)out, len, &info, dev->cb_ctx);
+	else if (dev->cb)
+		dev->cb((uint8_t *)out, len, dev->cb_ctx);
+	else if (dev->pool_num)
+		mirisdr_release_buffer(dev, out);
+}
 
-	if (!dev)
-		return -1;
+/* rate of the samples handed out */
+static uint32_t _mirisdr_out_rate(mirisdr_dev_t *dev)
+{
+	if (dev->decim)
+		return dev->out_rate;
 
-	dev->cb = cb;
-	dev->cb_ctx = ctx;
+	return dev->rate ? dev->rate : DEF_SAMPLE_RATE;
+}
+
+/*
+ * Advance the index over samples that are not handed out, given at the
+ * device rate. The remainder of a decimated sample is carried over so the
+ * index does not drift.
+ */
+static void _mirisdr_skip(mirisdr_dev_t *dev, uint64_t samples)
+{
+	uint64_t n;
 
-//	if (buf_num > 0)
-//		dev->xfer_buf_num = buf_num;
+	if (!dev->decim) {
+		dev->sample_index += samples;
+		return;
+	}
 
-//	else
-		dev->xfer_buf_num = DEFAULT_BUF_NUMBER;
-		dev->xfer_iso_pack = DEFAULT_ISO_PACKETS;
+	/* the filters would smear the samples before and after the hole */
+	mirisdr_decim_reset(dev->decim);
 
-//	if (buf_len > 0 && buf_len % 512 == 0) /* len must be multiple of 512 */
-//		dev->xfer_buf_len = buf_len;
-//	else
-		dev->xfer_buf_len = DEFAULT_BUF_LENGTH;
+	n = dev->skip_frac + samples * dev->out_rate;
+	dev->sample_index += n / dev->rate;
+	dev->skip_frac = n % dev->rate;
+}
 
-	_mirisdr_alloc_async_buffers(dev);
+/* output buffer for the next callback, NULL if all caller buffers are out */
+static void *_mirisdr_get_out(mirisdr_dev_t *dev, uint32_t samples)
+{
+	void *out = dev->pool_num ? _mirisdr_pool_get(dev) : dev->out_buf;
+
+	/* samples are lost, keep the index and tell the next buffer */
+	if (!out) {
+		STATS_ADD(dev, overruns, 1);
+		_mirisdr_count_lost(dev, samples);
+		_mirisdr_skip(dev, samples);
+		dev->buf_flags |= MIRISDR_BUF_DISCONTINUITY;
+	}
 
-	for(i = 0; i < dev->xfer_buf_num; ++i) {
-		libusb_fill_iso_transfer(dev->xfer[i],
-					  dev->devh,
-					  0x81,
-					  dev->xfer_buf[i],
-					  dev->xfer_buf_len,
-					  num_iso_pack,
-					  _libusb_callback,
-					  (void *)dev,
-					  ISO_TIMEOUT);
+	return out;
+}
 
-		libusb_set_iso_packet_lengths(dev->xfer[i],
-					      dev->xfer_buf_len/dev->xfer_iso_pack);
+/* a buffer that ended up without samples */
+static void _mirisdr_put_out(mirisdr_dev_t *dev, void *out)
+{
+	if (dev->pool_num)
+		mirisdr_release_buffer(dev, out);
+}
 
-		libusb_submit_transfer(dev->xfer[i]);
+/*
+ * Account for lost blocks, either by zero samples or by a flag. The lost
+ * samples are already counted. Zeros are limited per transfer, so a long
+ * gap does not keep the event thread from resubmitting the transfer.
+ */
+static void _mirisdr_gap(mirisdr_dev_t *dev, int32_t gap)
+{
+	uint32_t max = (dev->xfer_buf_len / MIRISDR_BLOCK_LEN) * (MIRISDR_BLOCK_SAMPLES / 2);
+	uint64_t n = gap > 0 ? (uint64_t)gap * (MIRISDR_BLOCK_SAMPLES / 2) : 0;
+	uint32_t len;
+	void *out;
+
+	uint32_t samples;
+
+	/* the counter of raw blocks shows the gap */
+	if (gap == MIRISDR_DECODER_RESET || !dev->zero_fill || n > dev->fill_left ||
+	    !dev->dec.format->sample_size) {
+		if (n)
+			_mirisdr_skip(dev, n);
+		dev->buf_flags |= MIRISDR_BUF_DISCONTINUITY;
+		return;
 	}
 
-	dev->async_status = mirisdr_RUNNING;
+	dev->fill_left -= n;
 
-	while (mirisdr_INACTIVE != dev->async_status) {
-		r = libusb_handle_events_timeout(dev->ctx, &tv);
-		if (r < 0) {
-			fprintf(stderr, "handle_events returned: %d\n", r);
-			if (r == LIBUSB_ERROR_INTERRUPTED) /* stray signal */
+	for (; n; n -= len) {
+		len = min(n, max);
+
+		/* out of caller buffers, the rest of the gap is skipped */
+		out = dev->pool_num ? _mirisdr_pool_get(dev) : dev->out_buf;
+		if (!out) {
+			STATS_ADD(dev, overruns, 1);
+			_mirisdr_skip(dev, n);
+			dev->buf_flags |= MIRISDR_BUF_DISCONTINUITY;
+			return;
+		}
+
+		/* zeros go through the filters too, that keeps the timing */
+		if (dev->decim) {
+			samples = mirisdr_decim_zeros(dev->decim, dev->dec.format, len, out);
+			if (!samples) {
+				_mirisdr_put_out(dev, out);
 				continue;
-			break;
+			}
+		} else {
+			samples = len;
+			memset(out, dev->dec.format->zero, len * dev->dec.format->sample_size);
 		}
 
-		if (mirisdr_CANCELING == dev->async_status) {
-			dev->async_status = mirisdr_INACTIVE;
+		_mirisdr_emit(dev, out, samples, MIRISDR_BUF_ZERO_FILLED);
+	}
+}
 
-			if (!dev->xfer)
-				break;
+/* convert a run of blocks without gaps into one output buffer */
+static void _mirisdr_emit_blocks(mirisdr_dev_t *dev, unsigned char **blocks,
+				 uint32_t n)
+{
+	uint32_t i, pos = 0, samples = n * (MIRISDR_BLOCK_SAMPLES / 2);
+	void *out;
+
+	if (!(out = _mirisdr_get_out(dev, samples)))
+		return;
+
+	if (dev->decim) {
+		samples = mirisdr_decim_blocks(dev->decim, dev->dec.unpack, dev->dec.format,
+					       _mirisdr_corr(dev), blocks, n, out);
+		if (samples)
+			_mirisdr_emit(dev, out, samples, 0);
+		else
+			_mirisdr_put_out(dev, out);
+		return;
+	}
 
-			for(i = 0; i < dev->xfer_buf_num; ++i) {
-				if (!dev->xfer[i])
-					continue;
+	for (i = 0; i < n; i++)
+		pos += mirisdr_convert_samples(dev, blocks[i], out, pos, samples,
+					       MIRISDR_BLOCK_LEN);
 
-				if (dev->xfer[i]->status == LIBUSB_TRANSFER_COMPLETED) {
-					libusb_cancel_transfer(dev->xfer[i]);
-					dev->async_status = mirisdr_CANCELING;
-				}
-			}
+	_mirisdr_emit(dev, out, samples, 0);
+}
 
-			if (mirisdr_INACTIVE == dev->async_status)
-				break;
-		}
+static uint64_t _mirisdr_us_to_samples(mirisdr_dev_t *dev, uint32_t us)
+{
+	return (uint64_t)us * _mirisdr_out_rate(dev) / 1000000;
+}
+
+static void _mirisdr_hop_tuned(void *ctx, int status)
+{
+	mirisdr_dev_t *dev = (mirisdr_dev_t *)ctx;
+
+	if (status < 0) {
+		log_err("retune to %u Hz failed: %d",
+			dev->hops[dev->hop_cur].freq, status);
+		_mirisdr_reg_invalidate(dev);
+		msi001_reset(&dev->msi001);
+		dev->hop_state = HOP_FAILED;
+		return;
 	}
 
-	_mirisdr_free_async_buffers(dev);
+	/* the next transfer may still hold samples from before the retune */
+	dev->freq = dev->hops[dev->hop_cur].freq;
+	dev->hop_settle = _mirisdr_us_to_samples(dev, dev->hops[dev->hop_cur].settle_us);
+	dev->hop_dwell = _mirisdr_us_to_samples(dev, dev->hops[dev->hop_cur].dwell_us);
+	dev->hop_end_valid = 0;
+	dev->hop_state = HOP_SETTLE;
 
-	return r;
+	/* the LO leaks differently at the new frequency */
+	mirisdr_iqcorr_reset(&dev->iqcorr);
 }
 
-int mirisdr_cancel_async(mirisdr_dev_t *dev)
+/* queue the tuner writes for the current hop, completes in _mirisdr_hop_tuned() */
+static void _mirisdr_hop_retune(mirisdr_dev_t *dev)
 {
-	if (!dev)
-		return -1;
+	mirisdr_transport_t *t = dev->transport;
+	int r;
 
-	if (mirisdr_RUNNING == dev->async_status) {
-		dev->async_status = mirisdr_CANCELING;
+	dev->hop_state = HOP_TUNING;
+
+	dev->ctrl_batch_depth++;
+	r = msi001_apply(dev, &dev->msi001, &dev->hop_plan->entries[dev->hop_cur]);
+	dev->ctrl_batch_depth--;
+
+	/* nothing changed, e.g. a single entry list */
+	if (r >= 0 && !dev->ctrl_batch_num) {
+		_mirisdr_hop_tuned(dev, 0);
+		return;
+	}
+
+	if (r >= 0)
+		r = t->ops->control_submit(t, dev->ctrl_batch, dev->ctrl_batch_num,
+					   _mirisdr_hop_tuned, dev);
+	dev->ctrl_batch_num = 0;
+
+	if (r < 0)
+		_mirisdr_hop_tuned(dev, r);
+}
+
+/* blocks dropped from the start of a run, n in total */
+static uint32_t _mirisdr_hop_drop(mirisdr_dev_t *dev, uint32_t n)
+{
+	uint32_t i;
+
+	if (!dev->hop_num || dev->hop_state == HOP_DWELL)
 		return 0;
+
+	if (dev->hop_state != HOP_SETTLE || !dev->hop_end_valid) {
+		_mirisdr_skip(dev, (uint64_t)n * (MIRISDR_BLOCK_SAMPLES / 2));
+		return n;
 	}
 
-	return -2;
+	for (i = 0; i < n && dev->sample_index < dev->hop_end; i++)
+		_mirisdr_skip(dev, MIRISDR_BLOCK_SAMPLES / 2);
+
+	if (dev->sample_index >= dev->hop_end) {
+		dev->hop_state = HOP_DWELL;
+		dev->hop_end = dev->sample_index + dev->hop_dwell;
+		dev->buf_flags |= MIRISDR_BUF_RETUNED;
+	}
+
+	return i;
+}
+
+/* at the end of every transfer, the only place retunes are started */
+static void _mirisdr_hop_next(mirisdr_dev_t *dev)
+{
+	switch (dev->hop_state) {
+	case HOP_DWELL:
+		if (dev->sample_index < dev->hop_end)
+			break;
+
+		dev->hop_cur = (dev->hop_cur + 1) % dev->hop_num;
+		_mirisdr_hop_retune(dev);
+		break;
+	case HOP_FAILED:
+		_mirisdr_hop_retune(dev);
+		break;
+	case HOP_SETTLE:
+		/* this transfer was dropped whole, the settle time starts here */
+		if (!dev->hop_end_valid) {
+			dev->hop_end = dev->sample_index + dev->hop_settle;
+			dev->hop_end_valid = 1;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/* called by the transport for every completed transfer */
+static void _mirisdr_process_packets(void *ctx, const mirisdr_packet_t *pkts,
+				     int num)
+{
+	int i;
+	uint32_t j, k, n, nblocks = 0;
+	uint64_t us;
+	int32_t gap;
+	mirisdr_dev_t *dev = (mirisdr_dev_t *)ctx;
+
+	STATS_ADD(dev, transfers, 1);
+	STATS_ADD(dev, iso_packets, num);
+
+	dev->fill_left = (uint64_t)MAX_FILL_BUFFERS *
+			 (dev->xfer_buf_len / MIRISDR_BLOCK_LEN) * (MIRISDR_BLOCK_SAMPLES / 2);
+
+	/* collect the blocks of all packets, checking the address counter */
+	for (i = 0; i < num; i++) {
+		const mirisdr_packet_t *pack = &pkts[i];
+
+		if (pack->status != MIRISDR_PACKET_COMPLETED &&
+		    pack->status < MIRISDR_ISO_STATUS_NUM)
+			STATS_ADD(dev, iso_errors[pack->status], 1);
+
+		if (pack->actual_length < pack->length)
+			STATS_ADD(dev, short_packets, 1);
+
+		if (pack->actual_length == 0 || !pack->buf)
+			continue;
+
+		for (j = 0; j < pack->actual_length / MIRISDR_BLOCK_LEN; j++) {
+			dev->blocks[nblocks] = pack->buf + j * MIRISDR_BLOCK_LEN;
+			dev->block_gap[nblocks] = _mirisdr_parse_header(dev, dev->blocks[nblocks]);
+			nblocks++;
+		}
+	}
+
+	if (nblocks && !atomic_load_explicit(&dev->stats.first_sample_us,
+					     memory_order_relaxed)) {
+		us = _mirisdr_now_us() - dev->stream_start;
+		atomic_store_explicit(&dev->stats.first_sample_us, us ? us : 1,
+				      memory_order_relaxed);
+	}
+
+	/* one buffer per run of contiguous blocks */
+	for (j = 0; j < nblocks; j = k) {
+		for (k = j + 1; k < nblocks && !dev->block_gap[k]; k++)
+			;
+
+		/* lost blocks inside the settle time need no accounting */
+		gap = dev->block_gap[j];
+		if (gap > 0)
+			gap -= _mirisdr_hop_drop(dev, gap);
+
+		if (gap)
+			_mirisdr_gap(dev, gap);
+
+		/* samples taken while retuning are dropped */
+		n = _mirisdr_hop_drop(dev, k - j);
+		if (n < k - j)
+			_mirisdr_emit_blocks(dev, dev->blocks + j + n, k - j - n);
+	}
+
+	if (dev->hop_num)
+		_mirisdr_hop_next(dev);
+}
+
+static int _mirisdr_alloc_async_buffers(mirisdr_dev_t *dev)
+{
+	if (!dev)
+		return -1;
+
+	if (!dev->blocks) {
+		dev->blocks = malloc((dev->xfer_buf_len / MIRISDR_BLOCK_LEN) *
+				     sizeof(unsigned char *));
+		dev->block_gap = malloc((dev->xfer_buf_len / MIRISDR_BLOCK_LEN) *
+					sizeof(int32_t));
+	}
+
+	/* converted samples of one transfer, handed to the callback */
+	if (!dev->out_buf && !dev->pool_num)
+		dev->out_buf = malloc(_mirisdr_out_bytes(dev,
+				(dev->xfer_buf_len / MIRISDR_BLOCK_LEN) *
+				(MIRISDR_BLOCK_SAMPLES / 2)));
+
+	if (!dev->blocks || !dev->block_gap || (!dev->out_buf && !dev->pool_num))
+		return -ENOMEM;
+
+	mirisdr_iqcorr_reset(&dev->iqcorr);
+
+	/* filters are set up for the rate the stream starts with */
+	if (dev->out_rate && !dev->dec.format->sample_size) {
+		log_warn("raw blocks are not decimated");
+	} else if (dev->out_rate && dev->out_rate < dev->rate) {
+		dev->decim = mirisdr_decim_create(dev->rate, dev->out_rate,
+				(dev->xfer_buf_len / MIRISDR_BLOCK_LEN) *
+				(MIRISDR_BLOCK_SAMPLES / 2));
+		if (!dev->decim)
+			return -ENOMEM;
+
+		dev->skip_frac = 0;
+	} else if (dev->out_rate) {
+		log_warn("output rate %u Hz is not below the sample rate, "
+			 "not decimating", dev->out_rate);
+	}
+
+	return 0;
+}
+
+static int _mirisdr_free_async_buffers(mirisdr_dev_t *dev)
+{
+	if (!dev)
+		return -1;
+
+	if (dev->out_buf) {
+		free(dev->out_buf);
+		dev->out_buf = NULL;
+	}
+
+	free(dev->blocks);
+	free(dev->block_gap);
+	dev->blocks = NULL;
+	dev->block_gap = NULL;
+
+	mirisdr_decim_free(dev->decim);
+	dev->decim = NULL;
+
+	return 0;
+}
+
+/* validate a geometry and make it the one of the next stream */
+static int _mirisdr_set_xfer(mirisdr_dev_t *dev, uint32_t buf_num,
+			     uint32_t iso_packets)
+{
+	if (!buf_num)
+		buf_num = DEFAULT_BUF_NUMBER;
+
+	if (!iso_packets)
+		iso_packets = DEFAULT_ISO_PACKETS;
+
+	if (buf_num > MAX_BUF_NUMBER || iso_packets > MAX_ISO_PACKETS ||
+	    (uint64_t)buf_num * iso_packets * ISO_PACKET_LENGTH > MAX_BUF_TOTAL) {
+		log_err("invalid transfer geometry %u x %u packets",
+			buf_num, iso_packets);
+		return -EINVAL;
+	}
+
+	dev->xfer_buf_num = buf_num;
+	dev->xfer_iso_pack = iso_packets;
+	dev->xfer_buf_len = iso_packets * ISO_PACKET_LENGTH;
+
+	return 0;
+}
+
+int mirisdr_set_transfer_geometry(mirisdr_dev_t *dev, uint32_t buf_num,
+				  uint32_t iso_packets)
+{
+	int r;
+
+	if (!dev)
+		return -1;
+
+	if (mirisdr_INACTIVE != dev->async_status)
+		return -2;
+
+	r = _mirisdr_set_xfer(dev, buf_num, iso_packets);
+	if (r < 0)
+		return r;
+
+	dev->geom_buf_num = dev->xfer_buf_num;
+	dev->geom_iso_pack = dev->xfer_iso_pack;
+
+	return 0;
+}
+
+int mirisdr_get_transfer_geometry(mirisdr_dev_t *dev, uint32_t *buf_num,
+				  uint32_t *iso_packets, uint32_t *buf_len)
+{
+	if (!dev)
+		return -1;
+
+	if (buf_num)
+		*buf_num = dev->xfer_buf_num;
+
+	if (iso_packets)
+		*iso_packets = dev->xfer_iso_pack;
+
+	if (buf_len)
+		*buf_len = dev->xfer_buf_len;
+
+	return 0;
+}
+
+/* set up and submit the transfers, events are handled by the caller */
+static int _mirisdr_async_begin(mirisdr_dev_t *dev, mirisdr_read_async_cb_t cb,
+				mirisdr_read_async_ex_cb_t cb_ex, void *ctx,
+				uint32_t buf_num, uint32_t buf_len)
+{
+	mirisdr_transport_t *t = dev->transport;
+	int r = 0;
+
+	if (buf_len > 0 && buf_len < ISO_PACKET_LENGTH) {
+		log_err("buffer length %u below one iso packet", buf_len);
+		return -EINVAL;
+	}
+
+	/*
+	 * A geometry given here applies to this stream only, buf_len is
+	 * rounded down to whole iso packets.
+	 */
+	if (buf_num > 0 || buf_len > 0) {
+		r = _mirisdr_set_xfer(dev,
+				buf_num ? buf_num : dev->geom_buf_num,
+				buf_len ? buf_len / ISO_PACKET_LENGTH : dev->geom_iso_pack);
+		if (r < 0)
+			return r;
+	}
+
+	dev->cb = cb;
+	dev->cb_ex = cb_ex;
+	dev->cb_ctx = ctx;
+	mirisdr_decoder_reset(&dev->dec);
+	dev->sample_index = 0;
+	dev->buf_flags = 0;
+	dev->async_canceled = 0;
+	dev->stream_start = _mirisdr_now_us();
+	atomic_store_explicit(&dev->stats.first_sample_us, 0,
+			      memory_order_relaxed);
+
+	if (dev->pool_num && dev->pool_len < mirisdr_get_output_buffer_len(dev)) {
+		log_err("caller buffers too small, need %u bytes",
+			mirisdr_get_output_buffer_len(dev));
+		r = -1;
+		goto err;
+	}
+
+	r = _mirisdr_alloc_async_buffers(dev);
+	if (r < 0)
+		goto err;
+
+	/* first hop, the event loop is not running yet so this may block */
+	if (dev->hop_num) {
+		dev->hop_cur = 0;
+
+		mirisdr_reg_batch_begin(dev);
+		r = msi001_apply(dev, &dev->msi001, &dev->hop_plan->entries[0]);
+		if (mirisdr_reg_batch_end(dev) < 0)
+			r = -1;
+
+		_mirisdr_hop_tuned(dev, r);
+	}
+
+	r = t->ops->stream_start(t, dev->xfer_buf_num, dev->xfer_iso_pack,
+				 ISO_PACKET_LENGTH, dev->rate,
+				 _mirisdr_process_packets, dev);
+	if (r < 0)
+		goto err;
+
+	dev->async_status = mirisdr_RUNNING;
+
+	return 0;
+err:
+	_mirisdr_free_async_buffers(dev);
+	_mirisdr_set_xfer(dev, dev->geom_buf_num, dev->geom_iso_pack);
+
+	return r;
+}
+
+/* after each round of events, returns 1 once every transfer is back */
+static int _mirisdr_async_step(mirisdr_dev_t *dev)
+{
+	mirisdr_transport_t *t = dev->transport;
+
+	/* cancel once, then wait for every transfer to come back */
+	if (mirisdr_CANCELING == dev->async_status && !dev->async_canceled) {
+		t->ops->stream_cancel(t);
+		dev->async_canceled = 1;
+	}
+
+	return !t->ops->stream_pending(t);
+}
+
+static void _mirisdr_async_end(mirisdr_dev_t *dev)
+{
+	mirisdr_transport_t *t = dev->transport;
+
+	t->ops->stream_free(t);
+	dev->async_status = mirisdr_INACTIVE;
+	_mirisdr_free_async_buffers(dev);
+
+	/* back to the geometry set by the user */
+	_mirisdr_set_xfer(dev, dev->geom_buf_num, dev->geom_iso_pack);
+}
+
+static int _mirisdr_read_async(mirisdr_dev_t *dev, mirisdr_read_async_cb_t cb,
+			       mirisdr_read_async_ex_cb_t cb_ex, void *ctx,
+			       uint32_t buf_num, uint32_t buf_len)
+{
+	mirisdr_transport_t *t;
+	int r;
+
+	if (!dev)
+		return -1;
+
+	if (dev->ctx_streaming)
+		return -2;
+
+	t = dev->transport;
+
+	r = _mirisdr_async_begin(dev, cb, cb_ex, ctx, buf_num, buf_len);
+	if (r < 0)
+		return r;
+
+	while (mirisdr_INACTIVE != dev->async_status) {
+		r = t->ops->handle_events(t, 1000);
+		if (r < 0) {
+			log_warn("handle_events returned: %d", r);
+			if (r == -EINTR) /* stray signal */
+				continue;
+			break;
+		}
+
+		if (_mirisdr_async_step(dev))
+			dev->async_status = mirisdr_INACTIVE;
+	}
+
+	_mirisdr_async_end(dev);
+
+	return r;
+}
+
+int mirisdr_read_async(mirisdr_dev_t *dev, mirisdr_read_async_cb_t cb, void *ctx,
+		       uint32_t buf_num, uint32_t buf_len)
+{
+	return _mirisdr_read_async(dev, cb, NULL, ctx, buf_num, buf_len);
+}
+
+int mirisdr_read_async_ex(mirisdr_dev_t *dev, mirisdr_read_async_ex_cb_t cb,
+			  void *ctx, uint32_t buf_num, uint32_t buf_len)
+{
+	return _mirisdr_read_async(dev, NULL, cb, ctx, buf_num, buf_len);
+}
+
+/* called by a context thread with the context lock held */
+static void _mirisdr_context_poll(mirisdr_dev_t *dev)
+{
+	if (!_mirisdr_async_step(dev))
+		return;
+
+	_mirisdr_async_end(dev);
+	dev->ctx_streaming = 0;
+	pthread_cond_broadcast(&dev->ctx->cond);
+}
+
+static void *_mirisdr_context_thread(void *arg)
+{
+	mirisdr_context_shard_t *s = (mirisdr_context_shard_t *)arg;
+	mirisdr_context_t *c = s->ctx;
+	mirisdr_dev_t *dev;
+	int r;
+
+	while (!atomic_load(&c->quit)) {
+		r = mirisdr_usb_pool_handle_events(c->usb, s->index, CONTEXT_POLL_MS);
+		if (r < 0 && r != -EINTR)
+			log_warn("handle_events returned: %d", r);
+
+		pthread_mutex_lock(&c->lock);
+		for (dev = c->devs; dev; dev = dev->ctx_next) {
+			if (dev->ctx_shard == s->index && dev->ctx_streaming)
+				_mirisdr_context_poll(dev);
+		}
+		pthread_mutex_unlock(&c->lock);
+	}
+
+	return NULL;
+}
+
+int mirisdr_context_create(mirisdr_context_t **out_ctx, int threads)
+{
+	mirisdr_context_t *c;
+	int i, r;
+
+	if (!out_ctx || threads < 0 || threads > MAX_CONTEXT_THREADS)
+		return -EINVAL;
+
+	if (!threads)
+		threads = 1;
+
+	c = calloc(1, sizeof(mirisdr_context_t));
+	if (!c)
+		return -ENOMEM;
+
+	c->shards = calloc(threads, sizeof(mirisdr_context_shard_t));
+	if (!c->shards) {
+		free(c);
+		return -ENOMEM;
+	}
+
+	r = mirisdr_usb_pool_create(&c->usb, threads);
+	if (r < 0) {
+		free(c->shards);
+		free(c);
+		return r;
+	}
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+
+	for (i = 0; i < threads; i++) {
+		c->shards[i].ctx = c;
+		c->shards[i].index = i;
+
+		if (pthread_create(&c->shards[i].thread, NULL,
+				   _mirisdr_context_thread, &c->shards[i])) {
+			log_err("failed to start context thread");
+			c->num = i;
+			mirisdr_context_destroy(c);
+			return -ENOMEM;
+		}
+	}
+
+	c->num = threads;
+	*out_ctx = c;
+
+	return 0;
+}
+
+int mirisdr_context_destroy(mirisdr_context_t *c)
+{
+	int i;
+
+	if (!c)
+		return -1;
+
+	if (c->devs)
+		return -2;
+
+	atomic_store(&c->quit, 1);
+	for (i = 0; i < c->num; i++)
+		pthread_join(c->shards[i].thread, NULL);
+
+	mirisdr_usb_pool_destroy(c->usb);
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->cond);
+	free(c->shards);
+	free(c);
+
+	return 0;
+}
+
+int mirisdr_start_async(mirisdr_dev_t *dev, mirisdr_read_async_ex_cb_t cb,
+			void *ctx, uint32_t buf_num, uint32_t buf_len)
+{
+	int r;
+
+	if (!dev)
+		return -1;
+
+	if (!dev->ctx)
+		return -EINVAL;
+
+	if (mirisdr_INACTIVE != dev->async_status)
+		return -2;
+
+	r = _mirisdr_async_begin(dev, NULL, cb, ctx, buf_num, buf_len);
+	if (r < 0)
+		return r;
+
+	/* from here on the context thread finishes the stream */
+	pthread_mutex_lock(&dev->ctx->lock);
+	dev->ctx_streaming = 1;
+	pthread_mutex_unlock(&dev->ctx->lock);
+
+	return 0;
+}
+
+int mirisdr_stop_async(mirisdr_dev_t *dev)
+{
+	mirisdr_context_t *c;
+
+	if (!dev || !dev->ctx)
+		return -1;
+
+	c = dev->ctx;
+
+	mirisdr_cancel_async(dev);
+
+	pthread_mutex_lock(&c->lock);
+	while (dev->ctx_streaming)
+		pthread_cond_wait(&c->cond, &c->lock);
+	pthread_mutex_unlock(&c->lock);
+
+	return 0;
+}
+
+int mirisdr_set_zero_fill(mirisdr_dev_t *dev, int on)
+{
+	if (!dev)
+		return -1;
+
+	if (mirisdr_INACTIVE != dev->async_status)
+		return -2;
+
+	dev->zero_fill = on ? 1 : 0;
+
+	return 0;
+}
+
+int mirisdr_set_iq_correction(mirisdr_dev_t *dev, int flags)
+{
+	if (!dev)
+		return -1;
+
+	if (mirisdr_INACTIVE != dev->async_status)
+		return -2;
+
+	mirisdr_iqcorr_init(&dev->iqcorr, flags & (MIRISDR_CORR_DC | MIRISDR_CORR_IQ));
+
+	return 0;
+}
+
+int mirisdr_get_iq_correction(mirisdr_dev_t *dev)
+{
+	if (!dev)
+		return 0;
+
+	return dev->iqcorr.flags;
+}
+
+int mirisdr_set_hop_list(mirisdr_dev_t *dev, const mirisdr_hop_t *hops,
+			 uint32_t num)
+{
+	mirisdr_tune_plan_t *plan = NULL;
+	mirisdr_hop_t *copy = NULL;
+	uint32_t *freqs, i;
+	int r;
+
+	if (!dev || (num && !hops))
+		return -1;
+
+	if (mirisdr_INACTIVE != dev->async_status)
+		return -2;
+
+	if (num) {
+		copy = malloc(num * sizeof(mirisdr_hop_t));
+		freqs = malloc(num * sizeof(uint32_t));
+		if (!copy || !freqs) {
+			free(copy);
+			free(freqs);
+			return -ENOMEM;
+		}
+
+		for (i = 0; i < num; i++)
+			freqs[i] = hops[i].freq;
+
+		r = mirisdr_tune_plan_create(dev, freqs, num, &plan);
+		free(freqs);
+		if (r < 0) {
+			free(copy);
+			return r;
+		}
+
+		memcpy(copy, hops, num * sizeof(mirisdr_hop_t));
+	}
+
+	free(dev->hops);
+	mirisdr_tune_plan_free(dev->hop_plan);
+
+	dev->hops = copy;
+	dev->hop_plan = plan;
+	dev->hop_num = num;
+	dev->hop_state = HOP_DWELL;
+
+	return 0;
+}
+
+int mirisdr_cancel_async(mirisdr_dev_t *dev)
+{
+	if (!dev)
+		return -1;
+
+	if (mirisdr_RUNNING == dev->async_status) {
+		dev->async_status = mirisdr_CANCELING;
+		return 0;
+	}
+
+	return -2;
+}
+
+int mirisdr_get_stream_stats(mirisdr_dev_t *dev, mirisdr_stream_stats_t *stats)
+{
+	int i;
+
+	if (!dev || !stats)
+		return -1;
+
+	stats->transfers = atomic_load_explicit(&dev->stats.transfers, memory_order_relaxed);
+	stats->iso_packets = atomic_load_explicit(&dev->stats.iso_packets, memory_order_relaxed);
+	for (i = 0; i < MIRISDR_ISO_STATUS_NUM; i++)
+		stats->iso_errors[i] = atomic_load_explicit(&dev->stats.iso_errors[i], memory_order_relaxed);
+	stats->short_packets = atomic_load_explicit(&dev->stats.short_packets, memory_order_relaxed);
+	stats->discontinuities = atomic_load_explicit(&dev->stats.discontinuities, memory_order_relaxed);
+	stats->samples_lost = atomic_load_explicit(&dev->stats.samples_lost, memory_order_relaxed);
+	stats->overruns = atomic_load_explicit(&dev->stats.overruns, memory_order_relaxed);
+	stats->open_us = dev->open_us;
+	stats->first_sample_us = atomic_load_explicit(&dev->stats.first_sample_us, memory_order_relaxed);
+
+	return 0;
+}
+
+static void _mirisdr_deadline(struct timespec *ts, int timeout_ms)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+
+	ts->tv_sec += timeout_ms / 1000;
+	ts->tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+/*
+ * Runs on the event thread. The ring is single producer, single consumer:
+ * only this callback moves sync_head, only the reader moves sync_tail. The
+ * mutex is taken just to wake up a sleeping reader.
+ */
+static void _mirisdr_sync_callback(unsigned char *buf, uint32_t len, void *ctx)
+{
+	mirisdr_dev_t *dev = (mirisdr_dev_t *)ctx;
+	uint64_t head, tail, wake;
+	uint32_t pos, n;
+	int dropped = 0;
+
+	head = atomic_load_explicit(&dev->sync_head, memory_order_relaxed);
+	tail = atomic_load_explicit(&dev->sync_tail, memory_order_acquire);
+
+	/*
+	 * Only one drop can be pending. Until the reader has reached it, keep
+	 * dropping, so the transfers lost meanwhile belong to that same drop.
+	 */
+	if (atomic_load(&dev->sync_gap) != SYNC_NO_GAP ||
+	    dev->sync_buf_len - (head - tail) < len) {
+		/* reader is too slow, drop the whole transfer */
+		if (atomic_load(&dev->sync_gap) == SYNC_NO_GAP)
+			atomic_store(&dev->sync_gap, head);
+		STATS_ADD(dev, overruns, 1);
+		STATS_ADD(dev, samples_lost, _mirisdr_out_samples(dev, len));
+		dropped = 1;
+	} else {
+		pos = head % dev->sync_buf_len;
+		n = dev->sync_buf_len - pos;
+		if (n > len)
+			n = len;
+
+		memcpy(dev->sync_buf + pos, buf, n);
+		memcpy(dev->sync_buf, buf + n, len - n);
+
+		head += len;
+		atomic_store(&dev->sync_head, head);
+	}
+
+	if (dev->pool_num)
+		mirisdr_release_buffer(dev, buf);
+
+	wake = atomic_load(&dev->sync_wake);
+	if (wake && (dropped || head >= wake)) {
+		pthread_mutex_lock(&dev->sync_lock);
+		pthread_cond_signal(&dev->sync_cond);
+		pthread_mutex_unlock(&dev->sync_lock);
+	}
+}
+
+static void *_mirisdr_sync_thread(void *arg)
+{
+	mirisdr_dev_t *dev = (mirisdr_dev_t *)arg;
+
+	mirisdr_read_async(dev, _mirisdr_sync_callback, dev, 0, 0);
+
+	pthread_mutex_lock(&dev->sync_lock);
+	atomic_store(&dev->sync_running, 0);
+	pthread_cond_broadcast(&dev->sync_cond);
+	pthread_mutex_unlock(&dev->sync_lock);
+
+	return NULL;
+}
+
+static int _mirisdr_sync_start(mirisdr_dev_t *dev)
+{
+	uint32_t len = dev->sync_buf_len ? dev->sync_buf_len : DEFAULT_SYNC_BUF_LENGTH;
+
+	/* a transfer must always fit, with room to spare for the reader */
+	if (len < 2 * mirisdr_get_output_buffer_len(dev))
+		return -1;
+
+	dev->sync_buf = malloc(len);
+	if (!dev->sync_buf)
+		return -ENOMEM;
+
+	dev->sync_buf_len = len;
+	atomic_store(&dev->sync_head, 0);
+	atomic_store(&dev->sync_tail, 0);
+	atomic_store(&dev->sync_gap, SYNC_NO_GAP);
+	atomic_store(&dev->sync_wake, 0);
+	atomic_store(&dev->sync_running, 1);
+
+	if (pthread_create(&dev->sync_thread, NULL, _mirisdr_sync_thread, dev)) {
+		free(dev->sync_buf);
+		dev->sync_buf = NULL;
+		return -1;
+	}
+
+	dev->sync_started = 1;
+
+	return 0;
+}
+
+static void _mirisdr_sync_stop(mirisdr_dev_t *dev)
+{
+	struct timespec ts;
+
+	if (!dev->sync_started)
+		return;
+
+	/* the event thread may not have started streaming yet */
+	pthread_mutex_lock(&dev->sync_lock);
+	while (atomic_load(&dev->sync_running) && mirisdr_cancel_async(dev) < 0) {
+		_mirisdr_deadline(&ts, 1);
+		pthread_cond_timedwait(&dev->sync_cond, &dev->sync_lock, &ts);
+	}
+	pthread_mutex_unlock(&dev->sync_lock);
+
+	pthread_join(dev->sync_thread, NULL);
+
+	free(dev->sync_buf);
+	dev->sync_buf = NULL;
+	dev->sync_started = 0;
+}
+
+int mirisdr_set_sync_buffer_len(mirisdr_dev_t *dev, uint32_t len)
+{
+	if (!dev)
+		return -1;
+
+	if (dev->sync_started)
+		return -2;
+
+	dev->sync_buf_len = len;
+
+	return 0;
+}
+
+int mirisdr_reset_buffer(mirisdr_dev_t *dev)
+{
+	uint64_t head;
+
+	if (!dev)
+		return -1;
+
+	if (dev->sync_started) {
+		head = atomic_load(&dev->sync_head);
+		atomic_store(&dev->sync_gap, SYNC_NO_GAP);
+		atomic_store_explicit(&dev->sync_tail, head, memory_order_release);
+	}
+
+	return 0;
+}
+
+int mirisdr_read_sync_timeout(mirisdr_dev_t *dev, void *buf, int len,
+			      int *n_read, int timeout_ms)
+{
+	uint64_t head, tail, gap, end;
+	uint32_t pos, n;
+	struct timespec ts;
+	int r = 0;
+
+	if (n_read)
+		*n_read = 0;
+
+	if (!dev || !buf || len < 0)
+		return -1;
+
+	if (!dev->sync_started && (r = _mirisdr_sync_start(dev)) < 0)
+		return r;
+
+	if (timeout_ms > 0)
+		_mirisdr_deadline(&ts, timeout_ms);
+
+	tail = atomic_load_explicit(&dev->sync_tail, memory_order_relaxed);
+	end = tail + len;
+
+	for (;;) {
+		head = atomic_load(&dev->sync_head);
+		gap = atomic_load(&dev->sync_gap);
+
+		/* never read across a drop, report it instead */
+		if (gap != SYNC_NO_GAP && gap <= end) {
+			end = gap;
+			atomic_store(&dev->sync_gap, SYNC_NO_GAP);
+			r = MIRISDR_SYNC_DROPPED;
+			break;
+		}
+
+		if (head >= end)
+			break;
+
+		pthread_mutex_lock(&dev->sync_lock);
+		atomic_store(&dev->sync_wake, end);
+
+		if (atomic_load(&dev->sync_head) < end &&
+		    atomic_load(&dev->sync_gap) == SYNC_NO_GAP) {
+			if (!atomic_load(&dev->sync_running))
+				r = -1;
+			else if (timeout_ms > 0)
+				r = pthread_cond_timedwait(&dev->sync_cond, &dev->sync_lock, &ts) ?
+				    MIRISDR_SYNC_TIMEOUT : 0;
+			else
+				pthread_cond_wait(&dev->sync_cond, &dev->sync_lock);
+		}
+
+		atomic_store(&dev->sync_wake, 0);
+		pthread_mutex_unlock(&dev->sync_lock);
+
+		if (r) {
+			/* streaming stopped or timed out, return what is there */
+			end = atomic_load(&dev->sync_head);
+			if (end > tail + len)
+				end = tail + len;
+			break;
+		}
+	}
+
+	len = (int)(end - tail);
+	pos = tail % dev->sync_buf_len;
+	n = dev->sync_buf_len - pos;
+	if (n > (uint32_t)len)
+		n = len;
+
+	memcpy(buf, dev->sync_buf + pos, n);
+	memcpy((uint8_t *)buf + n, dev->sync_buf, len - n);
+
+	atomic_store_explicit(&dev->sync_tail, end, memory_order_release);
+
+	if (n_read)
+		*n_read = len;
+
+	return r;
+}
+
+int mirisdr_read_sync(mirisdr_dev_t *dev, void *buf, int len, int *n_read)
+{
+	return mirisdr_read_sync_timeout(dev, buf, len, n_read, 0);
 }
 
 int mirisdr_reg_write_fn(void *dev, uint8_t reg, uint32_t val)
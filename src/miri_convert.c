@@ -0,0 +1,430 @@
+/*
+ * MiriSDR
+ * Offline conversion of raw MSi2500 block captures
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The capture is mapped into memory and cut into chunks of whole blocks.
+ * Workers take the chunks in turn and convert each into a slot of their
+ * own, there are a few more slots than workers so they can run ahead of
+ * the output. The main thread writes the slots out in chunk order.
+ *
+ * Blocks are independent of each other, only the address counter in their
+ * headers links them. Every worker runs a decoder of its own, which is
+ * shown the last block of the previous chunk before it decodes a chunk.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mirisdr.h"
+
+/* 384 complex samples in a block of 1024 bytes */
+#define BLOCK_LEN		1024
+#define BLOCK_SAMPLES		384
+
+#define CHUNK_BLOCKS		1024	/* 1 MiB of input */
+#define MAX_WORKERS		64
+#define SLOTS_PER_WORKER	2
+#define MAX_PRINTED_GAPS	20
+
+typedef struct gap {
+	uint64_t block;		/* first block after the gap */
+	uint32_t blocks;	/* lost, 0 for a counter reset */
+} gap_t;
+
+typedef struct slot {
+	uint64_t chunk;		/* the chunk it holds or is waiting for */
+	int ready;
+	void *out;
+	size_t len;
+	gap_t *gaps;
+	uint32_t gap_num;
+	uint32_t gap_size;
+} slot_t;
+
+static const struct {
+	const char *name;
+	mirisdr_format_t format;
+	size_t sample_size;
+} formats[] = {
+	{ "cs16", MIRISDR_FORMAT_CS16, 4 },
+	{ "cf32", MIRISDR_FORMAT_CF32, 8 },
+	{ "cu8", MIRISDR_FORMAT_CU8, 2 }
+};
+
+static const uint8_t *blocks;
+static uint64_t block_num;
+static uint64_t chunk_num;
+static mirisdr_format_t format = MIRISDR_FORMAT_CS16;
+static const char *format_name = "cs16";
+static size_t sample_size = 4;
+
+static atomic_uint_fast64_t next_chunk;
+static slot_t *slots;
+static uint32_t slot_num;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static atomic_int do_exit;
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"miri_convert, converts raw MSi2500 block captures\n\n"
+		"Usage:\t miri_convert [options] input output\n"
+		"\t[-F output format: cs16, cf32, cu8 (default: cs16)]\n"
+		"\t[-t worker threads (default: one per CPU)]\n"
+		"\tinput is a capture of miri_sdr -F raw, with or without header\n"
+		"\toutput is a file, '-' for stdout\n\n");
+	exit(1);
+}
+
+static void sighandler(int signum)
+{
+	atomic_store(&do_exit, 1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void add_gap(slot_t *s, uint64_t block, uint32_t lost)
+{
+	gap_t *gaps;
+
+	if (s->gap_num == s->gap_size) {
+		gaps = realloc(s->gaps, (s->gap_size + 16) * sizeof(gap_t));
+		if (!gaps)
+			return;
+		s->gaps = gaps;
+		s->gap_size += 16;
+	}
+
+	s->gaps[s->gap_num].block = block;
+	s->gaps[s->gap_num].blocks = lost;
+	s->gap_num++;
+}
+
+static void convert_chunk(mirisdr_decoder_t *dec, slot_t *s, uint64_t chunk)
+{
+	uint64_t first = chunk * CHUNK_BLOCKS;
+	uint32_t n = block_num - first < CHUNK_BLOCKS ?
+		     block_num - first : CHUNK_BLOCKS;
+	uint32_t k;
+	int32_t gap;
+	int r;
+
+	s->gap_num = 0;
+
+	/* pick up the stream at the last block of the chunk before */
+	mirisdr_decoder_reset(dec);
+	if (first)
+		mirisdr_decoder_check(dec, blocks + (first - 1) * BLOCK_LEN);
+
+	for (k = 0; k < n; k += r) {
+		r = mirisdr_decoder_decode(dec, blocks + (first + k) * BLOCK_LEN,
+					   (n - k) * BLOCK_LEN,
+					   (uint8_t *)s->out + k * BLOCK_SAMPLES * sample_size,
+					   &gap);
+		if (r <= 0)
+			break;
+
+		/* counter resets are kept as gaps of 0 blocks */
+		if (gap)
+			add_gap(s, first + k, gap > 0 ? gap : 0);
+	}
+
+	s->len = k * BLOCK_SAMPLES * sample_size;
+}
+
+static void *worker(void *arg)
+{
+	mirisdr_decoder_t *dec;
+	uint64_t chunk;
+	slot_t *s;
+
+	dec = mirisdr_decoder_create(format);
+	if (!dec) {
+		fprintf(stderr, "Failed to create decoder.\n");
+		atomic_store(&do_exit, 1);
+		pthread_mutex_lock(&lock);
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+		return NULL;
+	}
+
+	for (;;) {
+		chunk = atomic_fetch_add(&next_chunk, 1);
+		if (chunk >= chunk_num)
+			break;
+
+		s = &slots[chunk % slot_num];
+
+		/* wait for the output to be done with the slot */
+		pthread_mutex_lock(&lock);
+		while (s->chunk != chunk && !atomic_load(&do_exit))
+			pthread_cond_wait(&cond, &lock);
+		pthread_mutex_unlock(&lock);
+
+		if (atomic_load(&do_exit))
+			break;
+
+		convert_chunk(dec, s, chunk);
+
+		pthread_mutex_lock(&lock);
+		s->ready = 1;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+	}
+
+	mirisdr_decoder_free(dec);
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction sigact;
+	struct stat st;
+	pthread_t threads[MAX_WORKERS];
+	const mirisdr_raw_header_t *hdr;
+	FILE *file;
+	const uint8_t *map;
+	size_t start = 0;
+	uint64_t chunk, done = 0, lost = 0, gaps = 0, resets = 0;
+	double t0, t;
+	int workers = 0, printed = 0, fd, opt, r = 0;
+	uint32_t i, j;
+	slot_t *s;
+
+	while ((opt = getopt(argc, argv, "F:t:")) != -1) {
+		switch (opt) {
+		case 'F':
+			for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+				if (!strcmp(optarg, formats[i].name))
+					break;
+			}
+			if (i == sizeof(formats) / sizeof(formats[0]))
+				usage();
+			format = formats[i].format;
+			format_name = formats[i].name;
+			sample_size = formats[i].sample_size;
+			break;
+		case 't':
+			workers = atoi(optarg);
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (argc - optind != 2)
+		usage();
+
+	if (workers <= 0)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers <= 0)
+		workers = 1;
+	if (workers > MAX_WORKERS)
+		workers = MAX_WORKERS;
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "Failed to open %s\n", argv[optind]);
+		return 1;
+	}
+
+	if (!st.st_size) {
+		fprintf(stderr, "%s is empty.\n", argv[optind]);
+		return 1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Failed to map %s\n", argv[optind]);
+		return 1;
+	}
+	madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+
+	hdr = (const mirisdr_raw_header_t *)map;
+	if ((size_t)st.st_size >= sizeof(*hdr) &&
+	    !memcmp(hdr->magic, MIRISDR_RAW_MAGIC, sizeof(hdr->magic))) {
+		if (hdr->byte_order != MIRISDR_RAW_BYTE_ORDER) {
+			fprintf(stderr, "Capture was written on a host of the "
+				"other byte order.\n");
+			return 1;
+		}
+
+		if (hdr->block_len != BLOCK_LEN ||
+		    hdr->header_len > (size_t)st.st_size) {
+			fprintf(stderr, "Unsupported capture header.\n");
+			return 1;
+		}
+
+		start = hdr->header_len;
+		fprintf(stderr, "Capture at %u Hz, %u S/s, gain %.1f dB.\n",
+			hdr->center_freq, hdr->sample_rate, hdr->gain / 10.0);
+	}
+
+	blocks = map + start;
+	block_num = (st.st_size - start) / BLOCK_LEN;
+	chunk_num = (block_num + CHUNK_BLOCKS - 1) / CHUNK_BLOCKS;
+
+	if ((st.st_size - start) % BLOCK_LEN)
+		fprintf(stderr, "WARNING: ignoring %u bytes of a partial block "
+			"at the end.\n",
+			(unsigned)((st.st_size - start) % BLOCK_LEN));
+
+	if (strcmp(argv[optind + 1], "-") == 0) {
+		file = stdout;
+	} else {
+		file = fopen(argv[optind + 1], "wb");
+		if (!file) {
+			fprintf(stderr, "Failed to open %s\n", argv[optind + 1]);
+			return 1;
+		}
+	}
+
+	slot_num = workers * SLOTS_PER_WORKER;
+	slots = calloc(slot_num, sizeof(slot_t));
+	if (!slots)
+		return 1;
+
+	for (i = 0; i < slot_num; i++) {
+		slots[i].chunk = i;
+		slots[i].out = malloc(CHUNK_BLOCKS * BLOCK_SAMPLES *
+				      sample_size);
+		if (!slots[i].out) {
+			fprintf(stderr, "Out of memory.\n");
+			return 1;
+		}
+	}
+
+	sigact.sa_handler = sighandler;
+	sigemptyset(&sigact.sa_mask);
+	sigact.sa_flags = 0;
+	sigaction(SIGINT, &sigact, NULL);
+	sigaction(SIGTERM, &sigact, NULL);
+
+	fprintf(stderr, "Converting %llu blocks to %s with %d workers...\n",
+		(unsigned long long)block_num, format_name, workers);
+
+	t0 = now();
+	atomic_init(&next_chunk, 0);
+
+	for (i = 0; i < (uint32_t)workers; i++)
+		pthread_create(&threads[i], NULL, worker, NULL);
+
+	for (chunk = 0; chunk < chunk_num; chunk++) {
+		s = &slots[chunk % slot_num];
+
+		pthread_mutex_lock(&lock);
+		while (!s->ready && !atomic_load(&do_exit))
+			pthread_cond_wait(&cond, &lock);
+		pthread_mutex_unlock(&lock);
+
+		if (atomic_load(&do_exit))
+			break;
+
+		for (j = 0; j < s->gap_num; j++) {
+			if (s->gaps[j].blocks) {
+				gaps++;
+				lost += s->gaps[j].blocks;
+			} else {
+				resets++;
+			}
+
+			if (printed++ >= MAX_PRINTED_GAPS)
+				continue;
+
+			fprintf(stderr, "Block %llu (output sample %llu): ",
+				(unsigned long long)s->gaps[j].block,
+				(unsigned long long)s->gaps[j].block *
+				BLOCK_SAMPLES);
+			if (s->gaps[j].blocks)
+				fprintf(stderr, "%u blocks lost\n", s->gaps[j].blocks);
+			else
+				fprintf(stderr, "counter reset\n");
+		}
+
+		done += s->len / sample_size / BLOCK_SAMPLES;
+
+		if (fwrite(s->out, 1, s->len, file) != s->len) {
+			fprintf(stderr, "Short write, exiting!\n");
+			atomic_store(&do_exit, 1);
+			r = 1;
+		}
+
+		pthread_mutex_lock(&lock);
+		s->ready = 0;
+		s->chunk = chunk + slot_num;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+	}
+
+	/* wake up workers waiting for a slot */
+	pthread_mutex_lock(&lock);
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+
+	for (i = 0; i < (uint32_t)workers; i++)
+		pthread_join(threads[i], NULL);
+
+	t = now() - t0;
+
+	if (printed > MAX_PRINTED_GAPS)
+		fprintf(stderr, "... and %d more\n", printed - MAX_PRINTED_GAPS);
+
+	if (atomic_load(&do_exit) && !r)
+		fprintf(stderr, "Interrupted.\n");
+
+	fprintf(stderr, "%llu blocks in %.2f s, %.1f MB/s in, %.2f MS/s out; "
+		"%llu gaps, %llu blocks lost, %llu counter resets.\n",
+		(unsigned long long)done, t,
+		(done * BLOCK_LEN) / t / 1e6,
+		(done * BLOCK_SAMPLES) / t / 1e6,
+		(unsigned long long)gaps, (unsigned long long)lost,
+		(unsigned long long)resets);
+
+	if (file != stdout)
+		fclose(file);
+
+	for (i = 0; i < slot_num; i++) {
+		free(slots[i].out);
+		free(slots[i].gaps);
+	}
+	free(slots);
+	munmap((void *)map, st.st_size);
+
+	return r;
+}
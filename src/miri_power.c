@@ -0,0 +1,677 @@
+/*
+ * MiriSDR
+ * Power spectrum survey over a frequency range, in the spirit of rtl_power
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The event thread hands every buffer to a queue and goes back to the USB
+ * bus, it never waits for the FFTs. Buffers come from a pool owned by this
+ * tool and are released by the worker that is done with them, so the only
+ * thing that can happen to a slow worker pool is that the library drops
+ * transfers, which is counted as overruns.
+ *
+ * Each buffer is tagged with the frequency it was taken at. Workers sum up
+ * the power of all whole FFTs of a buffer and add them to the bins of its
+ * hop, the main thread prints and clears the bins once per interval.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mirisdr.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define DEFAULT_SAMPLE_RATE	2048000
+#define DEFAULT_INTERVAL	10	/* seconds */
+#define DEFAULT_CROP		0.25
+#define DEFAULT_SETTLE_US	1000
+#define MAX_FFT_SHIFT		16
+#define MAX_WORKERS		64
+#define POOL_PER_WORKER		4
+#define MIN_POOL		16
+#define SUBBLOCK_SAMPLES	1152	/* complex samples per 3072 byte iso packet */
+
+/* binary output, one record per hop and interval followed by bins floats */
+typedef struct power_record {
+	int64_t time;		/* seconds since the epoch */
+	uint32_t freq_low;	/* Hz */
+	uint32_t freq_high;	/* Hz */
+	float step;		/* Hz per bin */
+	uint32_t bins;
+	uint64_t samples;	/* complex samples that went into the bins */
+} power_record_t;
+
+typedef struct hop {
+	uint32_t freq;
+	pthread_mutex_t lock;
+	double *pwr;		/* kept bins */
+	uint64_t ffts;
+} hop_t;
+
+typedef struct job {
+	float *buf;
+	uint32_t samples;
+	hop_t *hop;
+} job_t;
+
+static int do_exit = 0;
+static mirisdr_dev_t *dev = NULL;
+
+/* filled in once, read only afterwards */
+static uint32_t fft_len, fft_shift, keep;
+static int32_t keep_first;	/* bin offset from the center */
+static float *window, *twiddle;
+static uint32_t *bitrev;
+static double norm;
+static hop_t *hops;
+static uint32_t hop_num;
+
+/* queue of buffers for the workers, never longer than the pool */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static job_t *queue;
+static uint32_t queue_len, queue_head, queue_num;
+static int queue_quit;
+
+static atomic_uint_fast64_t samples_done;
+static uint64_t buffers_skipped;	/* event thread only */
+
+void usage(void)
+{
+	fprintf(stderr,
+		"miri_power, a power spectrum survey tool for MiriSDR\n\n"
+		"Usage:\t -f lower:upper:bin_size [Hz]\n"
+		"\t[-i integration interval in seconds (default: %d)]\n"
+		"\t[-e exit after this many seconds (default: off)]\n"
+		"\t[-s samplerate (default: %d Hz)]\n"
+		"\t[-d device_index (default: 0)]\n"
+		"\t[-g gain (default: 0 for auto)]\n"
+		"\t[-c crop, fraction of each hop to discard (default: %.2f)]\n"
+		"\t[-w window: hann, hamming, blackman, rect (default: hann)]\n"
+		"\t[-t worker threads (default: one per CPU)]\n"
+		"\t[-D correct DC offset and IQ imbalance]\n"
+		"\t[-B write binary records instead of CSV]\n"
+		"\t[-R capture file to read instead of a device]\n"
+		"\t[-P pace the capture file at the sample rate]\n"
+		"\tfilename (a '-' dumps to stdout)\n\n"
+		"CSV rows are: date, time, Hz low, Hz high, Hz step, samples, dB, dB, ...\n",
+		DEFAULT_INTERVAL, DEFAULT_SAMPLE_RATE, DEFAULT_CROP);
+	exit(1);
+}
+
+static void sighandler(int signum)
+{
+	fprintf(stderr, "Signal caught, exiting!\n");
+	do_exit = 1;
+	mirisdr_cancel_async(dev);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int fft_init(const char *wname)
+{
+	uint32_t i, j;
+	double w, sum = 0;
+
+	window = malloc(fft_len * sizeof(float));
+	twiddle = malloc(fft_len * sizeof(float));
+	bitrev = malloc(fft_len * sizeof(uint32_t));
+	if (!window || !twiddle || !bitrev)
+		return -ENOMEM;
+
+	for (i = 0; i < fft_len; i++) {
+		w = 2 * M_PI * i / fft_len;
+		if (!strcmp(wname, "hann"))
+			window[i] = 0.5 - 0.5 * cos(w);
+		else if (!strcmp(wname, "hamming"))
+			window[i] = 0.54 - 0.46 * cos(w);
+		else if (!strcmp(wname, "blackman"))
+			window[i] = 0.42 - 0.5 * cos(w) + 0.08 * cos(2 * w);
+		else if (!strcmp(wname, "rect"))
+			window[i] = 1;
+		else
+			return -EINVAL;
+		sum += window[i];
+
+		for (j = 0, bitrev[i] = 0; j < fft_shift; j++)
+			bitrev[i] = (bitrev[i] << 1) | ((i >> j) & 1);
+	}
+
+	/* a full scale tone reads 0 dB */
+	norm = 1.0 / (sum * sum);
+
+	for (i = 0; i < fft_len / 2; i++) {
+		twiddle[2 * i] = cos(2 * M_PI * i / fft_len);
+		twiddle[2 * i + 1] = -sin(2 * M_PI * i / fft_len);
+	}
+
+	return 0;
+}
+
+/* in place radix-2 FFT of interleaved complex floats */
+static void fft(float *x)
+{
+	uint32_t i, j, k, half, step;
+	float ar, ai, br, bi, wr, wi, t;
+
+	for (i = 0; i < fft_len; i++) {
+		j = bitrev[i];
+		if (j > i) {
+			t = x[2 * i]; x[2 * i] = x[2 * j]; x[2 * j] = t;
+			t = x[2 * i + 1]; x[2 * i + 1] = x[2 * j + 1]; x[2 * j + 1] = t;
+		}
+	}
+
+	for (half = 1, step = fft_len / 2; half < fft_len; half <<= 1, step >>= 1) {
+		for (i = 0; i < fft_len; i += 2 * half) {
+			for (k = 0; k < half; k++) {
+				wr = twiddle[2 * k * step];
+				wi = twiddle[2 * k * step + 1];
+				ar = x[2 * (i + k)];
+				ai = x[2 * (i + k) + 1];
+				br = x[2 * (i + k + half)] * wr - x[2 * (i + k + half) + 1] * wi;
+				bi = x[2 * (i + k + half)] * wi + x[2 * (i + k + half) + 1] * wr;
+				x[2 * (i + k)] = ar + br;
+				x[2 * (i + k) + 1] = ai + bi;
+				x[2 * (i + k + half)] = ar - br;
+				x[2 * (i + k + half) + 1] = ai - bi;
+			}
+		}
+	}
+}
+
+static void *worker(void *arg)
+{
+	float *x = malloc(2 * fft_len * sizeof(float));
+	double *pwr = malloc(keep * sizeof(double));
+	uint32_t i, k, n, ffts;
+	const float *in;
+	job_t job;
+
+	if (!x || !pwr) {
+		fprintf(stderr, "Out of memory in worker.\n");
+		exit(1);
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&queue_lock);
+		while (!queue_num && !queue_quit)
+			pthread_cond_wait(&queue_cond, &queue_lock);
+		if (!queue_num) {
+			pthread_mutex_unlock(&queue_lock);
+			break;
+		}
+		job = queue[queue_head];
+		queue_head = (queue_head + 1) % queue_len;
+		queue_num--;
+		pthread_mutex_unlock(&queue_lock);
+
+		memset(pwr, 0, keep * sizeof(double));
+		ffts = job.samples / fft_len;
+
+		for (n = 0; n < ffts; n++) {
+			in = job.buf + 2 * n * fft_len;
+			for (i = 0; i < fft_len; i++) {
+				x[2 * i] = in[2 * i] * window[i];
+				x[2 * i + 1] = in[2 * i + 1] * window[i];
+			}
+
+			fft(x);
+
+			/* bin 0 is the center, keep the middle of the band */
+			for (i = 0; i < keep; i++) {
+				k = (keep_first + i) & (fft_len - 1);
+				pwr[i] += x[2 * k] * x[2 * k] + x[2 * k + 1] * x[2 * k + 1];
+			}
+		}
+
+		mirisdr_release_buffer(dev, job.buf);
+
+		if (!ffts)
+			continue;
+
+		pthread_mutex_lock(&job.hop->lock);
+		for (i = 0; i < keep; i++)
+			job.hop->pwr[i] += pwr[i];
+		job.hop->ffts += ffts;
+		pthread_mutex_unlock(&job.hop->lock);
+
+		atomic_fetch_add_explicit(&samples_done, (uint64_t)ffts * fft_len,
+					  memory_order_relaxed);
+	}
+
+	free(x);
+	free(pwr);
+
+	return NULL;
+}
+
+static hop_t *find_hop(uint32_t freq)
+{
+	uint32_t lo = 0, hi = hop_num, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (hops[mid].freq == freq)
+			return &hops[mid];
+		if (hops[mid].freq < freq)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
+/* runs on the event thread, must not wait for the workers */
+static void power_callback(unsigned char *buf, uint32_t len,
+			   const mirisdr_buffer_info_t *info, void *ctx)
+{
+	hop_t *hop = find_hop(info->center_freq);
+
+	if (!hop || info->samples < fft_len) {
+		buffers_skipped++;
+		mirisdr_release_buffer(dev, buf);
+		return;
+	}
+
+	/* the queue holds as many entries as there are pool buffers */
+	pthread_mutex_lock(&queue_lock);
+	queue[(queue_head + queue_num) % queue_len] = (job_t){
+		(float *)buf, info->samples, hop };
+	queue_num++;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+static void *reader(void *arg)
+{
+	int *ret = (int *)arg;
+
+	*ret = mirisdr_read_async_ex(dev, power_callback, NULL, 0, 0);
+	do_exit = 1;
+
+	return NULL;
+}
+
+/* print and clear the bins of every hop visited since the last call */
+static void write_rows(FILE *file, int binary, double bin_hz)
+{
+	double *pwr = malloc(keep * sizeof(double));
+	float *db = malloc(keep * sizeof(float));
+	power_record_t rec;
+	char date[16], tod[16];
+	uint64_t ffts;
+	time_t t = time(NULL);
+	struct tm *tm = localtime(&t);
+	uint32_t h, i;
+
+	if (!pwr || !db) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	strftime(date, sizeof(date), "%Y-%m-%d", tm);
+	strftime(tod, sizeof(tod), "%H:%M:%S", tm);
+
+	for (h = 0; h < hop_num; h++) {
+		pthread_mutex_lock(&hops[h].lock);
+		ffts = hops[h].ffts;
+		memcpy(pwr, hops[h].pwr, keep * sizeof(double));
+		memset(hops[h].pwr, 0, keep * sizeof(double));
+		hops[h].ffts = 0;
+		pthread_mutex_unlock(&hops[h].lock);
+
+		if (!ffts)
+			continue;
+
+		for (i = 0; i < keep; i++)
+			db[i] = 10 * log10(pwr[i] * norm / ffts + 1e-20);
+
+		rec.time = t;
+		rec.freq_low = hops[h].freq + keep_first * bin_hz;
+		rec.freq_high = rec.freq_low + keep * bin_hz;
+		rec.step = bin_hz;
+		rec.bins = keep;
+		rec.samples = ffts * fft_len;
+
+		if (binary) {
+			fwrite(&rec, sizeof(rec), 1, file);
+			fwrite(db, sizeof(float), keep, file);
+			continue;
+		}
+
+		fprintf(file, "%s, %s, %u, %u, %.2f, %llu", date, tod,
+			rec.freq_low, rec.freq_high, bin_hz,
+			(unsigned long long)rec.samples);
+		for (i = 0; i < keep; i++)
+			fprintf(file, ", %.2f", db[i]);
+		fprintf(file, "\n");
+	}
+
+	fflush(file);
+	free(pwr);
+	free(db);
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction sigact;
+	char *filename = NULL, *replay = NULL, *range = NULL;
+	const char *wname = "hann";
+	double crop = DEFAULT_CROP, interval = DEFAULT_INTERVAL, exit_time = 0;
+	double bin_hz, hop_hz, t0, next, start;
+	uint32_t samp_rate = DEFAULT_SAMPLE_RATE, dev_index = 0;
+	uint32_t lower, upper, bin_size, buf_num, i;
+	uint32_t workers = 0, pool_num;
+	int opt, r, gain = 0, corr = 0, binary = 0, replay_flags = 0;
+	int read_ret = 0;
+	mirisdr_hop_t *list;
+	mirisdr_stream_stats_t stats;
+	pthread_t *threads, read_thread;
+	uint32_t packets, pool_len;
+	void **pool;
+	FILE *file;
+
+	while ((opt = getopt(argc, argv, "f:i:e:s:d:g:c:w:t:DBR:P")) != -1) {
+		switch (opt) {
+		case 'f':
+			range = optarg;
+			break;
+		case 'i':
+			interval = atof(optarg);
+			break;
+		case 'e':
+			exit_time = atof(optarg);
+			break;
+		case 's':
+			samp_rate = (uint32_t)atof(optarg);
+			break;
+		case 'd':
+			dev_index = atoi(optarg);
+			break;
+		case 'g':
+			gain = (int)(atof(optarg) * 10); /* tenths of a dB */
+			break;
+		case 'c':
+			crop = atof(optarg);
+			break;
+		case 'w':
+			wname = optarg;
+			break;
+		case 't':
+			workers = atoi(optarg);
+			break;
+		case 'D':
+			corr = MIRISDR_CORR_DC | MIRISDR_CORR_IQ;
+			break;
+		case 'B':
+			binary = 1;
+			break;
+		case 'R':
+			replay = optarg;
+			break;
+		case 'P':
+			replay_flags |= MIRISDR_REPLAY_REALTIME;
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (argc <= optind || !range)
+		usage();
+	filename = argv[optind];
+
+	if (sscanf(range, "%u:%u:%u", &lower, &upper, &bin_size) != 3 ||
+	    upper <= lower || !bin_size || crop < 0 || crop >= 1 || interval <= 0)
+		usage();
+
+	if (!workers) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = n > 0 ? n : 1;
+	}
+	if (workers > MAX_WORKERS)
+		workers = MAX_WORKERS;
+
+	if (replay)
+		r = mirisdr_open_replay(&dev, replay, NULL, replay_flags);
+	else
+		r = mirisdr_open(&dev, dev_index);
+	if (r < 0) {
+		fprintf(stderr, "Failed to open %s.\n", replay ? replay : "mirisdr device");
+		exit(1);
+	}
+
+	sigact.sa_handler = sighandler;
+	sigemptyset(&sigact.sa_mask);
+	sigact.sa_flags = 0;
+	sigaction(SIGINT, &sigact, NULL);
+	sigaction(SIGTERM, &sigact, NULL);
+	sigaction(SIGQUIT, &sigact, NULL);
+	sigaction(SIGPIPE, &sigact, NULL);
+
+	r = mirisdr_set_sample_rate(dev, samp_rate);
+	if (r < 0) {
+		fprintf(stderr, "Failed to set sample rate %u Hz.\n", samp_rate);
+		goto out_close;
+	}
+	samp_rate = mirisdr_get_sample_rate(dev);
+
+	/* smallest power of two giving bins no wider than asked for */
+	for (fft_shift = 1; fft_shift < MAX_FFT_SHIFT &&
+	     (samp_rate >> fft_shift) > bin_size; fft_shift++)
+		;
+	fft_len = 1 << fft_shift;
+	bin_hz = (double)samp_rate / fft_len;
+
+	/* hops are spaced by the kept bins, so they tile the range */
+	keep = (uint32_t)(fft_len * (1 - crop)) & ~1;
+	if (!keep)
+		keep = 2;
+	keep_first = -(int32_t)keep / 2;
+	hop_hz = keep * bin_hz;
+	hop_num = (uint32_t)ceil((upper - lower) / hop_hz);
+
+	if (fft_init(wname) < 0) {
+		fprintf(stderr, "Unknown window %s.\n", wname);
+		goto out_close;
+	}
+
+	hops = calloc(hop_num, sizeof(hop_t));
+	list = calloc(hop_num, sizeof(mirisdr_hop_t));
+	if (!hops || !list) {
+		fprintf(stderr, "Out of memory.\n");
+		goto out_close;
+	}
+
+	for (i = 0; i < hop_num; i++) {
+		hops[i].freq = lower + (uint32_t)(hop_hz * i + hop_hz / 2);
+		hops[i].pwr = calloc(keep, sizeof(double));
+		if (!hops[i].pwr) {
+			fprintf(stderr, "Out of memory.\n");
+			goto out_close;
+		}
+		pthread_mutex_init(&hops[i].lock, NULL);
+
+		list[i].freq = hops[i].freq;
+		list[i].dwell_us = interval * 1e6 / hop_num;
+		list[i].settle_us = DEFAULT_SETTLE_US;
+	}
+
+	fprintf(stderr, "%u hops of %.0f Hz, %u point FFT, %.2f Hz bins, "
+		"%u workers\n", hop_num, hop_hz, fft_len, bin_hz, workers);
+
+	if (hop_num > 1)
+		r = mirisdr_set_hop_list(dev, list, hop_num);
+	else
+		r = mirisdr_set_center_freq(dev, hops[0].freq);
+	free(list);
+	if (r < 0) {
+		fprintf(stderr, "Failed to tune.\n");
+		goto out_close;
+	}
+
+	if (0 == gain) {
+		r = mirisdr_set_tuner_gain_mode(dev, 0);
+	} else {
+		r = mirisdr_set_tuner_gain_mode(dev, 1);
+		if (r >= 0)
+			r = mirisdr_set_tuner_gain(dev, gain);
+	}
+	if (r < 0)
+		fprintf(stderr, "WARNING: Failed to set gain.\n");
+
+	if (mirisdr_set_iq_correction(dev, corr) < 0)
+		fprintf(stderr, "WARNING: Failed to set IQ correction.\n");
+
+	mirisdr_set_output_format(dev, MIRISDR_FORMAT_CF32);
+
+	/* every transfer should hold at least one FFT */
+	mirisdr_get_transfer_geometry(dev, &buf_num, &packets, NULL);
+	if (packets * SUBBLOCK_SAMPLES < fft_len) {
+		packets = (fft_len + SUBBLOCK_SAMPLES - 1) / SUBBLOCK_SAMPLES;
+		if (mirisdr_set_transfer_geometry(dev, buf_num, packets) < 0) {
+			fprintf(stderr, "FFT of %u points does not fit a transfer.\n",
+				fft_len);
+			goto out_close;
+		}
+	}
+
+	pool_num = workers * POOL_PER_WORKER;
+	if (pool_num < MIN_POOL)
+		pool_num = MIN_POOL;
+	pool_len = mirisdr_get_output_buffer_len(dev);
+	pool = calloc(pool_num, sizeof(void *));
+	queue = calloc(pool_num, sizeof(job_t));
+	threads = calloc(workers, sizeof(pthread_t));
+	if (!pool || !queue || !threads) {
+		fprintf(stderr, "Out of memory.\n");
+		goto out_close;
+	}
+	queue_len = pool_num;
+
+	for (i = 0; i < pool_num; i++) {
+		if (posix_memalign(&pool[i], 32, pool_len)) {
+			fprintf(stderr, "Out of memory.\n");
+			goto out_close;
+		}
+	}
+	mirisdr_set_buffer_pool(dev, pool, pool_num, pool_len);
+
+	if (strcmp(filename, "-") == 0) {
+		file = stdout;
+	} else {
+		file = fopen(filename, binary ? "wb" : "w");
+		if (!file) {
+			fprintf(stderr, "Failed to open %s\n", filename);
+			goto out_close;
+		}
+	}
+
+	for (i = 0; i < workers; i++)
+		pthread_create(&threads[i], NULL, worker, NULL);
+
+	mirisdr_reset_buffer(dev);
+	pthread_create(&read_thread, NULL, reader, &read_ret);
+
+	start = now();
+	next = start + interval;
+	while (!do_exit) {
+		t0 = now();
+		if (exit_time > 0 && t0 - start >= exit_time)
+			break;
+
+		if (t0 >= next) {
+			write_rows(file, binary, bin_hz);
+			next += interval;
+			continue;
+		}
+
+		usleep(next - t0 < 0.1 ? (useconds_t)((next - t0) * 1e6) : 100000);
+	}
+
+	mirisdr_cancel_async(dev);
+	pthread_join(read_thread, NULL);
+
+	/* let the workers finish what is queued, then the last partial interval */
+	pthread_mutex_lock(&queue_lock);
+	queue_quit = 1;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+	for (i = 0; i < workers; i++)
+		pthread_join(threads[i], NULL);
+
+	write_rows(file, binary, bin_hz);
+
+	t0 = now() - start;
+	mirisdr_get_stream_stats(dev, &stats);
+	fprintf(stderr, "%llu samples in %.2f s, %.2f MS/s, lost %llu, "
+		"overruns %llu, skipped buffers %llu\n",
+		(unsigned long long)samples_done, t0, (double)samples_done / t0 / 1e6,
+		(unsigned long long)stats.samples_lost,
+		(unsigned long long)stats.overruns,
+		(unsigned long long)buffers_skipped);
+	fprintf(stderr, "Device up in %.1f ms, first samples after %.1f ms.\n",
+		stats.open_us / 1e3, stats.first_sample_us / 1e3);
+	if (read_ret < 0)
+		fprintf(stderr, "Library error %d.\n", read_ret);
+
+	if (file != stdout)
+		fclose(file);
+
+	mirisdr_close(dev);
+
+	for (i = 0; i < pool_num; i++)
+		free(pool[i]);
+	free(pool);
+	free(queue);
+	free(threads);
+
+	for (i = 0; i < hop_num; i++) {
+		pthread_mutex_destroy(&hops[i].lock);
+		free(hops[i].pwr);
+	}
+	free(hops);
+	free(window);
+	free(twiddle);
+	free(bitrev);
+
+	return 0;
+
+out_close:
+	mirisdr_close(dev);
+	return 1;
+}
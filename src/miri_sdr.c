@@ -17,29 +17,95 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef _WIN32
+#define _GNU_SOURCE /* O_DIRECT */
+#endif
+
 #include <errno.h>
 #include <signal.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 
 #ifndef _WIN32
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
 #else
 #include <Windows.h>
+#include <malloc.h>
 #endif
 
 #include "mirisdr.h"
 
-#define DEFAULT_SAMPLE_RATE		500000
+#define DEFAULT_SAMPLE_RATE		2048000
 #define DEFAULT_ASYNC_BUF_NUMBER	32
 #define DEFAULT_BUF_LENGTH		(16 * 16384)
 #define MINIMAL_BUF_LENGTH		512
 #define MAXIMAL_BUF_LENGTH		(256 * 16384)
 
+/* the writer thread writes whole chunks, aligned for O_DIRECT */
+#define WRITE_CHUNK			(4 * 1024 * 1024)
+#define WRITE_ALIGN			4096
+#define DEFAULT_RING_CHUNKS		16
+
 static int do_exit = 0;
 static mirisdr_dev_t *dev = NULL;
 
+/*
+ * Samples are copied into a ring and written out by a thread of their own,
+ * so a stalling disk or pipe never holds up the event thread. When the ring
+ * is full the buffer is dropped and counted instead.
+ */
+typedef struct writer {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned char *ring;
+	size_t size;
+	size_t head;		/* only moved by the producer */
+	size_t tail;		/* only moved by the writer */
+	size_t fill;
+	size_t high_water;
+	uint64_t overruns;
+	uint64_t dropped;
+	int done;
+	int error;
+#ifdef _WIN32
+	FILE *file;
+#else
+	int fd;
+	int direct;
+#endif
+} writer_t;
+
+static writer_t writer;
+
+static const struct {
+	const char *name;
+	mirisdr_format_t format;
+	uint32_t sample_len; /* bytes per complex sample, 0: raw blocks */
+	int planar;
+} formats[] = {
+	{ "cs16", MIRISDR_FORMAT_CS16, 4, 0 },
+	{ "cf32", MIRISDR_FORMAT_CF32, 8, 0 },
+	{ "cu8", MIRISDR_FORMAT_CU8, 2, 0 },
+	{ "cs16p", MIRISDR_FORMAT_CS16_PLANAR, 4, 1 },
+	{ "cf32p", MIRISDR_FORMAT_CF32_PLANAR, 8, 1 },
+	{ "raw", MIRISDR_FORMAT_RAW, 0, 0 }
+};
+
+/* 384 complex samples in a block of 1024 bytes */
+#define RAW_BYTES(samples)	((uint64_t)(samples) * 1024 / 384)
+
 void usage(void)
 {
 	#ifdef _WIN32
@@ -50,10 +116,20 @@ void usage(void)
 	fprintf(stderr,
 		"Usage:\t -f frequency_to_tune_to [Hz]\n"
 		"\t[-s samplerate (default: 2048000 Hz)]\n"
-		"\t[-d device_index (default: 0)]\n"
+		"\t[-r output rate, decimate below the sample rate (default: off)]\n"
+		"\t[-d device_index or serial number (default: 0)]\n"
 		"\t[-g gain (default: 0 for auto)]\n"
 		"\t[-b output_block_size (default: 16 * 16384)]\n"
 		"\t[-S force sync output (default: async)]\n"
+		"\t[-R ring size in MiB the writer thread is fed from (default: 64)]\n"
+		"\t[-O write the file with O_DIRECT, bypassing the page cache]\n"
+		"\t[-W seconds, flight recorder: keep the last seconds in a circular file]\n"
+		"\t[-X freeze the flight recorder on a trigger (default: snapshot)]\n"
+		"\t[-U control socket path, a \"trigger\" line triggers the recorder]\n"
+		"\t[-F output format: cs16, cf32, cu8, cs16p, cf32p, raw (default: cs16)]\n"
+		"\t[-z replace lost samples by zeros]\n"
+		"\t[-c correct DC offset and IQ imbalance]\n"
+		"\t[-v verbose, log register writes and stream headers]\n"
 		"\tfilename (a '-' dumps samples to stdout)\n\n");
 #endif
 	exit(1);
@@ -80,14 +156,619 @@ static void sighandler(int signum)
 }
 #endif
 
-static void mirisdr_callback(unsigned char *buf, uint32_t len, void *ctx)
+static int sink_write(writer_t *w, const unsigned char *buf, size_t len)
+{
+#ifdef _WIN32
+	return fwrite(buf, 1, len, w->file) == len ? 0 : -1;
+#else
+	ssize_t n;
+
+#ifdef O_DIRECT
+	/* the tail at the end is not a whole chunk */
+	if (w->direct && len % WRITE_ALIGN) {
+		fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_DIRECT);
+		w->direct = 0;
+	}
+#endif
+
+	while (len) {
+		n = write(w->fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+#endif
+}
+
+/*
+ * Full chunks are written as soon as they are there, a partial one once it
+ * has waited for a second, so a slow stream still reaches a pipe in time.
+ * With O_DIRECT the partial writes stay multiples of WRITE_ALIGN, the ring
+ * size is one as well, so both the file offset and the buffer stay aligned.
+ */
+static void *writer_thread(void *arg)
 {
-	if (ctx) {
-		if (fwrite(buf, 1, len, (FILE*)ctx) != len) {
-			fprintf(stderr, "Short write, samples lost, exiting!\n");
+	writer_t *w = (writer_t *)arg;
+	struct timespec ts;
+	size_t n, min;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+#ifdef _WIN32
+		min = 1;
+#else
+		min = w->direct ? WRITE_ALIGN : 1;
+#endif
+		while (w->fill < WRITE_CHUNK && !w->done) {
+			ts.tv_sec = time(NULL) + 1;
+			ts.tv_nsec = 0;
+			if (pthread_cond_timedwait(&w->cond, &w->lock, &ts) ==
+			    ETIMEDOUT && w->fill >= min)
+				break;
+		}
+
+		if (!w->fill)
+			break;
+
+		n = w->fill < WRITE_CHUNK ? w->fill : WRITE_CHUNK;
+		if (n > w->size - w->tail)
+			n = w->size - w->tail;
+		if (!w->done)
+			n -= n % min;
+		pthread_mutex_unlock(&w->lock);
+
+		if (!w->error && sink_write(w, w->ring + w->tail, n) < 0) {
+			fprintf(stderr, "Write failed, exiting!\n");
+			w->error = 1;
+			do_exit = 1;
 			mirisdr_cancel_async(dev);
 		}
+
+		pthread_mutex_lock(&w->lock);
+		w->tail = (w->tail + n) % w->size;
+		w->fill -= n;
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+static int writer_start(writer_t *w, size_t size)
+{
+	w->size = size;
+#ifdef _WIN32
+	w->ring = _aligned_malloc(size, WRITE_ALIGN);
+	if (!w->ring)
+		return -1;
+#else
+	if (posix_memalign((void **)&w->ring, WRITE_ALIGN, size))
+		return -1;
+#endif
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+
+	if (pthread_create(&w->thread, NULL, writer_thread, w)) {
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->lock);
+#ifdef _WIN32
+		_aligned_free(w->ring);
+#else
+		free(w->ring);
+#endif
+		return -1;
+	}
+
+	return 0;
+}
+
+static void writer_push(writer_t *w, const unsigned char *buf, size_t len)
+{
+	size_t free_len, first;
+
+	pthread_mutex_lock(&w->lock);
+	free_len = w->size - w->fill;
+	pthread_mutex_unlock(&w->lock);
+
+	if (len > free_len) {
+		w->overruns++;
+		w->dropped += len;
+		return;
+	}
+
+	/* the writer does not touch the free part of the ring */
+	first = w->size - w->head;
+	if (first > len)
+		first = len;
+	memcpy(w->ring + w->head, buf, first);
+	memcpy(w->ring, buf + first, len - first);
+	w->head = (w->head + len) % w->size;
+
+	pthread_mutex_lock(&w->lock);
+	w->fill += len;
+	if (w->fill > w->high_water)
+		w->high_water = w->fill;
+	if (w->fill >= WRITE_CHUNK)
+		pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* write out what is left and stop the thread */
+static void writer_stop(writer_t *w)
+{
+	pthread_mutex_lock(&w->lock);
+	w->done = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	pthread_join(w->thread, NULL);
+
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+#ifdef _WIN32
+	_aligned_free(w->ring);
+#else
+	free(w->ring);
+#endif
+}
+
+/* open the output and start the writer thread, filename "-" is stdout */
+static int writer_open(writer_t *w, const char *filename, int direct,
+		       size_t ring_size)
+{
+#ifdef _WIN32
+	if(strcmp(filename, "-") == 0) { /* Write samples to stdout */
+		w->file = stdout;
+	} else {
+		w->file = fopen(filename, "wb");
+		if (!w->file) {
+			fprintf(stderr, "Failed to open %s\n", filename);
+			return -1;
+		}
+	}
+#else
+	int flags;
+
+	if(strcmp(filename, "-") == 0) { /* Write samples to stdout */
+		if (direct)
+			fprintf(stderr, "WARNING: O_DIRECT is for files, not stdout.\n");
+		w->fd = STDOUT_FILENO;
+	} else {
+		flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+		if (direct)
+			flags |= O_DIRECT;
+#else
+		if (direct)
+			fprintf(stderr, "WARNING: O_DIRECT is not supported here.\n");
+#endif
+		w->fd = open(filename, flags, 0644);
+#ifdef O_DIRECT
+		/* tmpfs and some network file systems refuse it */
+		if (w->fd < 0 && direct) {
+			fprintf(stderr, "WARNING: Failed to open %s with O_DIRECT.\n",
+				filename);
+			flags &= ~O_DIRECT;
+			w->fd = open(filename, flags, 0644);
+		}
+		w->direct = !!(flags & O_DIRECT);
+#endif
+		if (w->fd < 0) {
+			fprintf(stderr, "Failed to open %s\n", filename);
+			return -1;
+		}
+	}
+#endif
+
+	if (writer_start(w, ring_size) < 0) {
+		fprintf(stderr, "Failed to start the writer thread.\n");
+#ifdef _WIN32
+		if (w->file != stdout)
+			fclose(w->file);
+#else
+		if (w->fd != STDOUT_FILENO)
+			close(w->fd);
+#endif
+		return -1;
+	}
+
+	return 0;
+}
+
+static void writer_close(writer_t *w)
+{
+	writer_stop(w);
+
+	fprintf(stderr, "Ring filled up to %.1f of %.1f MiB, %llu overruns "
+		"(%llu bytes dropped).\n",
+		w->high_water / 1048576.0, w->size / 1048576.0,
+		(unsigned long long)w->overruns,
+		(unsigned long long)w->dropped);
+
+#ifdef _WIN32
+	if (w->file != stdout)
+		fclose(w->file);
+#else
+	if (w->fd != STDOUT_FILENO)
+		close(w->fd);
+#endif
+}
+
+#ifndef _WIN32
+/*
+ * Flight recorder. Samples go round a fixed size file mapped into memory,
+ * storing them is a memcpy and an update of the write position in the
+ * header, no system call. SIGUSR1 or a "trigger" line on the control
+ * socket either copies the window before the trigger to a file of its own,
+ * <file>.<n>, while recording goes on, or freezes the recording.
+ *
+ * The file keeps the header below in its first page, in host byte order.
+ * The oldest byte is at write_pos % data_len once write_pos exceeds
+ * data_len, at 0 before.
+ */
+#define RECORDER_MAGIC		"MIRIREC1"
+#define RECORDER_HEADER_LEN	4096
+#define SNAPSHOT_CHUNK		(1024 * 1024)
+
+typedef struct recorder_header {
+	char magic[8];
+	uint32_t header_len;	/* data area starts here */
+	uint32_t format;	/* mirisdr_format_t */
+	uint32_t sample_rate;
+	uint32_t center_freq;
+	uint64_t data_len;	/* size of the data area */
+	uint64_t write_pos;	/* bytes recorded in total */
+	uint64_t trigger_pos;	/* write_pos at the last trigger */
+	int64_t trigger_time;	/* of the last trigger, us since 1970, 0 none */
+	uint32_t frozen;	/* recording stopped at trigger_pos */
+} recorder_header_t;
+
+typedef struct recorder {
+	recorder_header_t *hdr;
+	unsigned char *data;
+	size_t map_len;
+	uint64_t data_len;
+	atomic_uint_fast64_t pos;
+	atomic_uint_fast64_t claim;	/* end of the bytes being stored */
+	atomic_int freeze;	/* asked to freeze, done by the producer */
+	int frozen;
+	int freeze_mode;
+	int raw;
+	mirisdr_raw_header_t raw_hdr;
+	const char *path;
+	unsigned int snapshots;
+	int wake[2];		/* from the signal handler and for quitting */
+	int listen_fd;
+	pthread_t thread;
+} recorder_t;
+
+static recorder_t recorder = { .wake = { -1, -1 }, .listen_fd = -1 };
+
+static void recorder_push(recorder_t *rec, const unsigned char *buf,
+			  size_t len)
+{
+	uint64_t pos = atomic_load_explicit(&rec->pos, memory_order_relaxed);
+	size_t off, n;
+
+	if (rec->frozen)
+		return;
+
+	if (atomic_load_explicit(&rec->freeze, memory_order_relaxed)) {
+		rec->hdr->trigger_pos = pos;
+		rec->hdr->frozen = 1;
+		rec->frozen = 1;
+		do_exit = 1;
+		mirisdr_cancel_async(dev);
+		return;
+	}
+
+	/* a snapshot taken meanwhile must not trust what is overwritten */
+	atomic_store_explicit(&rec->claim, pos + len, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	while (len) {
+		off = pos % rec->data_len;
+		n = rec->data_len - off < len ? rec->data_len - off : len;
+		memcpy(rec->data + off, buf, n);
+		buf += n;
+		len -= n;
+		pos += n;
+	}
+
+	atomic_store_explicit(&rec->pos, pos, memory_order_release);
+	rec->hdr->write_pos = pos;
+}
+
+/*
+ * Copy the window before the trigger position out, oldest first. Recording
+ * goes on meanwhile and overwrites the oldest data, each piece is checked
+ * to be still in the window after it was copied and skipped if it is not.
+ */
+static void recorder_snapshot(recorder_t *rec, uint64_t trigger)
+{
+	unsigned char *buf;
+	char name[1024];
+	uint64_t start, done = 0, lost = 0;
+	size_t off, n;
+	FILE *f;
+
+	snprintf(name, sizeof(name), "%s.%u", rec->path, rec->snapshots++);
+	f = fopen(name, "wb");
+	buf = malloc(SNAPSHOT_CHUNK);
+	if (!f || !buf) {
+		fprintf(stderr, "Failed to write snapshot %s\n", name);
+		if (f)
+			fclose(f);
+		free(buf);
+		return;
+	}
+
+	start = trigger > rec->data_len ? trigger - rec->data_len : 0;
+
+	if (rec->raw) {
+		rec->raw_hdr.start_time = rec->hdr->trigger_time -
+			(int64_t)((trigger - start) * 1000000 /
+				  RAW_BYTES(rec->raw_hdr.sample_rate));
+		fwrite(&rec->raw_hdr, 1, sizeof(rec->raw_hdr), f);
+	}
+
+	while (start < trigger) {
+		off = start % rec->data_len;
+		n = SNAPSHOT_CHUNK;
+		if (n > trigger - start)
+			n = trigger - start;
+		if (n > rec->data_len - off)
+			n = rec->data_len - off;
+
+		memcpy(buf, rec->data + off, n);
+
+		/* the producer may have come round meanwhile */
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&rec->claim, memory_order_relaxed) >
+		    start + rec->data_len) {
+			lost += n;
+			start += n;
+			continue;
+		}
+
+		if (fwrite(buf, 1, n, f) != n) {
+			fprintf(stderr, "Short write on snapshot %s\n", name);
+			break;
+		}
+		start += n;
+		done += n;
+	}
+
+	fclose(f);
+	free(buf);
+
+	fprintf(stderr, "Snapshot of %llu bytes written to %s",
+		(unsigned long long)done, name);
+	if (lost)
+		fprintf(stderr, ", %llu bytes were overwritten before they "
+			"were copied", (unsigned long long)lost);
+	fprintf(stderr, ".\n");
+}
+
+static void recorder_trigger(recorder_t *rec)
+{
+	struct timeval tv;
+	uint64_t pos;
+
+	gettimeofday(&tv, NULL);
+
+	if (rec->freeze_mode) {
+		rec->hdr->trigger_time = tv.tv_sec * 1000000LL + tv.tv_usec;
+		atomic_store(&rec->freeze, 1);
+		fprintf(stderr, "Trigger, freezing the recording.\n");
+		return;
+	}
+
+	pos = atomic_load_explicit(&rec->pos, memory_order_acquire);
+	rec->hdr->trigger_pos = pos;
+	rec->hdr->trigger_time = tv.tv_sec * 1000000LL + tv.tv_usec;
+
+	recorder_snapshot(rec, pos);
+}
+
+/* one command per connection, answered with a line */
+static void recorder_command(recorder_t *rec, int fd)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	char line[64];
+	ssize_t n = 0;
+	const char *reply;
+
+	if (poll(&pfd, 1, 1000) > 0)
+		n = read(fd, line, sizeof(line) - 1);
+	line[n > 0 ? n : 0] = '\0';
+	line[strcspn(line, "\r\n")] = '\0';
+
+	if (!strcmp(line, "trigger")) {
+		recorder_trigger(rec);
+		reply = "ok\n";
+	} else {
+		reply = "error: unknown command\n";
+	}
+
+	n = write(fd, reply, strlen(reply));
+	close(fd);
+}
+
+static void *recorder_thread(void *arg)
+{
+	recorder_t *rec = (recorder_t *)arg;
+	struct pollfd pfd[2];
+	char c;
+	int fd, n = 1;
+
+	pfd[0].fd = rec->wake[0];
+	pfd[0].events = POLLIN;
+	if (rec->listen_fd >= 0) {
+		pfd[1].fd = rec->listen_fd;
+		pfd[1].events = POLLIN;
+		n = 2;
+	}
+
+	for (;;) {
+		if (poll(pfd, n, -1) < 0)
+			continue;
+
+		if (pfd[0].revents & POLLIN) {
+			if (read(rec->wake[0], &c, 1) == 1) {
+				if (c == 'q')
+					break;
+				recorder_trigger(rec);
+			}
+		}
+
+		if (n == 2 && (pfd[1].revents & POLLIN)) {
+			fd = accept(rec->listen_fd, NULL, NULL);
+			if (fd >= 0)
+				recorder_command(rec, fd);
+		}
+	}
+
+	return NULL;
+}
+
+static void recorder_sighandler(int signum)
+{
+	ssize_t r = write(recorder.wake[1], "t", 1);
+
+	(void)r;
+}
+
+static int recorder_start(recorder_t *rec, const char *path, uint64_t len,
+			  uint32_t format, uint32_t rate, uint32_t freq,
+			  const char *sock_path)
+{
+	struct sockaddr_un addr;
+	void *map;
+	int fd, flags = MAP_SHARED;
+
+	rec->path = path;
+	rec->data_len = (len + RECORDER_HEADER_LEN - 1) /
+			RECORDER_HEADER_LEN * RECORDER_HEADER_LEN;
+	rec->map_len = RECORDER_HEADER_LEN + rec->data_len;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		return -1;
+	}
+
+	/* the blocks are allocated now, not on a page fault while streaming */
+	if (posix_fallocate(fd, 0, rec->map_len) && ftruncate(fd, rec->map_len)) {
+		fprintf(stderr, "Failed to size %s\n", path);
+		close(fd);
+		return -1;
+	}
+
+#ifdef MAP_POPULATE
+	flags |= MAP_POPULATE;
+#endif
+	map = mmap(NULL, rec->map_len, PROT_READ | PROT_WRITE, flags, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Failed to map %s\n", path);
+		return -1;
+	}
+
+	rec->hdr = (recorder_header_t *)map;
+	rec->data = (unsigned char *)map + RECORDER_HEADER_LEN;
+	memset(rec->hdr, 0, sizeof(recorder_header_t));
+	memcpy(rec->hdr->magic, RECORDER_MAGIC, sizeof(rec->hdr->magic));
+	rec->hdr->header_len = RECORDER_HEADER_LEN;
+	rec->hdr->format = format;
+	rec->hdr->sample_rate = rate;
+	rec->hdr->center_freq = freq;
+	rec->hdr->data_len = rec->data_len;
+	atomic_init(&rec->pos, 0);
+	atomic_init(&rec->claim, 0);
+	atomic_init(&rec->freeze, 0);
+
+	if (pipe(rec->wake) < 0)
+		goto err;
+
+	if (sock_path) {
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+		unlink(sock_path);
+
+		rec->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (rec->listen_fd < 0 ||
+		    bind(rec->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		    listen(rec->listen_fd, 4) < 0) {
+			fprintf(stderr, "Failed to listen on %s\n", sock_path);
+			goto err;
+		}
+	}
+
+	if (pthread_create(&rec->thread, NULL, recorder_thread, rec))
+		goto err;
+
+	return 0;
+err:
+	if (rec->listen_fd >= 0)
+		close(rec->listen_fd);
+	if (rec->wake[0] >= 0) {
+		close(rec->wake[0]);
+		close(rec->wake[1]);
 	}
+	munmap(map, rec->map_len);
+	rec->data = NULL;
+
+	return -1;
+}
+
+static void recorder_stop(recorder_t *rec, const char *sock_path)
+{
+	ssize_t r;
+
+	r = write(rec->wake[1], "q", 1);
+	(void)r;
+	pthread_join(rec->thread, NULL);
+
+	close(rec->wake[0]);
+	close(rec->wake[1]);
+	if (rec->listen_fd >= 0) {
+		close(rec->listen_fd);
+		unlink(sock_path);
+	}
+
+	fprintf(stderr, "Flight recorder: %llu bytes recorded, %u snapshots%s.\n",
+		(unsigned long long)atomic_load(&rec->pos), rec->snapshots,
+		rec->frozen ? ", frozen at the trigger" : "");
+
+	msync(rec->hdr, rec->map_len, MS_SYNC);
+	munmap(rec->hdr, rec->map_len);
+	rec->data = NULL;
+}
+#endif
+
+static void output(writer_t *w, const unsigned char *buf, size_t len)
+{
+#ifndef _WIN32
+	if (recorder.data) {
+		recorder_push(&recorder, buf, len);
+		return;
+	}
+#endif
+	writer_push(w, buf, len);
+}
+
+static void mirisdr_callback(unsigned char *buf, uint32_t len, void *ctx)
+{
+	if (ctx)
+		output((writer_t *)ctx, buf, len);
 }
 
 int main(int argc, char **argv)
@@ -100,23 +781,40 @@ int main(int argc, char **argv)
 	int r, opt;
 	int i, gain = 0;
 	int sync_mode = 0;
-	FILE *file;
+	int zero_fill = 0;
+	int corr = 0;
+	int direct = 0;
+	size_t ring_size = DEFAULT_RING_CHUNKS * WRITE_CHUNK;
+	double window = 0; /* s */
+	uint64_t window_samples;
+	int freeze_mode = 0;
+	const char *sock_path = NULL;
+	uint32_t sample_len = 4;
+	int planar = 0;
+	mirisdr_raw_header_t raw_hdr;
 	uint8_t *buffer;
 	uint32_t dev_index = 0;
+	const char *dev_serial = NULL;
 	uint32_t frequency = 100000000;
 	uint32_t samp_rate = DEFAULT_SAMPLE_RATE;
+	uint32_t out_rate = 0;
 	uint32_t out_block_size = DEFAULT_BUF_LENGTH;
+	mirisdr_format_t format = MIRISDR_FORMAT_CS16;
 	int device_count;
 	char vendor[256] = { 0 }, product[256] = { 0 }, serial[256] = { 0 };
 	int count;
 	int gains[100];
 	uint32_t rates[100];
+	mirisdr_stream_stats_t stats;
 
 #ifndef _WIN32
-	while ((opt = getopt(argc, argv, "d:f:g:s:b:S::")) != -1) {
+	while ((opt = getopt(argc, argv, "d:f:g:s:r:b:F:R:W:U:S::OXvzc")) != -1) {
 		switch (opt) {
 		case 'd':
-			dev_index = atoi(optarg);
+			if (optarg[strspn(optarg, "0123456789")])
+				dev_serial = optarg;
+			else
+				dev_index = atoi(optarg);
 			break;
 		case 'f':
 			frequency = (uint32_t)atof(optarg);
@@ -127,12 +825,54 @@ int main(int argc, char **argv)
 		case 's':
 			samp_rate = (uint32_t)atof(optarg);
 			break;
+		case 'r':
+			out_rate = (uint32_t)atof(optarg);
+			break;
 		case 'b':
 			out_block_size = (uint32_t)atof(optarg);
 			break;
 		case 'S':
 			sync_mode = 1;
 			break;
+		case 'R':
+			/* whole chunks, at least two so one can fill while the other is written */
+			ring_size = (size_t)(atof(optarg) * 1024 * 1024) / WRITE_CHUNK;
+			if (ring_size < 2)
+				ring_size = 2;
+			ring_size *= WRITE_CHUNK;
+			break;
+		case 'O':
+			direct = 1;
+			break;
+		case 'W':
+			window = atof(optarg);
+			break;
+		case 'X':
+			freeze_mode = 1;
+			break;
+		case 'U':
+			sock_path = optarg;
+			break;
+		case 'F':
+			for (i = 0; i < (int)(sizeof(formats) / sizeof(formats[0])); i++) {
+				if (!strcmp(optarg, formats[i].name))
+					break;
+			}
+			if (i == (int)(sizeof(formats) / sizeof(formats[0])))
+				usage();
+			format = formats[i].format;
+			sample_len = formats[i].sample_len;
+			planar = formats[i].planar;
+			break;
+		case 'z':
+			zero_fill = 1;
+			break;
+		case 'c':
+			corr = MIRISDR_CORR_DC | MIRISDR_CORR_IQ;
+			break;
+		case 'v':
+			mirisdr_set_log_callback(MIRISDR_LOG_DEBUG, NULL);
+			break;
 		default:
 			usage();
 			break;
@@ -179,6 +919,16 @@ int main(int argc, char **argv)
 	}
 	fprintf(stderr, "\n");
 
+	if (dev_serial) {
+		r = mirisdr_get_index_by_serial(dev_serial);
+		if (r < 0) {
+			fprintf(stderr, "No device with serial number %s.\n",
+				dev_serial);
+			exit(1);
+		}
+		dev_index = r;
+	}
+
 	fprintf(stderr, "Using device %d: %s\n",
 		dev_index, mirisdr_get_device_name(dev_index));
 
@@ -212,15 +962,43 @@ int main(int argc, char **argv)
 	else
 		fprintf(stderr, "%s, %s: SN: %s\n", vendor, product, serial);
 
-	/* Set the sample rate */
+	count = mirisdr_get_sample_rates(dev, rates);
+	fprintf(stderr, "Supported sample rates (%d): ", count);
+	for (i = 0; i < count; i++)
+		fprintf(stderr, "%u ", rates[i]);
+	fprintf(stderr, "\n");
+
+	/* Set the sample rate, recording at some other rate is of no use */
 	r = mirisdr_set_sample_rate(dev, samp_rate);
+	if (r < 0) {
+		fprintf(stderr, "Failed to set sample rate %u Hz.\n", samp_rate);
+		mirisdr_close(dev);
+		goto out;
+	}
+
+	samp_rate = mirisdr_get_sample_rate(dev);
+	fprintf(stderr, "Sample rate is set to %u Hz.\n", samp_rate);
+
+	r = mirisdr_set_output_format(dev, format);
 	if (r < 0)
-		fprintf(stderr, "WARNING: Failed to set sample rate.\n");
-	else {
-		samp_rate = mirisdr_get_sample_rate(dev);
-		fprintf(stderr, "Sample rate is set to %u Hz.\n", samp_rate);
+		fprintf(stderr, "WARNING: Failed to set output format.\n");
+
+	if (out_rate) {
+		r = mirisdr_set_output_rate(dev, out_rate);
+		if (r < 0)
+			fprintf(stderr, "WARNING: Failed to set output rate %u Hz.\n",
+				out_rate);
+		else
+			fprintf(stderr, "Decimating to %u Hz.\n",
+				mirisdr_get_output_rate(dev));
 	}
 
+	mirisdr_set_zero_fill(dev, zero_fill);
+
+	r = mirisdr_set_iq_correction(dev, corr);
+	if (r < 0)
+		fprintf(stderr, "WARNING: Failed to set IQ correction.\n");
+
 	/* Set the frequency */
 	r = mirisdr_set_center_freq(dev, frequency);
 	if (r < 0)
@@ -247,15 +1025,53 @@ int main(int argc, char **argv)
 			fprintf(stderr, "Tuner gain set to %f dB.\n", gain/10.0);
 	}
 
-	if(strcmp(filename, "-") == 0) { /* Write samples to stdout */
-		file = stdout;
-	} else {
-		file = fopen(filename, "wb");
-		if (!file) {
-			fprintf(stderr, "Failed to open %s\n", filename);
+#ifndef _WIN32
+	if (window > 0) {
+		if (strcmp(filename, "-") == 0 || planar) {
+			fprintf(stderr, "The flight recorder needs a file and an "
+				"interleaved format.\n");
+			mirisdr_close(dev);
 			goto out;
 		}
+
+		window_samples = window * mirisdr_get_output_rate(dev);
+		r = recorder_start(&recorder, filename,
+				   sample_len ? window_samples * sample_len :
+				   RAW_BYTES(window_samples), format,
+				   mirisdr_get_output_rate(dev), frequency,
+				   sock_path);
+		recorder.freeze_mode = freeze_mode;
+
+		/* snapshots of raw blocks get a header of their own */
+		if (r >= 0 && !sample_len)
+			recorder.raw = !mirisdr_get_raw_header(dev, &recorder.raw_hdr);
+	} else
+#endif
+		r = writer_open(&writer, filename, direct, ring_size);
+
+	if (r < 0) {
+		mirisdr_close(dev);
+		goto out;
+	}
+
+	/* raw blocks are preceded by a header describing them */
+	if (!sample_len && !window && mirisdr_get_raw_header(dev, &raw_hdr) >= 0)
+		writer_push(&writer, (const unsigned char *)&raw_hdr,
+			    sizeof(raw_hdr));
+
+#ifndef _WIN32
+	if (recorder.data) {
+		sigact.sa_handler = recorder_sighandler;
+		sigemptyset(&sigact.sa_mask);
+		sigact.sa_flags = SA_RESTART;
+		sigaction(SIGUSR1, &sigact, NULL);
+
+		fprintf(stderr, "Flight recorder keeping %.1f s in %s, "
+			"SIGUSR1%s%s triggers.\n", window, filename,
+			sock_path ? " or the socket " : "",
+			sock_path ? sock_path : "");
 	}
+#endif
 
 	/* Reset endpoint before we start reading from it (mandatory) */
 	r = mirisdr_reset_buffer(dev);
@@ -271,19 +1087,14 @@ int main(int argc, char **argv)
 				break;
 			}
 
-			if (fwrite(buffer, 1, n_read, file) != (size_t)n_read) {
-				fprintf(stderr, "Short write, samples lost, exiting!\n");
-				break;
-			}
+			output(&writer, buffer, n_read);
 
-			if ((uint32_t)n_read < out_block_size) {
-				fprintf(stderr, "Short read, samples lost, exiting!\n");
-				break;
-			}
+			if (r == MIRISDR_SYNC_DROPPED)
+				fprintf(stderr, "WARNING: samples dropped, writing too slow.\n");
 		}
 	} else {
 		fprintf(stderr, "Reading samples in async mode...\n");
-		r = mirisdr_read_async(dev, mirisdr_callback, (void *)file,
+		r = mirisdr_read_async(dev, mirisdr_callback, (void *)&writer,
 				      DEFAULT_ASYNC_BUF_NUMBER, out_block_size);
 	}
 
@@ -292,8 +1103,16 @@ int main(int argc, char **argv)
 	else
 		fprintf(stderr, "\nLibrary error %d, exiting...\n", r);
 
-	if (file != stdout)
-		fclose(file);
+	mirisdr_get_stream_stats(dev, &stats);
+	fprintf(stderr, "Device up in %.1f ms, first samples after %.1f ms.\n",
+		stats.open_us / 1e3, stats.first_sample_us / 1e3);
+
+#ifndef _WIN32
+	if (recorder.data)
+		recorder_stop(&recorder, sock_path);
+	else
+#endif
+		writer_close(&writer);
 
 	mirisdr_close(dev);
 	free (buffer);
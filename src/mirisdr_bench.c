@@ -0,0 +1,306 @@
+/*
+ * MiriSDR
+ * Sample conversion benchmark
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_TSC
+#include <x86intrin.h>
+#endif
+
+#include "convert.h"
+
+#define ISO_PACKET_BLOCKS	3	/* 3072 byte iso packet */
+#define MAX_PACKETS		128	/* largest transfer */
+#define MAX_BLOCKS		(MAX_PACKETS * ISO_PACKET_BLOCKS)
+#define MAX_SAMPLE_SIZE		8	/* complex float */
+
+#define DEFAULT_MIN_TIME	0.1	/* seconds per measurement */
+#define VERIFY_ROUNDS		100000
+
+static const uint32_t packet_counts[] = { 1, 8, 32, MAX_PACKETS };
+
+static uint32_t rng_state = 0x12345678;
+
+static uint32_t rng(void)
+{
+	/* xorshift32, deterministic so runs are comparable */
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+
+	return rng_state;
+}
+
+/*
+ * Fill nblocks blocks in the MSi2500 wire format: a header carrying the
+ * address counter, six sub-blocks of random packed 10 bit samples with
+ * random scale flags and zero padding.
+ */
+static void gen_blocks(uint8_t *buf, uint32_t nblocks, uint32_t *addr)
+{
+	uint8_t *ip;
+	uint32_t i, j, flags;
+
+	for (i = 0; i < nblocks; i++, buf += MIRISDR_BLOCK_LEN) {
+		memset(buf, 0, MIRISDR_BLOCK_LEN);
+
+		buf[1] = *addr & 0xff;
+		buf[2] = (*addr >> 8) & 0xff;
+		buf[3] = (*addr >> 16) & 0xff;
+		*addr = (*addr + 1) & 0xffffff;
+
+		ip = buf + MIRISDR_BLOCK_HDR_LEN;
+		for (j = 0; j < MIRISDR_SUBBLOCKS; j++) {
+			/* any byte pattern is a valid set of 10 bit samples */
+			for (flags = 0; flags < MIRISDR_SUBBLOCK_LEN; flags++)
+				ip[flags] = rng() & 0xff;
+
+			flags = rng();
+			ip[160] = flags & 0xff;
+			ip[161] = (flags >> 8) & 0xff;
+			ip[162] = (flags >> 16) & 0xff;
+			ip[163] = flags >> 24;
+
+			ip += MIRISDR_SUBBLOCK_LEN + MIRISDR_SUBBLOCK_FLAG_LEN;
+		}
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t cycles(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/* returns MS/s, cycles per complex sample in *cps (0 if unknown) */
+static double bench_one(const mirisdr_unpack_kernel_t *k,
+			const mirisdr_format_desc_t *fmt, mirisdr_iqcorr_t *corr,
+			const uint8_t *in, void *out, uint32_t nblocks,
+			double min_time, double *cps)
+{
+	uint32_t samples = nblocks * (MIRISDR_BLOCK_SAMPLES / 2);
+	uint64_t reps = 1, r, c0, c1;
+	double t0, t1;
+
+	/* warm up caches and the branch predictor */
+	mirisdr_convert_blocks(k->unpack, fmt, corr, in, out, 0, samples, nblocks);
+
+	for (;;) {
+		t0 = now();
+		c0 = cycles();
+		for (r = 0; r < reps; r++)
+			mirisdr_convert_blocks(k->unpack, fmt, corr, in, out, 0, samples, nblocks);
+		c1 = cycles();
+		t1 = now();
+
+		if (t1 - t0 >= min_time)
+			break;
+
+		reps *= 2;
+	}
+
+	*cps = (double)(c1 - c0) / ((double)reps * samples);
+
+	return (double)reps * samples / (t1 - t0) / 1e6;
+}
+
+/* compare every kernel and format with the scalar kernel */
+static int verify(void)
+{
+	const mirisdr_unpack_kernel_t *k, *ref = NULL;
+	const mirisdr_format_desc_t *fmt;
+	static uint8_t in[MAX_BLOCKS * MIRISDR_BLOCK_LEN];
+	static uint8_t out[MAX_BLOCKS * MIRISDR_BLOCK_SAMPLES / 2 * MAX_SAMPLE_SIZE];
+	static uint8_t out_ref[sizeof(out)];
+	int16_t sp[MIRISDR_SUBBLOCK_SAMPLES], sp_ref[MIRISDR_SUBBLOCK_SAMPLES];
+	uint32_t addr = 0, flags, len, samples = MAX_BLOCKS * (MIRISDR_BLOCK_SAMPLES / 2);
+	int i, f, bad, fail = 0;
+
+	for (k = mirisdr_unpack_kernels; k->name; k++) {
+		if (!strcmp(k->name, "scalar"))
+			ref = k;
+	}
+
+	for (k = mirisdr_unpack_kernels; k->name; k++) {
+		if (k == ref || !k->supported())
+			continue;
+
+		bad = 0;
+
+		/* raw kernels, with every scale flag combination */
+		for (i = 0; i < VERIFY_ROUNDS; i++) {
+			gen_blocks(in, 1, &addr);
+			flags = rng();
+
+			ref->unpack(in + MIRISDR_BLOCK_HDR_LEN, sp_ref, flags);
+			k->unpack(in + MIRISDR_BLOCK_HDR_LEN, sp, flags);
+
+			if (memcmp(sp, sp_ref, sizeof(sp))) {
+				fprintf(stderr, "%s: mismatch, flags 0x%08x\n", k->name, flags);
+				bad = 1;
+				break;
+			}
+		}
+
+		/* whole transfers in every output format */
+		gen_blocks(in, MAX_BLOCKS, &addr);
+		for (f = 0; (fmt = mirisdr_format_desc(f)); f++) {
+			/* raw blocks are not converted */
+			if (!fmt->sample_size)
+				continue;
+
+			len = samples * fmt->sample_size;
+
+			mirisdr_convert_blocks(ref->unpack, fmt, NULL, in, out_ref, 0, samples, MAX_BLOCKS);
+			mirisdr_convert_blocks(k->unpack, fmt, NULL, in, out, 0, samples, MAX_BLOCKS);
+
+			if (memcmp(out, out_ref, len)) {
+				fprintf(stderr, "%s: %s output mismatch\n", k->name, fmt->name);
+				bad = 1;
+			}
+		}
+
+		fprintf(stderr, "%s: %s\n", k->name, bad ? "FAILED" : "ok");
+		fail |= bad;
+	}
+
+	return fail;
+}
+
+void usage(void)
+{
+	fprintf(stderr,
+		"mirisdr_bench, sample conversion benchmark\n\n"
+		"Usage:\t[-k kernel (default: all supported)]\n"
+		"\t[-f format (default: all)]\n"
+		"\t[-t seconds per measurement (default: %.1f)]\n"
+		"\t[-c with DC offset and IQ imbalance correction]\n"
+		"\t[-j print JSON instead of a table]\n"
+		"\t[-V verify all kernels against the scalar one and exit]\n",
+		DEFAULT_MIN_TIME);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const mirisdr_unpack_kernel_t *k;
+	const mirisdr_format_desc_t *fmt;
+	const char *kernel = NULL, *format = NULL;
+	mirisdr_iqcorr_t iqcorr, *corr = NULL;
+	double min_time = DEFAULT_MIN_TIME, msps, cps;
+	int json = 0, first = 1;
+	uint32_t addr = 0, i, nblocks;
+	uint8_t *in, *out;
+	int opt, f;
+
+	while ((opt = getopt(argc, argv, "k:f:t:cjV")) != -1) {
+		switch (opt) {
+		case 'k':
+			kernel = optarg;
+			break;
+		case 'f':
+			format = optarg;
+			break;
+		case 't':
+			min_time = atof(optarg);
+			break;
+		case 'c':
+			mirisdr_iqcorr_init(&iqcorr, MIRISDR_CORR_DC | MIRISDR_CORR_IQ);
+			corr = &iqcorr;
+			break;
+		case 'j':
+			json = 1;
+			break;
+		case 'V':
+			return verify();
+		default:
+			usage();
+			break;
+		}
+	}
+
+	in = malloc(MAX_BLOCKS * MIRISDR_BLOCK_LEN);
+	out = malloc(MAX_BLOCKS * (MIRISDR_BLOCK_SAMPLES / 2) * MAX_SAMPLE_SIZE);
+	if (!in || !out) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	gen_blocks(in, MAX_BLOCKS, &addr);
+
+	if (json)
+		printf("{\n  \"selected\": \"%s\",\n  \"results\": [\n",
+		       mirisdr_unpack_select()->name);
+	else
+		printf("selected kernel: %s\n\n%-8s %-6s %8s %8s %10s %8s\n",
+		       mirisdr_unpack_select()->name,
+		       "kernel", "format", "packets", "blocks", "MS/s", "cyc/S");
+
+	for (k = mirisdr_unpack_kernels; k->name; k++) {
+		if (!k->supported() || (kernel && strcmp(kernel, k->name)))
+			continue;
+
+		for (f = 0; (fmt = mirisdr_format_desc(f)); f++) {
+			if (!fmt->sample_size || (format && strcmp(format, fmt->name)))
+				continue;
+
+			for (i = 0; i < sizeof(packet_counts) / sizeof(packet_counts[0]); i++) {
+				nblocks = packet_counts[i] * ISO_PACKET_BLOCKS;
+				msps = bench_one(k, fmt, corr, in, out, nblocks, min_time, &cps);
+
+				if (json) {
+					printf("%s    { \"kernel\": \"%s\", \"format\": \"%s\", "
+					       "\"packets\": %u, \"blocks\": %u, "
+					       "\"msps\": %.2f, \"cycles_per_sample\": %.3f }",
+					       first ? "" : ",\n", k->name, fmt->name,
+					       packet_counts[i], nblocks, msps, cps);
+					first = 0;
+				} else {
+					printf("%-8s %-6s %8u %8u %10.2f %8.3f\n",
+					       k->name, fmt->name, packet_counts[i],
+					       nblocks, msps, cps);
+				}
+			}
+		}
+	}
+
+	if (json)
+		printf("\n  ]\n}\n");
+
+	free(in);
+	free(out);
+
+	return 0;
+}
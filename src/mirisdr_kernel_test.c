@@ -0,0 +1,130 @@
+/*
+ * MiriSDR
+ * Check every unpack kernel against the scalar one
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "convert.h"
+
+#define ROUNDS		200000
+
+/*
+ * Sub-blocks are taken from whole blocks, the kernels may read up to 6 bytes
+ * past them, into the flag word and for the last one the block padding.
+ */
+#define SUBBLOCK_STEP	(MIRISDR_SUBBLOCK_LEN + MIRISDR_SUBBLOCK_FLAG_LEN)
+
+static const uint8_t *subblock(const uint8_t *block, int k)
+{
+	return block + MIRISDR_BLOCK_HDR_LEN + k * SUBBLOCK_STEP;
+}
+
+static uint32_t rng_state = 0x9e3779b9;
+
+static uint32_t rng(void)
+{
+	/* xorshift32, failures are reproducible */
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+
+	return rng_state;
+}
+
+static int check(const mirisdr_unpack_kernel_t *k,
+		 const mirisdr_unpack_kernel_t *ref,
+		 const uint8_t *ip, uint32_t flags)
+{
+	int16_t sp[MIRISDR_SUBBLOCK_SAMPLES], sp_ref[MIRISDR_SUBBLOCK_SAMPLES];
+
+	ref->unpack(ip, sp_ref, flags);
+	k->unpack(ip, sp, flags);
+
+	if (!memcmp(sp, sp_ref, sizeof(sp)))
+		return 0;
+
+	fprintf(stderr, "%s: mismatch, flags 0x%08x\n", k->name, flags);
+
+	return 1;
+}
+
+static int check_kernel(const mirisdr_unpack_kernel_t *k,
+			const mirisdr_unpack_kernel_t *ref)
+{
+	uint8_t block[MIRISDR_BLOCK_LEN];
+	uint32_t flags;
+	int i, j;
+
+	/* extremes of the packed values, with every scale of them */
+	for (i = 0; i < 4; i++) {
+		memset(block, i & 1 ? 0xff : 0x00, sizeof(block));
+		if (i & 2)
+			block[MIRISDR_BLOCK_HDR_LEN] = block[MIRISDR_BLOCK_HDR_LEN + 5] = 0x55;
+		for (flags = 0; flags < 4; flags++) {
+			if (check(k, ref, subblock(block, 0), flags * 0x55555555))
+				return 1;
+		}
+	}
+
+	for (i = 0; i < ROUNDS / MIRISDR_SUBBLOCKS; i++) {
+		for (j = 0; j < MIRISDR_BLOCK_LEN; j++)
+			block[j] = rng() & 0xff;
+
+		for (j = 0; j < MIRISDR_SUBBLOCKS; j++) {
+			if (check(k, ref, subblock(block, j), rng()))
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	const mirisdr_unpack_kernel_t *k, *ref = NULL;
+	int fail = 0;
+
+	for (k = mirisdr_unpack_kernels; k->name; k++) {
+		if (!strcmp(k->name, "scalar"))
+			ref = k;
+	}
+
+	if (!ref) {
+		fprintf(stderr, "no scalar kernel\n");
+		return 1;
+	}
+
+	for (k = mirisdr_unpack_kernels; k->name; k++) {
+		if (k == ref)
+			continue;
+
+		if (!k->supported()) {
+			fprintf(stderr, "%s: not supported, skipped\n", k->name);
+			continue;
+		}
+
+		if (check_kernel(k, ref)) {
+			fprintf(stderr, "%s: FAILED\n", k->name);
+			fail = 1;
+		} else {
+			fprintf(stderr, "%s: ok\n", k->name);
+		}
+	}
+
+	return fail;
+}
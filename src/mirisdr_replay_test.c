@@ -0,0 +1,224 @@
+/*
+ * MiriSDR
+ * Stream a synthetic capture through the replay transport
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mirisdr.h"
+#include "convert.h"
+
+#define CAPTURE		"mirisdr_replay_test.bin"
+
+/* not a multiple of the transfer size, the last one ends short */
+#define BLOCKS		1001
+#define SAMPLES		((uint64_t)BLOCKS * MIRISDR_BLOCK_SAMPLES / 2)
+
+/* packed 10 bit value of a sample, CS16 has it scaled to full scale */
+static int value(uint64_t n)
+{
+	return (int)((n * 37 + n / 5) % 1024) - 512;
+}
+
+static int16_t expected(uint64_t n)
+{
+	return value(n) * (MIRISDR_CS16_FULL_SCALE / 512);
+}
+
+/* 8 samples in 10 bytes, as unpack_scalar() takes them */
+static void pack(uint8_t *op, uint64_t n)
+{
+	uint32_t u[4];
+	int i, j;
+
+	for (j = 0; j < 2; j++, op += 5) {
+		for (i = 0; i < 4; i++)
+			u[i] = value(n++) & 0x3ff;
+
+		op[0] = u[0] & 0xff;
+		op[1] = (u[0] >> 8) | ((u[1] & 0x3f) << 2);
+		op[2] = (u[1] >> 6) | ((u[2] & 0x0f) << 4);
+		op[3] = (u[2] >> 4) | ((u[3] & 0x03) << 6);
+		op[4] = u[3] >> 2;
+	}
+}
+
+static int write_capture(int header)
+{
+	mirisdr_raw_header_t hdr;
+	uint8_t block[MIRISDR_BLOCK_LEN], *ip;
+	uint64_t n = 0;
+	uint32_t b;
+	int k, j;
+	FILE *f;
+
+	f = fopen(CAPTURE, "wb");
+	if (!f) {
+		perror(CAPTURE);
+		return -1;
+	}
+
+	if (header) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, MIRISDR_RAW_MAGIC, sizeof(hdr.magic));
+		hdr.byte_order = MIRISDR_RAW_BYTE_ORDER;
+		hdr.header_len = sizeof(hdr);
+		hdr.block_len = MIRISDR_BLOCK_LEN;
+		hdr.block_samples = MIRISDR_BLOCK_SAMPLES / 2;
+		hdr.sample_bits = 10;
+		hdr.sample_rate = 2000000;
+		fwrite(&hdr, 1, sizeof(hdr), f);
+	}
+
+	for (b = 0; b < BLOCKS; b++) {
+		memset(block, 0, sizeof(block));
+		block[1] = b & 0xff;
+		block[2] = (b >> 8) & 0xff;
+		block[3] = (b >> 16) & 0xff;
+
+		for (k = 0; k < MIRISDR_SUBBLOCKS; k++) {
+			ip = block + MIRISDR_BLOCK_HDR_LEN +
+			     k * (MIRISDR_SUBBLOCK_LEN + MIRISDR_SUBBLOCK_FLAG_LEN);
+
+			for (j = 0; j < MIRISDR_SUBBLOCK_SAMPLES; j += 8, n += 8)
+				pack(ip + j / 8 * 10, n);
+		}
+
+		fwrite(block, 1, sizeof(block), f);
+	}
+
+	return fclose(f) ? -1 : 0;
+}
+
+typedef struct result {
+	uint64_t samples;	/* int16 values seen */
+	uint64_t errors;
+} result_t;
+
+static void check_samples(result_t *res, const int16_t *sp, uint32_t num)
+{
+	uint32_t i;
+
+	for (i = 0; i < num; i++, res->samples++) {
+		if (sp[i] != expected(res->samples) && !res->errors++)
+			fprintf(stderr, "sample %llu is %d, not %d\n",
+				(unsigned long long)res->samples, sp[i],
+				expected(res->samples));
+	}
+}
+
+static void async_cb(unsigned char *buf, uint32_t len, void *ctx)
+{
+	check_samples(ctx, (const int16_t *)buf, len / sizeof(int16_t));
+}
+
+static int open_capture(mirisdr_dev_t **dev)
+{
+	int r;
+
+	r = mirisdr_open_replay(dev, CAPTURE, NULL, 0);
+	if (r < 0) {
+		fprintf(stderr, "can't open %s: %d\n", CAPTURE, r);
+		return r;
+	}
+
+	return mirisdr_set_output_format(*dev, MIRISDR_FORMAT_CS16);
+}
+
+static int test_async(result_t *res)
+{
+	mirisdr_dev_t *dev;
+	int r;
+
+	if (open_capture(&dev) < 0)
+		return -1;
+
+	/* returns at the end of the capture */
+	r = mirisdr_read_async(dev, async_cb, res, 0, 0);
+	mirisdr_close(dev);
+
+	return r;
+}
+
+static int test_sync(result_t *res)
+{
+	static int16_t buf[4096];
+	mirisdr_dev_t *dev;
+	int r, n;
+
+	if (open_capture(&dev) < 0)
+		return -1;
+
+	/* full reads until the end, the last one short with an error */
+	do {
+		r = mirisdr_read_sync(dev, buf, sizeof(buf), &n);
+		check_samples(res, buf, n / sizeof(int16_t));
+	} while (!r && n == sizeof(buf));
+
+	if (r >= 0) {
+		fprintf(stderr, "no error at the end of the capture: %d\n", r);
+		mirisdr_close(dev);
+		return -1;
+	}
+
+	/* past the end, reads fail right away */
+	r = mirisdr_read_sync(dev, buf, sizeof(buf), &n);
+	mirisdr_close(dev);
+
+	if (r >= 0 || n) {
+		fprintf(stderr, "read past the end: %d, %d bytes\n", r, n);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int run(const char *name, int (*test)(result_t *))
+{
+	result_t res = { 0, 0 };
+	int fail;
+
+	fail = test(&res) < 0 || res.errors ||
+	       res.samples != SAMPLES * 2;
+
+	fprintf(stderr, "%s: %llu of %llu samples, %llu wrong: %s\n", name,
+		(unsigned long long)res.samples / 2,
+		(unsigned long long)SAMPLES,
+		(unsigned long long)res.errors, fail ? "FAILED" : "ok");
+
+	return fail;
+}
+
+int main(void)
+{
+	int header, fail = 0;
+
+	for (header = 0; header < 2; header++) {
+		if (write_capture(header) < 0)
+			return 1;
+
+		fprintf(stderr, "%s raw header\n", header ? "with" : "without");
+
+		fail |= run("read_async", test_async);
+		fail |= run("read_sync", test_sync);
+	}
+
+	remove(CAPTURE);
+
+	return fail;
+}
@@ -0,0 +1,399 @@
+/*
+ * Capture file replay transport
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mirisdr.h"
+#include "mirisdr_log.h"
+#include "transport.h"
+
+/*
+ * The capture file holds the raw payload of the iso packets, a stream of
+ * 1024 byte blocks exactly as sent by the MSi2500, possibly preceded by a
+ * mirisdr_raw_header_t. Each completed transfer is filled from the file,
+ * control requests only go to the register log.
+ *
+ * The length and status of the packets are not part of the capture, so
+ * every packet comes back completed and full, only the last one of the
+ * file may be short. Packets lost on the bus show up just as gaps in the
+ * block addresses.
+ */
+
+/* rate programmed by the baseband init, used when none is set */
+#define REPLAY_DEFAULT_RATE	9140000
+
+#define REPLAY_BYTES_PER_SEC(rate)	((uint64_t)(rate) * 1024 / 384)
+
+typedef struct replay_transport {
+	mirisdr_transport_t base;
+	FILE *file;
+	FILE *regs;
+	char *path;
+	int flags;
+	long data_start;	/* past the header */
+	uint32_t file_rate;	/* from the header, 0 without one */
+	/* streaming */
+	unsigned char *buf;
+	mirisdr_packet_t *pkts;
+	uint32_t iso_packets;
+	uint32_t packet_len;
+	uint32_t xfer_num;
+	uint32_t pending;
+	int running;
+	uint64_t bytes_per_sec;
+	uint64_t bytes_sent;
+	uint64_t start_ns;
+	mirisdr_packets_cb_t cb;
+	void *cb_ctx;
+	/* submitted control requests, completed by the next handle_events() */
+	mirisdr_ctrl_cb_t ctrl_cb;
+	void *ctrl_ctx;
+} replay_transport_t;
+
+static uint64_t replay_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void replay_close(mirisdr_transport_t *t)
+{
+	replay_transport_t *r = (replay_transport_t *)t;
+
+	if (r->regs)
+		fclose(r->regs);
+
+	fclose(r->file);
+	free(r->path);
+	free(r);
+}
+
+static int replay_activate(mirisdr_transport_t *t)
+{
+	return 0;
+}
+
+static int replay_control(mirisdr_transport_t *t, uint8_t request,
+			  uint16_t value, uint16_t index)
+{
+	replay_transport_t *r = (replay_transport_t *)t;
+
+	if (!r->regs)
+		return 0;
+
+	/* register writes in the form msi2500_write_reg() takes them */
+	if (request == 0x41)
+		fprintf(r->regs, "reg 0x%02x 0x%06x\n", value & 0xff,
+			((uint32_t)index << 8) | (value >> 8));
+	else
+		fprintf(r->regs, "req 0x%02x 0x%04x 0x%04x\n", request, value, index);
+
+	return 0;
+}
+
+static int replay_control_batch(mirisdr_transport_t *t,
+				const mirisdr_ctrl_t *reqs, int num)
+{
+	int i;
+
+	for (i = 0; i < num; i++)
+		replay_control(t, reqs[i].request, reqs[i].value, reqs[i].index);
+
+	return 0;
+}
+
+static void replay_ctrl_complete(replay_transport_t *r)
+{
+	mirisdr_ctrl_cb_t cb = r->ctrl_cb;
+
+	if (!cb)
+		return;
+
+	r->ctrl_cb = NULL;
+	cb(r->ctrl_ctx, 0);
+}
+
+static int replay_control_submit(mirisdr_transport_t *t,
+				 const mirisdr_ctrl_t *reqs, int num,
+				 mirisdr_ctrl_cb_t cb, void *ctx)
+{
+	replay_transport_t *r = (replay_transport_t *)t;
+
+	if (num <= 0)
+		return 0;
+
+	/* only one set is held back, an older one completes right away */
+	replay_ctrl_complete(r);
+
+	replay_control_batch(t, reqs, num);
+	r->ctrl_cb = cb;
+	r->ctrl_ctx = ctx;
+
+	return 0;
+}
+
+static int replay_get_usb_strings(mirisdr_transport_t *t, char *manufact,
+				  char *product, char *serial)
+{
+	replay_transport_t *r = (replay_transport_t *)t;
+	const int buf_max = 256;
+
+	if (manufact)
+		snprintf(manufact, buf_max, "Mirics");
+
+	if (product)
+		snprintf(product, buf_max, "MSi2500 replay");
+
+	if (serial)
+		snprintf(serial, buf_max, "%s", r->path);
+
+	return 0;
+}
+
+static void replay_stream_free(mirisdr_transport_t *t)
+{
+	replay_transport_t *r = (replay_transport_t *)t;
+
+	r->running = 0;
+	r->pending = 0;
+	replay_ctrl_complete(r);
+
+	free(r->buf);
+	free(r->pkts);
+	r->buf = NULL;
+	r->pkts = NULL;
+}
+
+static int replay_stream_start(mirisdr_transport_t *t, uint32_t buf_num,
+			       uint32_t iso_packets, uint32_t packet_len,
+			       uint32_t rate, mirisdr_packets_cb_t cb, void *ctx)
+{
+	replay_transport_t *r = (replay_transport_t *)t;
+
+	/* a single buffer is enough, transfers complete one at a time */
+	r->buf = malloc(iso_packets * packet_len);
+	r->pkts = calloc(iso_packets, sizeof(mirisdr_packet_t));
+	if (!r->buf || !r->pkts) {
+		replay_stream_free(t);
+		return -ENOMEM;
+	}
+
+	r->iso_packets = iso_packets;
+	r->packet_len = packet_len;
+	r->xfer_num = buf_num;
+	r->pending = buf_num;
+	r->running = 1;
+	/* a header knows the rate the blocks were recorded at */
+	if (r->file_rate)
+		rate = r->file_rate;
+	r->bytes_per_sec = REPLAY_BYTES_PER_SEC(rate ? rate : REPLAY_DEFAULT_RATE);
+	r->bytes_sent = 0;
+	r->start_ns = replay_now_ns();
+	r->cb = cb;
+	r->cb_ctx = ctx;
+
+	return 0;
+}
+
+/* fill one transfer from the file, 0 at the end of the capture */
+static size_t replay_fill(replay_transport_t *r)
+{
+	size_t len = r->iso_packets * r->packet_len, n;
+	uint32_t i, off;
+
+	n = fread(r->buf, 1, len, r->file);
+	if (n < len && (r->flags & MIRISDR_REPLAY_LOOP)) {
+		fseek(r->file, r->data_start, SEEK_SET);
+		n += fread(r->buf + n, 1, len - n, r->file);
+	}
+
+	for (i = 0; i < r->iso_packets; i++) {
+		off = i * r->packet_len;
+
+		r->pkts[i].buf = r->buf + off;
+		r->pkts[i].length = r->packet_len;
+		r->pkts[i].actual_length = n > off ? (n - off < r->packet_len ?
+					   n - off : r->packet_len) : 0;
+		r->pkts[i].status = MIRISDR_PACKET_COMPLETED;
+	}
+
+	return n;
+}
+
+static int replay_handle_events(mirisdr_transport_t *t, int timeout_ms)
+{
+	replay_transport_t *r = (replay_transport_t *)t;
+	struct timespec ts;
+	uint64_t now, due, wait;
+	uint32_t i;
+	size_t n;
+
+	replay_ctrl_complete(r);
+
+	if (!r->running)
+		return 0;
+
+	for (i = 0; i < r->xfer_num && r->running; i++) {
+		if (r->flags & MIRISDR_REPLAY_REALTIME) {
+			now = replay_now_ns();
+			due = r->start_ns + r->bytes_sent * 1000000000ULL / r->bytes_per_sec;
+
+			if (due > now) {
+				if (i)
+					break;
+
+				/* nothing due yet, sleep like a blocking poll */
+				wait = due - now;
+				if (wait > (uint64_t)timeout_ms * 1000000ULL)
+					wait = (uint64_t)timeout_ms * 1000000ULL;
+
+				ts.tv_sec = wait / 1000000000ULL;
+				ts.tv_nsec = wait % 1000000000ULL;
+				nanosleep(&ts, NULL);
+
+				if (wait < due - now)
+					break;
+			}
+		}
+
+		n = replay_fill(r);
+
+		/* end of the capture, the transfers never come back */
+		if (!n) {
+			r->running = 0;
+			r->pending = 0;
+			break;
+		}
+
+		r->bytes_sent += n;
+		r->cb(r->cb_ctx, r->pkts, r->iso_packets);
+	}
+
+	return 0;
+}
+
+static int replay_stream_cancel(mirisdr_transport_t *t)
+{
+	replay_transport_t *r = (replay_transport_t *)t;
+
+	r->running = 0;
+	r->pending = 0;
+
+	return 0;
+}
+
+static uint32_t replay_stream_pending(mirisdr_transport_t *t)
+{
+	replay_transport_t *r = (replay_transport_t *)t;
+
+	return r->pending + (r->ctrl_cb ? 1 : 0);
+}
+
+static const mirisdr_transport_ops_t replay_ops = {
+	"replay",
+	replay_close,
+	replay_activate,
+	replay_control,
+	replay_control_batch,
+	replay_control_submit,
+	replay_get_usb_strings,
+	replay_stream_start,
+	replay_handle_events,
+	replay_stream_cancel,
+	replay_stream_pending,
+	replay_stream_free
+};
+
+static uint32_t replay_swap32(uint32_t v)
+{
+	return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+}
+
+/* skip a raw capture header, if there is one */
+static int replay_header(replay_transport_t *r)
+{
+	mirisdr_raw_header_t hdr;
+	uint32_t header_len, rate;
+
+	if (fread(&hdr, 1, sizeof(hdr), r->file) != sizeof(hdr) ||
+	    memcmp(hdr.magic, MIRISDR_RAW_MAGIC, sizeof(hdr.magic))) {
+		rewind(r->file);
+		return 0;
+	}
+
+	header_len = hdr.header_len;
+	rate = hdr.sample_rate;
+	if (hdr.byte_order != MIRISDR_RAW_BYTE_ORDER) {
+		header_len = replay_swap32(header_len);
+		rate = replay_swap32(rate);
+	}
+
+	if (header_len < sizeof(hdr) ||
+	    fseek(r->file, header_len, SEEK_SET) < 0) {
+		log_err("bad raw capture header in %s", r->path);
+		return -EINVAL;
+	}
+
+	r->data_start = header_len;
+	r->file_rate = rate;
+
+	return 0;
+}
+
+int mirisdr_replay_open(mirisdr_transport_t **t, const char *path,
+			const char *reg_log, int flags)
+{
+	replay_transport_t *r;
+
+	r = calloc(1, sizeof(replay_transport_t));
+	if (NULL == r)
+		return -ENOMEM;
+
+	r->base.ops = &replay_ops;
+	r->flags = flags;
+
+	r->file = fopen(path, "rb");
+	if (!r->file) {
+		log_err("can't open replay file %s", path);
+		free(r);
+		return -ENOENT;
+	}
+
+	if (reg_log) {
+		r->regs = fopen(reg_log, "w");
+		if (!r->regs)
+			log_warn("can't open register log %s", reg_log);
+	}
+
+	r->path = strdup(path);
+
+	if (replay_header(r) < 0) {
+		replay_close(&r->base);
+		return -EINVAL;
+	}
+
+	*t = &r->base;
+
+	return 0;
+}
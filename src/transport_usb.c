@@ -0,0 +1,956 @@
+/*
+ * libusb transport for the MSi2500
+ *
+ * Copyright (C) 2012 by Steve Markgraf <steve@steve-m.de>
+ * Copyright (C) 2012 by Dimitri Stolnikov <horiz0n@gmx.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <libusb.h>
+
+/*
+ * All libusb callback functions should be marked with the LIBUSB_CALL macro
+ * to ensure that they are compiled with the same calling convention as libusb.
+ *
+ * If the macro isn't available in older libusb versions, we simply define it.
+ */
+#ifndef LIBUSB_CALL
+#define LIBUSB_CALL
+#endif
+
+#include "mirisdr_log.h"
+#include "transport.h"
+
+typedef struct mirisdr_dongle {
+	uint16_t vid;
+	uint16_t pid;
+	const char *name;
+} mirisdr_dongle_t;
+
+static mirisdr_dongle_t known_devices[] = {
+	{ 0x1df7, 0x2500, "Mirics MSi2500 default (e.g. VTX3D card)" },
+	{ 0x04bb, 0x0537, "IO-DATA GV-TV100 stick" }
+};
+
+#define CTRL_TIMEOUT	300
+#define CTRL_EVENT_TRIES	10 /* failed event rounds before a batch is given up */
+#define ISO_TIMEOUT	0
+
+typedef struct usb_transport {
+	mirisdr_transport_t base;
+	libusb_context *ctx;
+	int own_ctx; /* 0: borrowed from a mirisdr_usb_pool_t */
+	struct libusb_device_handle *devh;
+	/* streaming */
+	struct libusb_transfer **xfer;
+	unsigned char **xfer_buf;
+	uint32_t xfer_num;
+	uint32_t pending; /* transfers submitted to libusb */
+	uint32_t ctrl_pending; /* control request sets in flight */
+	int running;
+	mirisdr_packet_t *pkts;
+	mirisdr_packets_cb_t cb;
+	void *cb_ctx;
+} usb_transport_t;
+
+static mirisdr_dongle_t *find_known_device(uint16_t vid, uint16_t pid)
+{
+	unsigned int i;
+	mirisdr_dongle_t *device = NULL;
+
+	for (i = 0; i < sizeof(known_devices)/sizeof(mirisdr_dongle_t); i++ ) {
+		if (known_devices[i].vid == vid && known_devices[i].pid == pid) {
+			device = &known_devices[i];
+			break;
+		}
+	}
+
+	return device;
+}
+
+static int usb_strings(struct libusb_device_handle *devh, char *manufact,
+		       char *product, char *serial)
+{
+	struct libusb_device_descriptor dd;
+	libusb_device *device = NULL;
+	const int buf_max = 256;
+	int r = 0;
+
+	device = libusb_get_device(devh);
+
+	r = libusb_get_device_descriptor(device, &dd);
+	if (r < 0)
+		return -1;
+
+	if (manufact) {
+		memset(manufact, 0, buf_max);
+		libusb_get_string_descriptor_ascii(devh, dd.iManufacturer,
+						   (unsigned char *)manufact,
+						   buf_max);
+	}
+
+	if (product) {
+		memset(product, 0, buf_max);
+		libusb_get_string_descriptor_ascii(devh, dd.iProduct,
+						   (unsigned char *)product,
+						   buf_max);
+	}
+
+	if (serial) {
+		memset(serial, 0, buf_max);
+		libusb_get_string_descriptor_ascii(devh, dd.iSerialNumber,
+						   (unsigned char *)serial,
+						   buf_max);
+	}
+
+	return 0;
+}
+
+/*
+ * Enumeration is served from a snapshot of the known devices, taken once
+ * with a libusb context that stays around. Where libusb supports hotplug
+ * the snapshot follows the arrive and leave events, which are picked up
+ * without blocking whenever the snapshot is read, otherwise the device
+ * list is walked again. The USB strings take a round trip to the device
+ * and are read once, the first time they are asked for.
+ */
+#define MAX_PORT_DEPTH	7
+
+typedef struct usb_entry {
+	libusb_device *device; /* referenced, of the enumeration context */
+	const mirisdr_dongle_t *dongle;
+	uint8_t bus;
+	uint8_t ports[MAX_PORT_DEPTH];
+	int port_num;
+	int have_strings;
+	char manufact[256];
+	char product[256];
+	char serial[256];
+} usb_entry_t;
+
+static struct {
+	pthread_mutex_t lock;
+	libusb_context *ctx;
+	int hotplug;
+	usb_entry_t *entries;
+	uint32_t num;
+	uint32_t size;
+} usb_enum = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, NULL, 0, 0 };
+
+/* devices are numbered by their place on the bus, not by arrival */
+static int usb_entry_cmp(const usb_entry_t *a, const usb_entry_t *b)
+{
+	int i;
+
+	if (a->bus != b->bus)
+		return a->bus - b->bus;
+
+	for (i = 0; i < a->port_num && i < b->port_num; i++) {
+		if (a->ports[i] != b->ports[i])
+			return a->ports[i] - b->ports[i];
+	}
+
+	return a->port_num - b->port_num;
+}
+
+static int usb_entry_find(libusb_device *device)
+{
+	uint32_t i;
+
+	for (i = 0; i < usb_enum.num; i++) {
+		if (usb_enum.entries[i].device == device)
+			return i;
+	}
+
+	return -1;
+}
+
+/* these run with usb_enum.lock held */
+static void usb_enum_add(libusb_device *device)
+{
+	struct libusb_device_descriptor dd;
+	const mirisdr_dongle_t *dongle;
+	usb_entry_t e, *entries;
+	uint32_t i;
+	int r;
+
+	if (usb_entry_find(device) >= 0)
+		return;
+
+	if (libusb_get_device_descriptor(device, &dd) < 0)
+		return;
+
+	dongle = find_known_device(dd.idVendor, dd.idProduct);
+	if (!dongle)
+		return;
+
+	if (usb_enum.num == usb_enum.size) {
+		entries = realloc(usb_enum.entries, (usb_enum.size + 4) *
+				  sizeof(usb_entry_t));
+		if (!entries)
+			return;
+
+		usb_enum.entries = entries;
+		usb_enum.size += 4;
+	}
+
+	memset(&e, 0, sizeof(e));
+	e.device = libusb_ref_device(device);
+	e.dongle = dongle;
+	e.bus = libusb_get_bus_number(device);
+	r = libusb_get_port_numbers(device, e.ports, MAX_PORT_DEPTH);
+	e.port_num = r < 0 ? 0 : r;
+
+	for (i = usb_enum.num; i > 0; i--) {
+		if (usb_entry_cmp(&usb_enum.entries[i - 1], &e) <= 0)
+			break;
+
+		usb_enum.entries[i] = usb_enum.entries[i - 1];
+	}
+
+	usb_enum.entries[i] = e;
+	usb_enum.num++;
+}
+
+static void usb_enum_remove(uint32_t i)
+{
+	libusb_unref_device(usb_enum.entries[i].device);
+
+	usb_enum.num--;
+	memmove(&usb_enum.entries[i], &usb_enum.entries[i + 1],
+		(usb_enum.num - i) * sizeof(usb_entry_t));
+}
+
+static int LIBUSB_CALL usb_enum_hotplug(libusb_context *ctx,
+					libusb_device *device,
+					libusb_hotplug_event event,
+					void *user_data)
+{
+	int i;
+
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		usb_enum_add(device);
+	} else {
+		i = usb_entry_find(device);
+		if (i >= 0)
+			usb_enum_remove(i);
+	}
+
+	return 0;
+}
+
+/* without hotplug, keep what is still there and add what is new */
+static void usb_enum_rescan(void)
+{
+	libusb_device **list;
+	ssize_t cnt, i;
+	uint32_t j;
+
+	cnt = libusb_get_device_list(usb_enum.ctx, &list);
+	if (cnt < 0)
+		return;
+
+	for (j = usb_enum.num; j > 0; j--) {
+		for (i = 0; i < cnt; i++) {
+			if (list[i] == usb_enum.entries[j - 1].device)
+				break;
+		}
+
+		if (i == cnt)
+			usb_enum_remove(j - 1);
+	}
+
+	for (i = 0; i < cnt; i++)
+		usb_enum_add(list[i]);
+
+	libusb_free_device_list(list, 1);
+}
+
+/* bring the snapshot up to date and take the lock */
+static int usb_enum_lock(void)
+{
+	struct timeval tv = { 0, 0 };
+	libusb_hotplug_callback_handle handle;
+	int r;
+
+	pthread_mutex_lock(&usb_enum.lock);
+
+	if (!usb_enum.ctx) {
+		r = libusb_init(&usb_enum.ctx);
+		if (r < 0) {
+			usb_enum.ctx = NULL;
+			pthread_mutex_unlock(&usb_enum.lock);
+			return r;
+		}
+
+		if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+			/* the present devices are reported right away */
+			r = libusb_hotplug_register_callback(usb_enum.ctx,
+				LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+				LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+				LIBUSB_HOTPLUG_ENUMERATE,
+				LIBUSB_HOTPLUG_MATCH_ANY,
+				LIBUSB_HOTPLUG_MATCH_ANY,
+				LIBUSB_HOTPLUG_MATCH_ANY,
+				usb_enum_hotplug, NULL, &handle);
+			usb_enum.hotplug = r == 0;
+		}
+
+		if (!usb_enum.hotplug)
+			usb_enum_rescan();
+	} else if (usb_enum.hotplug) {
+		libusb_handle_events_timeout_completed(usb_enum.ctx, &tv, NULL);
+	} else {
+		usb_enum_rescan();
+	}
+
+	return 0;
+}
+
+static void usb_enum_unlock(void)
+{
+	pthread_mutex_unlock(&usb_enum.lock);
+}
+
+uint32_t mirisdr_usb_get_device_count(void)
+{
+	uint32_t device_count;
+
+	if (usb_enum_lock() < 0)
+		return 0;
+
+	device_count = usb_enum.num;
+
+	usb_enum_unlock();
+
+	return device_count;
+}
+
+const char *mirisdr_usb_get_device_name(uint32_t index)
+{
+	const char *name = "";
+
+	if (usb_enum_lock() < 0)
+		return name;
+
+	if (index < usb_enum.num)
+		name = usb_enum.entries[index].dongle->name;
+
+	usb_enum_unlock();
+
+	return name;
+}
+
+int mirisdr_usb_get_device_usb_strings(uint32_t index, char *manufact,
+				       char *product, char *serial)
+{
+	struct libusb_device_handle *devh;
+	usb_entry_t *e;
+	int r;
+
+	r = usb_enum_lock();
+	if (r < 0)
+		return r;
+
+	if (index >= usb_enum.num) {
+		usb_enum_unlock();
+		return -2;
+	}
+
+	e = &usb_enum.entries[index];
+
+	if (!e->have_strings) {
+		r = libusb_open(e->device, &devh);
+		if (!r) {
+			r = usb_strings(devh, e->manufact, e->product,
+					e->serial);
+			libusb_close(devh);
+		}
+
+		e->have_strings = r == 0;
+	}
+
+	if (e->have_strings) {
+		if (manufact)
+			memcpy(manufact, e->manufact, sizeof(e->manufact));
+		if (product)
+			memcpy(product, e->product, sizeof(e->product));
+		if (serial)
+			memcpy(serial, e->serial, sizeof(e->serial));
+	}
+
+	usb_enum_unlock();
+
+	return r;
+}
+
+static void usb_close(mirisdr_transport_t *t)
+{
+	usb_transport_t *u = (usb_transport_t *)t;
+
+	libusb_release_interface(u->devh, 0);
+	libusb_close(u->devh);
+
+	if (u->own_ctx)
+		libusb_exit(u->ctx);
+
+	free(u);
+}
+
+static int usb_activate(mirisdr_transport_t *t)
+{
+	usb_transport_t *u = (usb_transport_t *)t;
+
+	return libusb_set_interface_alt_setting(u->devh, 0, 1);
+}
+
+static int usb_control(mirisdr_transport_t *t, uint8_t request, uint16_t value,
+		       uint16_t index)
+{
+	usb_transport_t *u = (usb_transport_t *)t;
+
+	return libusb_control_transfer(u->devh, 0x42, request, value, index,
+				       NULL, 0, CTRL_TIMEOUT);
+}
+
+/* a set of control requests in flight */
+typedef struct usb_ctrl_set {
+	usb_transport_t *u;
+	struct libusb_transfer **xfer;
+	unsigned char *setup;
+	int num;
+	int pending;
+	int error;
+	mirisdr_ctrl_cb_t cb;
+	void *cb_ctx;
+} usb_ctrl_set_t;
+
+static void usb_ctrl_set_free(usb_ctrl_set_t *c)
+{
+	int i;
+
+	for (i = 0; i < c->num; i++) {
+		if (c->xfer[i])
+			libusb_free_transfer(c->xfer[i]);
+	}
+
+	free(c->xfer);
+	free(c->setup);
+	free(c);
+}
+
+static void LIBUSB_CALL usb_ctrl_callback(struct libusb_transfer *xfer)
+{
+	usb_ctrl_set_t *c = (usb_ctrl_set_t *)xfer->user_data;
+	usb_transport_t *u = c->u;
+
+	if (xfer->status != LIBUSB_TRANSFER_COMPLETED && !c->error)
+		c->error = xfer->status == LIBUSB_TRANSFER_TIMED_OUT ?
+			   LIBUSB_ERROR_TIMEOUT : LIBUSB_ERROR_IO;
+
+	if (--c->pending)
+		return;
+
+	u->ctrl_pending--;
+	c->cb(c->cb_ctx, c->error);
+	usb_ctrl_set_free(c);
+}
+
+/*
+ * Requests on the control endpoint are carried out in submission order, so
+ * all of them can be in flight at once and cost a single round trip to the
+ * event loop instead of one blocking transfer each.
+ */
+static int usb_ctrl_submit(usb_transport_t *u, const mirisdr_ctrl_t *reqs,
+			   int num, mirisdr_ctrl_cb_t cb, void *ctx,
+			   usb_ctrl_set_t **out)
+{
+	usb_ctrl_set_t *c;
+	int i, r = 0;
+
+	c = calloc(1, sizeof(usb_ctrl_set_t));
+	if (!c)
+		return -ENOMEM;
+
+	c->u = u;
+	c->cb = cb;
+	c->cb_ctx = ctx;
+	c->xfer = calloc(num, sizeof(struct libusb_transfer *));
+	c->setup = malloc(num * LIBUSB_CONTROL_SETUP_SIZE);
+	if (!c->xfer || !c->setup) {
+		usb_ctrl_set_free(c);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < num; i++) {
+		c->xfer[i] = libusb_alloc_transfer(0);
+		if (!c->xfer[i]) {
+			r = LIBUSB_ERROR_NO_MEM;
+			break;
+		}
+
+		c->num++;
+
+		libusb_fill_control_setup(c->setup + i * LIBUSB_CONTROL_SETUP_SIZE,
+					  0x42, reqs[i].request, reqs[i].value,
+					  reqs[i].index, 0);
+		libusb_fill_control_transfer(c->xfer[i], u->devh,
+					     c->setup + i * LIBUSB_CONTROL_SETUP_SIZE,
+					     usb_ctrl_callback, c, CTRL_TIMEOUT);
+
+		r = libusb_submit_transfer(c->xfer[i]);
+		if (r < 0)
+			break;
+
+		c->pending++;
+	}
+
+	/* the requests that made it out still complete, and report the error */
+	if (r < 0) {
+		c->error = r;
+
+		if (!c->pending) {
+			usb_ctrl_set_free(c);
+			return r;
+		}
+	}
+
+	u->ctrl_pending++;
+
+	if (out)
+		*out = c;
+
+	return 0;
+}
+
+static int usb_control_submit(mirisdr_transport_t *t, const mirisdr_ctrl_t *reqs,
+			      int num, mirisdr_ctrl_cb_t cb, void *ctx)
+{
+	if (num <= 0)
+		return 0;
+
+	return usb_ctrl_submit((usb_transport_t *)t, reqs, num, cb, ctx, NULL);
+}
+
+typedef struct usb_batch {
+	int done;
+	int error;
+} usb_batch_t;
+
+static void usb_batch_done(void *ctx, int status)
+{
+	usb_batch_t *b = (usb_batch_t *)ctx;
+
+	b->error = status;
+	b->done = 1;
+}
+
+static int usb_control_batch(mirisdr_transport_t *t, const mirisdr_ctrl_t *reqs,
+			     int num)
+{
+	usb_transport_t *u = (usb_transport_t *)t;
+	usb_ctrl_set_t *c;
+	struct timeval tv = { 1, 0 };
+	usb_batch_t *b;
+	int i, r, err = 0, tries = 0;
+
+	if (num <= 0)
+		return 0;
+
+	/* not on the stack, it is left behind if the set never completes */
+	b = calloc(1, sizeof(usb_batch_t));
+	if (!b)
+		return -ENOMEM;
+
+	r = usb_ctrl_submit(u, reqs, num, usb_batch_done, b, &c);
+	if (r < 0) {
+		free(b);
+		return r;
+	}
+
+	/* a single wait for the whole set */
+	while (!b->done) {
+		r = libusb_handle_events_timeout_completed(u->ctx, &tv, &b->done);
+		if (r >= 0 || r == LIBUSB_ERROR_INTERRUPTED || b->done)
+			continue;
+
+		if (!err) {
+			/* cancel the set, the error is returned once it is done */
+			err = r;
+			for (i = 0; i < c->num; i++)
+				libusb_cancel_transfer(c->xfer[i]);
+		} else if (++tries >= CTRL_EVENT_TRIES) {
+			log_err("control requests still pending, error %d", r);
+			return err;
+		}
+	}
+
+	r = err ? err : b->error;
+	free(b);
+
+	return r;
+}
+
+static int usb_get_usb_strings(mirisdr_transport_t *t, char *manufact,
+			       char *product, char *serial)
+{
+	usb_transport_t *u = (usb_transport_t *)t;
+
+	return usb_strings(u->devh, manufact, product, serial);
+}
+
+static void LIBUSB_CALL usb_callback(struct libusb_transfer *xfer)
+{
+	usb_transport_t *u = (usb_transport_t *)xfer->user_data;
+	int i;
+
+	if (xfer->status != LIBUSB_TRANSFER_CANCELLED && u->pkts) {
+		for (i = 0; i < xfer->num_iso_packets; i++) {
+			u->pkts[i].buf = libusb_get_iso_packet_buffer_simple(xfer, i);
+			u->pkts[i].length = xfer->iso_packet_desc[i].length;
+			u->pkts[i].actual_length = xfer->iso_packet_desc[i].actual_length;
+			u->pkts[i].status = xfer->iso_packet_desc[i].status;
+		}
+
+		u->cb(u->cb_ctx, u->pkts, xfer->num_iso_packets);
+	}
+
+	/* resubmit transfer, unless streaming is being stopped */
+	if (!u->running) {
+		u->pending--;
+	} else if (libusb_submit_transfer(xfer) < 0) {
+		log_err("error re-submitting URB");
+		u->pending--;
+	}
+}
+
+static void usb_stream_free(mirisdr_transport_t *t);
+
+static int usb_stream_start(mirisdr_transport_t *t, uint32_t buf_num,
+			    uint32_t iso_packets, uint32_t packet_len,
+			    uint32_t rate, mirisdr_packets_cb_t cb, void *ctx)
+{
+	usb_transport_t *u = (usb_transport_t *)t;
+	unsigned int i;
+
+	u->xfer = calloc(buf_num, sizeof(struct libusb_transfer *));
+	u->xfer_buf = calloc(buf_num, sizeof(unsigned char *));
+	u->pkts = calloc(iso_packets, sizeof(mirisdr_packet_t));
+	u->xfer_num = buf_num;
+	if (!u->xfer || !u->xfer_buf || !u->pkts)
+		goto err;
+
+	for (i = 0; i < buf_num; i++) {
+		u->xfer[i] = libusb_alloc_transfer(iso_packets);
+		u->xfer_buf[i] = malloc(iso_packets * packet_len);
+		if (!u->xfer[i] || !u->xfer_buf[i])
+			goto err;
+	}
+
+	u->cb = cb;
+	u->cb_ctx = ctx;
+	u->running = 1;
+
+	for (i = 0; i < buf_num; i++) {
+		libusb_fill_iso_transfer(u->xfer[i],
+					 u->devh,
+					 0x81,
+					 u->xfer_buf[i],
+					 iso_packets * packet_len,
+					 iso_packets,
+					 usb_callback,
+					 (void *)u,
+					 ISO_TIMEOUT);
+
+		libusb_set_iso_packet_lengths(u->xfer[i], packet_len);
+
+		if (libusb_submit_transfer(u->xfer[i]) == 0)
+			u->pending++;
+	}
+
+	return 0;
+err:
+	usb_stream_free(t);
+
+	return -ENOMEM;
+}
+
+static int usb_handle_events(mirisdr_transport_t *t, int timeout_ms)
+{
+	usb_transport_t *u = (usb_transport_t *)t;
+	struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+	int r;
+
+	r = libusb_handle_events_timeout(u->ctx, &tv);
+	if (r == LIBUSB_ERROR_INTERRUPTED)
+		return -EINTR;
+
+	return r;
+}
+
+static int usb_stream_cancel(mirisdr_transport_t *t)
+{
+	usb_transport_t *u = (usb_transport_t *)t;
+	unsigned int i;
+
+	u->running = 0;
+
+	for (i = 0; i < u->xfer_num; i++)
+		libusb_cancel_transfer(u->xfer[i]);
+
+	return 0;
+}
+
+static uint32_t usb_stream_pending(mirisdr_transport_t *t)
+{
+	usb_transport_t *u = (usb_transport_t *)t;
+
+	return u->pending + u->ctrl_pending;
+}
+
+static void usb_stream_free(mirisdr_transport_t *t)
+{
+	usb_transport_t *u = (usb_transport_t *)t;
+	unsigned int i;
+	int r;
+
+	/* transfers still owned by libusb may not be freed */
+	if (u->pending || u->ctrl_pending) {
+		usb_stream_cancel(t);
+
+		while (u->pending || u->ctrl_pending) {
+			r = usb_handle_events(t, 100);
+			if (r < 0 && r != -EINTR)
+				break;
+		}
+	}
+
+	u->running = 0;
+
+	if (u->pending) {
+		/* event handling failed, libusb still owns them, leave them be */
+		log_err("%u transfers still pending, not freed", u->pending);
+		u->xfer = NULL;
+		u->xfer_buf = NULL;
+		u->pkts = NULL;
+		u->xfer_num = 0;
+		return;
+	}
+
+	if (u->xfer) {
+		for (i = 0; i < u->xfer_num; i++) {
+			if (u->xfer[i])
+				libusb_free_transfer(u->xfer[i]);
+		}
+
+		free(u->xfer);
+		u->xfer = NULL;
+	}
+
+	if (u->xfer_buf) {
+		for (i = 0; i < u->xfer_num; i++)
+			free(u->xfer_buf[i]);
+
+		free(u->xfer_buf);
+		u->xfer_buf = NULL;
+	}
+
+	free(u->pkts);
+	u->pkts = NULL;
+	u->xfer_num = 0;
+}
+
+static const mirisdr_transport_ops_t usb_ops = {
+	"usb",
+	usb_close,
+	usb_activate,
+	usb_control,
+	usb_control_batch,
+	usb_control_submit,
+	usb_get_usb_strings,
+	usb_stream_start,
+	usb_handle_events,
+	usb_stream_cancel,
+	usb_stream_pending,
+	usb_stream_free
+};
+
+static int usb_open(mirisdr_transport_t **t, uint32_t index,
+		    libusb_context *ctx)
+{
+	int r;
+	int i;
+	libusb_device **list;
+	usb_transport_t *u = NULL;
+	libusb_device *device = NULL;
+	usb_entry_t where;
+	uint8_t ports[MAX_PORT_DEPTH];
+	ssize_t cnt;
+	int n;
+
+	u = calloc(1, sizeof(usb_transport_t));
+	if (NULL == u)
+		return -ENOMEM;
+
+	u->base.ops = &usb_ops;
+
+	if (ctx) {
+		u->ctx = ctx;
+	} else {
+		u->own_ctx = 1;
+		r = libusb_init(&u->ctx);
+		if (r < 0) {
+			log_err("libusb_init error %d", r);
+			u->ctx = NULL;
+			goto err;
+		}
+	}
+
+	/* the same device seen through the context it will run on */
+	r = usb_enum_lock();
+	if (r < 0)
+		goto err;
+
+	if (index >= usb_enum.num) {
+		usb_enum_unlock();
+		r = -1;
+		goto err;
+	}
+
+	where = usb_enum.entries[index];
+	usb_enum_unlock();
+
+	cnt = libusb_get_device_list(u->ctx, &list);
+	if (cnt < 0) {
+		r = (int)cnt;
+		goto err;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		device = list[i];
+
+		if (libusb_get_bus_number(device) == where.bus) {
+			n = libusb_get_port_numbers(device, ports,
+						    MAX_PORT_DEPTH);
+			if (n == where.port_num &&
+			    !memcmp(ports, where.ports, n))
+				break;
+		}
+
+		device = NULL;
+	}
+
+	if (!device) {
+		libusb_free_device_list(list, 1);
+		r = -1;
+		goto err;
+	}
+
+	r = libusb_open(device, &u->devh);
+	if (r < 0) {
+		libusb_free_device_list(list, 1);
+		log_err("usb_open error %d", r);
+		goto err;
+	}
+
+	libusb_free_device_list(list, 1);
+
+	r = libusb_claim_interface(u->devh, 0);
+	if (r < 0) {
+		log_err("usb_claim_interface error %d", r);
+		libusb_close(u->devh);
+		goto err;
+	}
+
+	*t = &u->base;
+
+	return 0;
+err:
+	if (u->own_ctx && u->ctx)
+		libusb_exit(u->ctx);
+
+	free(u);
+
+	return r;
+}
+
+int mirisdr_usb_open(mirisdr_transport_t **t, uint32_t index)
+{
+	return usb_open(t, index, NULL);
+}
+
+struct mirisdr_usb_pool {
+	int num;
+	libusb_context *ctx[];
+};
+
+int mirisdr_usb_pool_create(mirisdr_usb_pool_t **pool, int num)
+{
+	mirisdr_usb_pool_t *p;
+	int i, r;
+
+	p = calloc(1, sizeof(mirisdr_usb_pool_t) + num * sizeof(libusb_context *));
+	if (!p)
+		return -ENOMEM;
+
+	for (i = 0; i < num; i++) {
+		r = libusb_init(&p->ctx[i]);
+		if (r < 0) {
+			log_err("libusb_init error %d", r);
+			p->num = i;
+			mirisdr_usb_pool_destroy(p);
+			return r;
+		}
+	}
+
+	p->num = num;
+	*pool = p;
+
+	return 0;
+}
+
+void mirisdr_usb_pool_destroy(mirisdr_usb_pool_t *pool)
+{
+	int i;
+
+	for (i = 0; i < pool->num; i++)
+		libusb_exit(pool->ctx[i]);
+
+	free(pool);
+}
+
+int mirisdr_usb_pool_handle_events(mirisdr_usb_pool_t *pool, int shard,
+				   int timeout_ms)
+{
+	struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+	int r;
+
+	r = libusb_handle_events_timeout(pool->ctx[shard], &tv);
+	if (r == LIBUSB_ERROR_INTERRUPTED)
+		return -EINTR;
+
+	return r;
+}
+
+int mirisdr_usb_pool_open(mirisdr_transport_t **t, uint32_t index,
+			  mirisdr_usb_pool_t *pool, int shard)
+{
+	return usb_open(t, index, pool->ctx[shard]);
+}
@@ -19,9 +19,9 @@
 
 #include "tuner_msi001.h"
 #include "mirisdr_reg.h"
+#include "mirisdr_log.h"
 
 #include <stdint.h>
-#include <stdio.h>
 #include <memory.h>
 
 static const struct r0_modes_ r0_modes[] = {
@@ -42,17 +42,33 @@ static const struct iffreqs_ iffreqs[] = {
 	{MHZ(38.4),		MHZ(38.4)/2,		MHZ(38.4) * 3.5}
 };
 
+/* wanted synthesizer step at the LO, sets the fractional threshold */
+#define FRAC_STEP	KHZ(1000)
+
 static void writereg(void *dev, uint8_t reg, uint32_t val) {
-	fprintf(stderr, "%u 0x%08x\n", reg, val);
+	log_dbg("%u 0x%08x", reg, val);
 	mirisdr_reg_write_fn(dev, 0x09, val);
 }
 
-static int set_reg0(void *dev, struct state* s) {
+static enum mode band_sel(uint32_t freq) {
+	if (freq < MHZ(30))
+		return AM_MODE1;
+	else if (freq < MHZ(140))
+		return VHF_MODE;
+	else if (freq < MHZ(300))
+		return B3_MODE;
+	else if (freq < MHZ(970))
+		return B45_MODE;
+	else
+		return BL_MODE;
+}
+
+static uint32_t calc_reg0(struct msi001_plan *p) {
 	uint32_t reg0=0;
 
-	reg0 = r0_modes[s->m].value << 4;
+	reg0 = r0_modes[p->m].value << 4;
 
-	if (s->m == AM_MODE1 || s->m == AM_MODE1) {
+	if (p->m == AM_MODE1) {
 		reg0 |= FIL_MODE_450K_IF << R0_FIL_MODE_SH;
 		reg0 |= 0x1 << R0_FIL_BW_SH;//hack filter bw
 	} else {
@@ -60,53 +76,44 @@ static int set_reg0(void *dev, struct state* s) {
 		reg0 |= 0x7 << R0_FIL_BW_SH;//hack filter bw
 	}
 
-	reg0 |= s->x << R0_XTAL_SEL_SH;
+	reg0 |= p->x << R0_XTAL_SEL_SH;
 
-	writereg(dev, 0, reg0);
-	s->reg[0] = reg0;
-	return 0;
+	return reg0;
 }
 
-static int set_reg52 (void *dev, struct state* s) {
-	uint32_t reg5=5;
-	uint32_t reg2=2;
-	float i_want_a_fracstep = 1000e3;
-
-	float f_if=0, fsynth,synthstep;
-	uint32_t thresh,int_,frac;
-
-	if (s->m == AM_MODE1 || s->m == AM_MODE1) {
-		f_if = 450e3;
-		fsynth = (iffreqs[s->x].fif1 - s->freq_hz + f_if) * r0_modes[s->m].lodiv;
-		fprintf(stderr, "wtf is if2?");
+/*
+ * LO = fref / lodiv * (int + frac / thresh), all in integer Hz so the
+ * result is exact and does not depend on float rounding.
+ */
+static int calc_reg52(struct msi001_plan *p) {
+	uint32_t fref = iffreqs[p->x].fref1 * 4;
+	uint32_t lodiv = r0_modes[p->m].lodiv;
+	uint32_t thresh, int_, frac;
+	uint64_t fsynth;
+
+	if (p->m == AM_MODE1) {
+		log_warn("wtf is if2?");
 		return -1;
-	} else {
-		fsynth = (s->freq_hz + f_if) * r0_modes[s->m].lodiv;
 	}
-	synthstep = i_want_a_fracstep * r0_modes[s->m].lodiv;
-	thresh = (iffreqs[s->x].fref1*4)/synthstep;
-	
-	reg5 |= 0x28 << 16;
-	reg5 |= (uint32_t)thresh << 4;
 
-	int_ = fsynth/(iffreqs[s->x].fref1*4);//ROUNDDOWN?
-	frac = ((fsynth/(iffreqs[s->x].fref1*4)) - int_)*thresh;
+	/* zero IF */
+	fsynth = (uint64_t)p->freq_hz * lodiv;
+	thresh = fref / (FRAC_STEP * lodiv);
 
-	reg2 |= frac << 4;
-	reg2 |= int_ << R2_INT_SH;
+	int_ = fsynth / fref;
+	/* nearest fractional step, it may carry into the integer part */
+	frac = ((fsynth % fref) * thresh + fref / 2) / fref;
+	if (frac == thresh) {
+		int_++;
+		frac = 0;
+	}
 
-	fprintf(stderr, "fsynth %fmhz synthstep %e thresh %u int_ %u frac %u // frac step value: %f\n", fsynth/1e6, synthstep, thresh, int_, frac, i_want_a_fracstep);
-	writereg(dev, 5, reg5);
-	writereg(dev, 2, reg2);
+	p->reg5 = 5 | 0x28 << 16 | thresh << 4;
 	/* bit 19 and 21 must be set */
-	s->reg[5] = reg5;
-	s->reg[2] = reg2;
-	return 0;
-}
+	p->reg2 = 2 | frac << 4 | int_ << R2_INT_SH;
+	p->lo_hz = ((uint64_t)fref * (int_ * thresh + frac)) / ((uint64_t)lodiv * thresh);
 
-static void setfreqs(void *dev, struct state* s) {
-	c(set_reg0(dev, s));
-	c(set_reg52(dev, s));
+	return 0;
 }
 
 static int setgains(void *dev, struct state* s) {
@@ -133,52 +140,67 @@ static int setgains(void *dev, struct state* s) {
 	return 0;
 }
 
-static void checkfreq(void *dev, struct state* s) {
-	uint32_t freq = (iffreqs[s->x].fref1*4)/r0_modes[s->m].lodiv;
-	uint32_t frac = (s->reg[2] >> 4) & ((1<<12)-1);
-	uint32_t int_ = (s->reg[2] >> R2_INT_SH) & ((1<<6)-1);
-	uint32_t thresh = (s->reg[5] >> 4) & ((1<<12)-1);
-	double res = freq * (float)((float)int_ + ((float)((frac << 12) +0)/(float)(thresh << 12) ));
-	float fstep = (float)(iffreqs[s->x].fref1 * 4)/ r0_modes[s->m].lodiv * thresh;
-	fprintf(stderr, "freq %u thresh %u int %u frac %u res: %fmhz\n", freq, thresh, int_, frac, res/1e6);
-	fprintf(stderr, "+1 frac res: %fmhz\n", freq * (float)((float)int_ + ((float)(((frac+1) << 12) +0)/(float)(thresh << 12) )) /1e6);
-	fprintf(stderr, "-1 frac res: %fmhz\n", freq * (float)((float)int_ + ((float)(((frac-1) << 12) +0)/(float)(thresh << 12) )) /1e6);
+void msi001_reset(struct state *s)
+{
+	memset(s, 0, sizeof(*s));
+
+	s->x = XTAL24_576M;//xtal freq
+	s->minus_bbgain = 20;//gain reduction: 0-59dB
+	s->am_mixgainred = r1_mixbu_p0_12;// ignored & reset except in am mode
+	s->mixl = 0;// bool, table 6-11
+	s->lnagr = 0;// bool, table 6-11
+
+//	c(setgains(dev, s));
+	//no dc track timing
+	//no aux features
+	// AFC?
 }
 
-int msi001_init(void *dev, uint32_t freq)
+int msi001_plan(const struct state *s, uint32_t freq, struct msi001_plan *p)
 {
-	struct state curstate;
-
-	memset(&curstate,0,sizeof(curstate));
+	memset(p, 0, sizeof(*p));
 
-	//band sel
-	if (freq < MHZ(30))
-		curstate.m = AM_MODE1;
-	else if (freq < MHZ(140))
-		curstate.m = VHF_MODE;
-	else if (freq < MHZ(300))
-		curstate.m = B3_MODE;
-	else if (freq < MHZ(970))
-		curstate.m = B45_MODE;
-	else
-		curstate.m = BL_MODE;
+	p->freq_hz = freq;
+	p->m = band_sel(freq);
+	p->x = s->x;
+	p->reg0 = calc_reg0(p);
 
-	curstate.x = XTAL24_576M;//xtal freq
-	curstate.freq_hz= freq;
+	return calc_reg52(p);
+}
 
-	setfreqs(dev, &curstate);
+int msi001_apply(void *dev, struct state *s, const struct msi001_plan *p)
+{
+	/* same band and crystal, only the PLL INT/FRAC word changes */
+	if (!s->valid || s->m != p->m || s->x != p->x) {
+		s->valid = 0;
+		writereg(dev, 0, p->reg0);
+		writereg(dev, 5, p->reg5);
+		s->m = p->m;
+		s->x = p->x;
+		s->reg[0] = p->reg0;
+		s->reg[5] = p->reg5;
+	}
 
-	curstate.minus_bbgain = 20;//gain reduction: 0-59dB
-	curstate.am_mixgainred = r1_mixbu_p0_12;// ignored & reset except in am mode
-	curstate.mixl = 0;// bool, table 6-11
-	curstate.lnagr = 0;// bool, table 6-11
+	writereg(dev, 2, p->reg2);
+	s->reg[2] = p->reg2;
+	s->freq_hz = p->freq_hz;
+	s->valid = 1;
 
-//	c(setgains(dev, &curstate));
-	//no dc track timing
-	//no aux features
-	// AFC?
+	log_dbg("freq %u lo %u int %u frac %u thresh %u", p->freq_hz, p->lo_hz,
+		(p->reg2 >> R2_INT_SH) & ((1<<6)-1), (p->reg2 >> 4) & ((1<<12)-1),
+		(p->reg5 >> 4) & ((1<<12)-1));
 
-	checkfreq(dev, &curstate);
 	return 0;
 }
 
+int msi001_tune(void *dev, struct state *s, uint32_t freq)
+{
+	struct msi001_plan p;
+	int r;
+
+	r = msi001_plan(s, freq, &p);
+	if (r < 0)
+		return r;
+
+	return msi001_apply(dev, s, &p);
+}